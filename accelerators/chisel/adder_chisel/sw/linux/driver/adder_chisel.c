@@ -52,8 +52,8 @@ static void adder_prep_xfer(struct esp_device *esp, void *arg)
 	iowrite32be(a->size, esp->iomem + ADDER_SIZE_REG);
 	iowrite32be(a->writeAddr, esp->iomem + ADDER_WRITEADDR_REG);
 
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -113,6 +113,7 @@ static struct esp_driver adder_driver = {
 	.prep_xfer	= adder_prep_xfer,
 	.ioctl_cm	= ADDER_CHISEL_IOC_ACCESS,
 	.arg_size	= sizeof(struct adder_chisel_access),
+	.xfer_window	= true,
 };
 
 static int __init adder_init(void)
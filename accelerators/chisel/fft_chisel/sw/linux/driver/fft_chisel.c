@@ -51,8 +51,8 @@ static void fft_prep_xfer(struct esp_device *esp, void *arg)
 	iowrite32be(a->stride, esp->iomem + FFT_STRIDE_REG);
 	iowrite32be(1, esp->iomem + FFT_COUNT_REG);
 	iowrite32be(0, esp->iomem + FFT_STARTADDR_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -112,6 +112,7 @@ static struct esp_driver fft_driver = {
 	.prep_xfer	= fft_prep_xfer,
 	.ioctl_cm	= FFT_CHISEL_IOC_ACCESS,
 	.arg_size	= sizeof(struct fft_chisel_access),
+	.xfer_window	= true,
 };
 
 static int __init fft_init(void)
@@ -47,8 +47,8 @@ static void cholesky_prep_xfer(struct esp_device *esp, void *arg)
 
 	/* <<--regs-config-->> */
 	iowrite32be(a->rows, esp->iomem + CHOLESKY_ROWS_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -111,6 +111,7 @@ static struct esp_driver cholesky_driver = {
 	.prep_xfer	= cholesky_prep_xfer,
 	.ioctl_cm	= CHOLESKY_STRATUS_IOC_ACCESS,
 	.arg_size	= sizeof(struct cholesky_stratus_access),
+	.xfer_window	= true,
 };
 
 static int __init cholesky_init(void)
@@ -63,8 +63,8 @@ static void conv2d_prep_xfer(struct esp_device *esp, void *arg)
 	iowrite32be(a->do_relu, esp->iomem + CONV2D_DO_RELU_REG);
 	iowrite32be(a->pool_type, esp->iomem + CONV2D_POOL_TYPE_REG);
 	iowrite32be(a->batch_size, esp->iomem + CONV2D_BATCH_SIZE_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 }
 
 static bool conv2d_xfer_input_ok(struct esp_device *esp, void *arg)
@@ -123,6 +123,7 @@ static struct esp_driver conv2d_driver = {
 	.prep_xfer	= conv2d_prep_xfer,
 	.ioctl_cm	= CONV2D_STRATUS_IOC_ACCESS,
 	.arg_size	= sizeof(struct conv2d_stratus_access),
+	.xfer_window	= true,
 };
 
 static int __init conv2d_init(void)
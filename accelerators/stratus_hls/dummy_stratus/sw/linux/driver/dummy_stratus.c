@@ -47,8 +47,8 @@ static void dummy_prep_xfer(struct esp_device *esp, void *arg)
 
 	iowrite32be(a->tokens, esp->iomem + DUMMY_LEN_REG);
 	iowrite32be(a->batch, esp->iomem + DUMMY_BATCH_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -108,6 +108,7 @@ static struct esp_driver dummy_driver = {
 	.prep_xfer	= dummy_prep_xfer,
 	.ioctl_cm	= DUMMY_STRATUS_IOC_ACCESS,
 	.arg_size	= sizeof(struct dummy_stratus_access),
+	.xfer_window	= true,
 };
 
 static int __init dummy_init(void)
@@ -53,8 +53,8 @@ static void fft2_prep_xfer(struct esp_device *esp, void *arg)
 	iowrite32be(a->logn_samples, esp->iomem + FFT2_LOGN_SAMPLES_REG);
 	iowrite32be(a->do_shift, esp->iomem + FFT2_DO_SHIFT_REG);
 	iowrite32be(a->num_ffts, esp->iomem + FFT2_NUM_FFTS_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -114,6 +114,7 @@ static struct esp_driver fft2_driver = {
 	.prep_xfer	= fft2_prep_xfer,
 	.ioctl_cm	= FFT2_STRATUS_IOC_ACCESS,
 	.arg_size	= sizeof(struct fft2_stratus_access),
+	.xfer_window	= true,
 };
 
 static int __init fft2_init(void)
@@ -53,8 +53,8 @@ static void fft_prep_xfer(struct esp_device *esp, void *arg)
 	iowrite32be(a->batch_size, esp->iomem + FFT_BATCH_SIZE_REG);
 	iowrite32be(a->do_bitrev, esp->iomem + FFT_DO_BITREV_REG);
 	iowrite32be(a->log_len, esp->iomem + FFT_LOG_LEN_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 }
 
 static bool fft_xfer_input_ok(struct esp_device *esp, void *arg)
@@ -113,6 +113,7 @@ static struct esp_driver fft_driver = {
 	.prep_xfer	= fft_prep_xfer,
 	.ioctl_cm	= FFT_STRATUS_IOC_ACCESS,
 	.arg_size	= sizeof(struct fft_stratus_access),
+	.xfer_window	= true,
 };
 
 static int __init fft_init(void)
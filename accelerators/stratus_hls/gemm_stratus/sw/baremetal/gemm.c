@@ -244,7 +244,7 @@ int main(int argc, char * argv[])
 			iowrite32(dev, SELECT_REG, ioread32(dev, DEVID_REG));
 			iowrite32(dev, COHERENCE_REG, coherence);
 
-			iowrite32(dev, PT_ADDRESS_REG, (unsigned long) ptable);
+			esp_set_pt_address(dev, ptable);
 
 			iowrite32(dev, PT_NCHUNK_REG, NCHUNK(mem_size));
 			iowrite32(dev, PT_SHIFT_REG, CHUNK_SHIFT);
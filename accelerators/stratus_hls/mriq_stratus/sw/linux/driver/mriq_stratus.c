@@ -55,8 +55,8 @@ static void mriq_prep_xfer(struct esp_device *esp, void *arg)
 	iowrite32be(a->batch_size_k, esp->iomem + MRIQ_BATCH_SIZE_K_REG);
 	iowrite32be(a->num_batch_x, esp->iomem + MRIQ_NUM_BATCH_X_REG);
 	iowrite32be(a->batch_size_x, esp->iomem + MRIQ_BATCH_SIZE_X_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -116,6 +116,7 @@ static struct esp_driver mriq_driver = {
 	.prep_xfer	= mriq_prep_xfer,
 	.ioctl_cm	= MRIQ_STRATUS_IOC_ACCESS,
 	.arg_size	= sizeof(struct mriq_stratus_access),
+	.xfer_window	= true,
 };
 
 static int __init mriq_init(void)
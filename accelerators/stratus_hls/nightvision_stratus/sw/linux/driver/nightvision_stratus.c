@@ -52,8 +52,8 @@ static void nightvision_prep_xfer(struct esp_device *esp, void *arg)
     iowrite32be(a->rows, esp->iomem + NIGHTVISION_ROWS_REG);
     iowrite32be(a->cols, esp->iomem + NIGHTVISION_COLS_REG);
     iowrite32be(a->do_dwt, esp->iomem + NIGHTVISION_DO_DWT_REG);
-    iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-    iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+    iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+    iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 }
 
 static bool nightvision_xfer_input_ok(struct esp_device *esp, void *arg)
@@ -125,6 +125,7 @@ static struct esp_driver nightvision_driver = {
     .prep_xfer     = nightvision_prep_xfer,
     .ioctl_cm      = NIGHTVISION_STRATUS_IOC_ACCESS,
     .arg_size      = sizeof(struct nightvision_stratus_access),
+    .xfer_window   = true,
 };
 
 static int __init nightvision_init(void) { return esp_driver_register(&nightvision_driver); }
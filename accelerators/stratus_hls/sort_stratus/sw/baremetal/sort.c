@@ -151,7 +151,7 @@ int main(int argc, char * argv[])
 			iowrite32(dev, COHERENCE_REG, coherence);
 
 			if (scatter_gather) {
-				iowrite32(dev, PT_ADDRESS_REG, (unsigned long) ptable);
+				esp_set_pt_address(dev, ptable);
 				iowrite32(dev, PT_NCHUNK_REG, NCHUNK);
 				iowrite32(dev, PT_SHIFT_REG, CHUNK_SHIFT);
 				iowrite32(dev, SRC_OFFSET_REG, 0);
@@ -171,6 +171,8 @@ static void config_threads(FILE* f, accelerator_thread_info_t **thread_info, esp
             thread_info[t]->alloc_choice = CONTIG_ALLOC_LEAST_LOADED;
         } else if (!strcmp(alloc_choice, "balanced")){  
             thread_info[t]->alloc_choice = CONTIG_ALLOC_BALANCED;
+        } else if (!strcmp(alloc_choice, "interleaved")){
+            thread_info[t]->alloc_choice = CONTIG_ALLOC_INTERLEAVED;
         }
 
         size_t in_size;  
@@ -321,6 +323,8 @@ static void alloc_phase(accelerator_thread_info_t **thread_info, esp_thread_info
     for (int i = 0; i < nthreads; i++){
         struct contig_alloc_params params; 
 
+        memset(&params, 0, sizeof(params));
+
         if (alloc_mode == CFG){
             params.policy = thread_info[i]->alloc_choice;
         } 
@@ -451,6 +455,8 @@ static void dump_results(FILE* out_file, accelerator_thread_info_t **thread_info
                 fprintf(out_file,"preferred,");
             else if (thread_info[t]->alloc_choice == CONTIG_ALLOC_LEAST_LOADED)
                 fprintf(out_file,"lloaded,");
+            else if (thread_info[t]->alloc_choice == CONTIG_ALLOC_INTERLEAVED)
+                fprintf(out_file,"interleaved,");
 
             fprintf(out_file, "%d,", synth_cfg[t][d].esp.footprint); 
 
@@ -466,6 +472,8 @@ static void dump_results(FILE* out_file, accelerator_thread_info_t **thread_info
             fprintf(out_file,"preferred,");
         else if (thread_info[t]->alloc_choice == CONTIG_ALLOC_LEAST_LOADED)
             fprintf(out_file,"lloaded,");
+        else if (thread_info[t]->alloc_choice == CONTIG_ALLOC_INTERLEAVED)
+            fprintf(out_file,"interleaved,");
         
         fprintf(out_file, "%zu,", thread_info[t]->memsz);
         phase_size += thread_info[t]->memsz; 
@@ -553,6 +561,10 @@ int main (int argc, char** argv)
         alloc_mode = FIXED;
         alloc = CONTIG_ALLOC_BALANCED;
     }
+    else if (!strcmp(argv[3], "interleaved")){
+        alloc_mode = FIXED;
+        alloc = CONTIG_ALLOC_INTERLEAVED;
+    }
     else if (!strcmp(argv[3], "auto")){
         alloc_mode = AUTO;
         alloc = ACC_COH_AUTO;
@@ -561,7 +573,7 @@ int main (int argc, char** argv)
         alloc_mode = CFG;
     }
     else{
-        printf("Valid alloc choices include preferred, lloaded, balanced, auto, and cfg\n");
+        printf("Valid alloc choices include preferred, lloaded, balanced, interleaved, auto, and cfg\n");
         return 1;
     }
 
@@ -51,8 +51,8 @@ static void vitdodec_prep_xfer(struct esp_device *esp, void *arg)
 	iowrite32be(a->cbps, esp->iomem + VITDODEC_CBPS_REG);
 	iowrite32be(a->ntraceback, esp->iomem + VITDODEC_NTRACEBACK_REG);
 	iowrite32be(a->data_bits, esp->iomem + VITDODEC_DATA_BITS_REG);
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -112,6 +112,7 @@ static struct esp_driver vitdodec_driver = {
 	.prep_xfer	= vitdodec_prep_xfer,
 	.ioctl_cm	= VITDODEC_STRATUS_IOC_ACCESS,
 	.arg_size	= sizeof(struct vitdodec_stratus_access),
+	.xfer_window	= true,
 };
 
 static int __init vitdodec_init(void)
@@ -0,0 +1,284 @@
+// Copyright (c) 2011-2022 Columbia University, System Level Design Group
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Microbenchmark for the per-invocation overhead of libesp. Each mode
+ * invokes a tiny dummy_stratus job ITERS times and reports the average
+ * wall-clock time per invocation. The submit/reap mode keeps the kernel
+ * submission queue of the device full, so the next invocation starts from
+ * the interrupt handler of the previous one. The stream mode rotates
+ * STREAM_BUFS buffers so that filling and checking frames overlaps the
+ * accelerator, and reports the frame rate and accelerator idle time.
+ */
+#include <errno.h>
+
+#include "libesp.h"
+#include "esp_bench_cfg.h"
+
+#define DEFAULT_ITERS 1000
+#define STREAM_BUFS 3
+
+static const char usage_str[] = "Usage:\n"
+	"./esp_bench.exe [iterations]\n"
+	"  iterations is the number of invocations per mode (default 1000).\n";
+
+static unsigned out_offset;
+static unsigned size;
+
+static void init_buffer(token_t *buf)
+{
+	int i;
+
+	for (i = 0; i < TOKENS * BATCH; i++)
+		buf[i] = 0xFEED0BAC00000000ULL | i;
+	for (i = 0; i < TOKENS * BATCH; i++)
+		buf[out_offset / sizeof(token_t) + i] = 0;
+}
+
+static int validate_buffer(token_t *buf)
+{
+	int i;
+	int errors = 0;
+
+	for (i = 0; i < TOKENS * BATCH; i++)
+		if (buf[out_offset / sizeof(token_t) + i] != (0xFEED0BAC00000000ULL | i))
+			errors++;
+	return errors;
+}
+
+static void print_result(const char *mode, unsigned long long ns, unsigned iters, int errors)
+{
+	printf("  %-12s %10llu ns/invocation (%u invocations, %s)\n",
+		mode, ns / iters, iters, errors ? "FAIL" : "PASS");
+}
+
+/* Current path: open, spawn, join and close on every invocation */
+static unsigned long long bench_esp_run(unsigned iters)
+{
+	struct timespec th_start;
+	struct timespec th_end;
+	int stdout_fd;
+	int null_fd;
+	int i;
+
+	/* esp_run() prints its timing on every call: keep it out of the way */
+	fflush(stdout);
+	stdout_fd = dup(STDOUT_FILENO);
+	null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+
+	gettime(&th_start);
+	for (i = 0; i < iters; i++)
+		esp_run(cfg_000, NACC);
+	gettime(&th_end);
+
+	fflush(stdout);
+	dup2(stdout_fd, STDOUT_FILENO);
+	close(null_fd);
+	close(stdout_fd);
+
+	return ts_subtract(&th_start, &th_end);
+}
+
+static unsigned long long bench_session(unsigned iters)
+{
+	struct timespec th_start;
+	struct timespec th_end;
+	esp_session_t *session;
+	int i;
+
+	session = esp_session_open(NACC);
+	if (session == NULL)
+		die_errno("esp_session_open");
+
+	/* Warm-up: open the device files */
+	esp_session_submit(session, cfg_000, NACC);
+
+	gettime(&th_start);
+	for (i = 0; i < iters; i++)
+		if (esp_session_submit(session, cfg_000, NACC))
+			break;
+	gettime(&th_end);
+
+	esp_session_close(session);
+
+	return ts_subtract(&th_start, &th_end);
+}
+
+/* Validate once with ESP_IOC_PREPARE, then only run */
+static unsigned long long bench_prepared(unsigned iters)
+{
+	struct timespec th_start;
+	struct timespec th_end;
+	esp_prepared_t *prep;
+	int i;
+
+	prep = esp_prepare(&cfg_000[0]);
+	if (prep == NULL)
+		die_errno("esp_prepare");
+
+	gettime(&th_start);
+	for (i = 0; i < iters; i++)
+		if (esp_run_prepared(prep))
+			die_errno("esp_run_prepared");
+	gettime(&th_end);
+
+	esp_release_prepared(prep);
+
+	return ts_subtract(&th_start, &th_end);
+}
+
+/* Keep the device submission queue full with ESP_IOC_SUBMIT/ESP_IOC_REAP */
+static unsigned long long bench_queue(unsigned iters)
+{
+	struct esp_job_desc jobs[ESP_QUEUE_DEPTH];
+	struct esp_job_done done[ESP_QUEUE_DEPTH];
+	struct esp_submit_req submit;
+	struct esp_reap_req reap;
+	struct timespec th_start;
+	struct timespec th_end;
+	esp_thread_info_t *cfg[] = { cfg_000 };
+	unsigned nacc[] = { NACC };
+	unsigned submitted = 0;
+	unsigned completed = 0;
+	unsigned inflight = 0;
+	char path[70];
+	int fd;
+	int i;
+
+	esp_config(cfg, 1, nacc);
+
+	snprintf(path, sizeof(path), "/dev/%s", cfg_000[0].devname);
+	fd = open(path, O_RDWR, 0);
+	if (fd < 0)
+		die_errno("open");
+
+	for (i = 0; i < ESP_QUEUE_DEPTH; i++) {
+		jobs[i].access = cfg_000[0].esp_desc;
+		jobs[i].tag = i;
+	}
+
+	gettime(&th_start);
+	while (completed < iters) {
+		submit.jobs = jobs;
+		submit.n = ESP_QUEUE_DEPTH - inflight;
+		if (submit.n > iters - submitted)
+			submit.n = iters - submitted;
+		if (submit.n) {
+			if (ioctl(fd, ESP_IOC_SUBMIT, &submit) && errno != EAGAIN)
+				die_errno("ESP_IOC_SUBMIT");
+			submitted += submit.n_submitted;
+			inflight += submit.n_submitted;
+		}
+
+		reap.done = done;
+		reap.n_max = ESP_QUEUE_DEPTH;
+		reap.min_complete = 1;
+		if (ioctl(fd, ESP_IOC_REAP, &reap))
+			die_errno("ESP_IOC_REAP");
+		for (i = 0; i < reap.n; i++)
+			if (done[i].err)
+				die("invocation %llu failed\n", (unsigned long long) done[i].tag);
+		completed += reap.n;
+		inflight -= reap.n;
+	}
+	gettime(&th_end);
+
+	close(fd);
+
+	return ts_subtract(&th_start, &th_end);
+}
+
+static int stream_fill(void *in, unsigned long long frame, void *arg)
+{
+	token_t *buf = in;
+	int i;
+
+	for (i = 0; i < TOKENS * BATCH; i++)
+		buf[i] = (frame << 32) | i;
+	return 0;
+}
+
+static int stream_drain(void *out, unsigned long long frame, void *arg)
+{
+	token_t *buf = out;
+	int *errors = arg;
+	int i;
+
+	for (i = 0; i < TOKENS * BATCH; i++)
+		if (buf[i] != ((frame << 32) | i))
+			(*errors)++;
+	return 0;
+}
+
+static unsigned long long bench_stream(unsigned iters, int *errors, struct esp_stream_stats *stats)
+{
+	esp_stream_t *stream;
+
+	stream = esp_stream_open(&cfg_000[0], sizeof(dummy_cfg_000[0]), STREAM_BUFS,
+				out_offset, out_offset);
+	if (stream == NULL)
+		die_errno("esp_stream_open");
+
+	*errors = 0;
+	if (esp_stream_run(stream, iters, stream_fill, stream_drain, errors))
+		die("esp_stream_run failed\n");
+	esp_stream_get_stats(stream, stats);
+	esp_stream_close(stream);
+
+	return stats->elapsed_ns;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned iters = DEFAULT_ITERS;
+	unsigned long long ns;
+	token_t *buf;
+	struct esp_stream_stats stats;
+	int errors;
+
+	if (argc > 2) {
+		fprintf(stderr, "%s", usage_str);
+		return 1;
+	}
+	if (argc == 2)
+		iters = strtoul(argv[1], NULL, 0);
+	if (iters == 0)
+		iters = 1;
+
+	out_offset = TOKENS * BATCH * sizeof(token_t);
+	size = 2 * out_offset;
+
+	buf = (token_t *) esp_alloc(size);
+	cfg_000[0].hw_buf = buf;
+
+	printf("\n====== libesp invocation overhead ======\n\n");
+	printf("  .tokens = %d\n", TOKENS);
+	printf("  .batch = %d\n", BATCH);
+	printf("\n");
+
+	init_buffer(buf);
+	ns = bench_esp_run(iters);
+	print_result("esp_run", ns, iters, validate_buffer(buf));
+
+	init_buffer(buf);
+	ns = bench_session(iters);
+	print_result("session", ns, iters, validate_buffer(buf));
+
+	init_buffer(buf);
+	ns = bench_prepared(iters);
+	print_result("prepared", ns, iters, validate_buffer(buf));
+
+	init_buffer(buf);
+	ns = bench_queue(iters);
+	print_result("submit/reap", ns, iters, validate_buffer(buf));
+
+	ns = bench_stream(iters, &errors, &stats);
+	print_result("stream", ns, iters, errors);
+	printf("  %-12s %10.0f frames/s, accelerator idle %.1f%%\n", "", stats.fps, stats.idle * 100);
+
+	printf("\n============\n\n");
+
+	esp_free(buf);
+
+	return 0;
+}
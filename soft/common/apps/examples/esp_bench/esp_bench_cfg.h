@@ -0,0 +1,40 @@
+// Copyright (c) 2011-2022 Columbia University, System Level Design Group
+// SPDX-License-Identifier: Apache-2.0
+#ifndef __ESP_BENCH_CFG_H__
+#define __ESP_BENCH_CFG_H__
+
+#include "libesp.h"
+#include "dummy_stratus.h"
+
+typedef unsigned long long token_t;
+
+/* <<--params-def-->> */
+#define TOKENS 8
+#define BATCH 1
+
+#define NACC 1
+
+struct dummy_stratus_access dummy_cfg_000[] = {
+	{
+		/* <<--descriptor-->> */
+		.tokens = TOKENS,
+		.batch = BATCH,
+		.src_offset = 0,
+		.dst_offset = TOKENS * BATCH * sizeof(token_t),
+		.esp.coherence = ACC_COH_FULL,
+		.esp.p2p_store = 0,
+		.esp.p2p_nsrcs = 0,
+		.esp.p2p_srcs = {"", "", "", ""},
+	}
+};
+
+esp_thread_info_t cfg_000[] = {
+	{
+		.run = true,
+		.devname = "dummy_stratus.0",
+		.ioctl_req = DUMMY_STRATUS_IOC_ACCESS,
+		.esp_desc = &(dummy_cfg_000[0].esp),
+	}
+};
+
+#endif /* __ESP_BENCH_CFG_H__ */
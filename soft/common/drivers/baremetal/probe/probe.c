@@ -297,6 +297,15 @@ void iowrite32(struct esp_device *dev, unsigned offset, unsigned payload)
 	*reg = payload;
 }
 
+/* Program the page table address, including the bits above 32 */
+void esp_set_pt_address(struct esp_device *dev, void *ptable)
+{
+	unsigned long long addr = (uintptr_t) ptable;
+
+	iowrite32(dev, PT_ADDRESS_REG, (unsigned) addr);
+	iowrite32(dev, PT_ADDRESS_EXTENDED_REG, (unsigned) (addr >> 32));
+}
+
 void esp_p2p_init(struct esp_device *dev, struct esp_device **srcs, unsigned nsrcs)
 {
 	unsigned i;
@@ -15,6 +15,26 @@
  *          DDR devices. Ignored for bigphysarea.
  * - size: Array with the size in bytes of each memory region.
  * - chunk_log: log2 of the size of each memory chunk. Default: 20 (i.e. 1MB).
+ * Optionally, classes lists the log2 of larger chunk sizes, in increasing
+ * order, e.g. classes=20,24 with chunk_log=16 for 64KB, 1MB and 16MB chunks.
+ * A chunk of a larger class is an aligned run of chunk_log chunks, so every
+ * class draws from the whole region. Each buffer uses a single class, picked
+ * from its size unless the caller asks for one.
+ * Optionally, ddr_y and ddr_x hold the NoC coordinates of the memory tile of
+ * each DDR device, for the least-busy policy and for user space to estimate
+ * the distance between accelerators and buffers. With mon_base, the physical
+ * address of the tile monitors, and noc_cols, the number of NoC columns, the
+ * traffic of each DDR device is sampled every mon_period_ms from the DDR and
+ * DMA request counters of its memory tile.
+ * Each buffer is laid out in runs of physically adjacent chunks where the
+ * free memory allows it; the fragmentation sysfs attribute of the device
+ * tells how well that works.
+ * Reservations set chunks of one DDR device aside for the files attached to
+ * them, so that other clients cannot exhaust the memory of, e.g., a real-time
+ * pipeline. The reserve parameter creates them at load time as a list of
+ * name:size[:node], e.g. reserve=rt:64M:1; CONTIG_IOC_RESV_CREATE creates
+ * them later. Outside of reservations, a file can allocate up to its quota,
+ * which starts at file_quota bytes (0 for no limit).
  */
 //#include <linux/bigphysarea.h>
 #include <linux/dma-mapping.h>
@@ -30,18 +50,37 @@
 #include <linux/err.h>
 #include <linux/mm.h>
 
+#include <linux/workqueue.h>
 #include <linux/uaccess.h>
+#include <linux/cred.h>
+#include <linux/bitmap.h>
+#include <linux/io.h>
 
 #include <contig_alloc.h>
 
-struct contig_chunk {
-	unsigned long paddr;
+/*
+ * A range of chunks of one DDR node set aside for the files attached to it.
+ * Allocations from a reservation only take its own lock.
+ */
+struct contig_resv {
+	struct list_head node; /* in resv_list, under contig_lock */
+	char name[CONTIG_RESV_NAME_MAX];
 	int ddr_node;
-	struct list_head node; /* head: inactive_chunks or desc->alloc_list */
+	unsigned long first; /* first chunk of the range in the node */
+	unsigned long n;
+	kuid_t uid; /* who may attach besides CAP_SYS_ADMIN; invalid for anyone */
+	unsigned int users; /* attached files, under contig_lock */
+	struct mutex lock;
+	unsigned long *map; /* one bit per chunk of the range, under lock */
+	unsigned long allocated; /* bytes, under lock */
 };
 
 struct contig_file {
+	struct mutex lock;
 	struct list_head desc_list;
+	struct contig_resv *resv;
+	unsigned long shared; /* bytes allocated outside of the reservation */
+	unsigned long quota; /* limit on shared, 0 for none */
 };
 
 #define PFX "contig_alloc: "
@@ -52,18 +91,62 @@ static unsigned long chunk_size;
 unsigned long contig_chunk_size_log = 20;
 EXPORT_SYMBOL_GPL(contig_chunk_size_log);
 module_param_named(chunk_log, contig_chunk_size_log, ulong, S_IRUGO);
+#define MAX_CHUNK_CLASSES 4
+static unsigned int extra_class_log[MAX_CHUNK_CLASSES - 1];
+static unsigned int n_extra_classes;
+module_param_array_named(classes, extra_class_log, uint, &n_extra_classes, S_IRUGO);
+/* chunk_log, then the classes parameter */
+static unsigned int class_log[MAX_CHUNK_CLASSES];
+static unsigned int nclasses;
 static unsigned int nddr;
 module_param(nddr, uint, S_IRUGO);
 static unsigned long mem_start[MAX_DDR_NODES];
 module_param_array_named(start, mem_start, ulong, &nddr, S_IRUGO);
 static unsigned long mem_size[MAX_DDR_NODES];
 module_param_array_named(size, mem_size, ulong, &nddr, S_IRUGO);
+static int ddr_y[MAX_DDR_NODES];
+static unsigned int n_ddr_y;
+module_param_array(ddr_y, int, &n_ddr_y, S_IRUGO);
+static int ddr_x[MAX_DDR_NODES];
+static unsigned int n_ddr_x;
+module_param_array(ddr_x, int, &n_ddr_x, S_IRUGO);
+static unsigned long mon_base;
+module_param(mon_base, ulong, S_IRUGO);
+static unsigned int noc_cols;
+module_param(noc_cols, uint, S_IRUGO);
+static unsigned int mon_period_ms = 20;
+module_param(mon_period_ms, uint, S_IRUGO);
+static char *reserve;
+module_param(reserve, charp, S_IRUGO);
+static unsigned long file_quota;
+module_param(file_quota, ulong, S_IRUGO | S_IWUSR);
+
+/* monitors of a tile: the burst register, then one word per counter */
+#define MON_TILE_SIZE		0x200
+#define MON_BURST_REG		0x00
+#define MON_DDR_WORDS_REG	0x04 /* MON_DDR_WORD_TRANSFER_INDEX */
+#define MON_DMA_REQS_REG	0x18 /* MON_MEM_DMA_REQ_INDEX */
 
 static struct class *contig_class;
+static struct device *contig_dev;
 static DEFINE_MUTEX(contig_lock);
 static LIST_HEAD(desc_list);
-static struct list_head inactive_chunks[MAX_DDR_NODES];
+static LIST_HEAD(resv_list);
+/* one bit per chunk of each DDR node, set while the chunk is allocated */
+static unsigned long *chunk_map[MAX_DDR_NODES];
+static unsigned long node_chunks[MAX_DDR_NODES];
+static unsigned long node_base[MAX_DDR_NODES]; /* physical address of chunk 0 */
 static unsigned long mem_allocated[MAX_DDR_NODES];
+/* monitors of the memory tile of each DDR node, if sampled */
+static void __iomem *node_mon[MAX_DDR_NODES];
+static u32 node_mon_last[MAX_DDR_NODES];
+/* average traffic of each DDR node over the last samples, in words per period */
+static unsigned long node_busy[MAX_DDR_NODES];
+/* bytes placed on each DDR node by the least-busy policy since the last sample */
+static unsigned long node_placed[MAX_DDR_NODES];
+static struct delayed_work contig_mon_work;
+/* first DDR node of the next interleaved buffer */
+static unsigned int interleave_next;
 static caddr_t bp_buf __maybe_unused;
 
 static int contig_open(struct inode *, struct file *);
@@ -79,7 +162,7 @@ static const struct file_operations contig_fops = {
 	.mmap		= contig_mmap,
 };
 
-static struct contig_desc *contig_alloc_descriptor(unsigned int n_chunks)
+static struct contig_desc *contig_alloc_descriptor(unsigned int n_chunks, unsigned int chunk_log)
 {
 	struct contig_desc *desc;
 
@@ -92,7 +175,7 @@ static struct contig_desc *contig_alloc_descriptor(unsigned int n_chunks)
 		goto err_arr;
 
 #ifndef __riscv
-	desc->arr_dma_addr = dma_map_single(NULL, desc->arr, n_chunks * sizeof(dma_addr_t), DMA_TO_DEVICE);
+	desc->arr_dma_addr = dma_map_single(NULL, desc->arr, n_chunks * sizeof(*desc->arr), DMA_TO_DEVICE);
 #else
 	desc->arr_dma_addr = virt_to_phys(desc->arr);
 #endif
@@ -100,7 +183,13 @@ static struct contig_desc *contig_alloc_descriptor(unsigned int n_chunks)
 		goto err_dma;
 
 	desc->n = n_chunks;
-	INIT_LIST_HEAD(&desc->alloc_list);
+	desc->chunk_log = chunk_log;
+	desc->resv = NULL;
+	kref_init(&desc->kref);
+	desc->mapping = NULL;
+	desc->nmaps = 0;
+	/* the chunks may still be cached from their previous use */
+	desc->cached = true;
 	return desc;
 
  err_dma:
@@ -113,38 +202,154 @@ static struct contig_desc *contig_alloc_descriptor(unsigned int n_chunks)
 static void contig_free_descriptor(struct contig_desc *desc)
 {
 #ifndef __riscv
-	dma_unmap_single(NULL, desc->arr_dma_addr, desc->n * sizeof(dma_addr_t), DMA_TO_DEVICE);
+	dma_unmap_single(NULL, desc->arr_dma_addr, desc->n * sizeof(*desc->arr), DMA_TO_DEVICE);
 #endif
 	kfree(desc->arr);
 	kfree(desc);
 }
 
-static int get_next_ddr_node(int ddr_node, int first_ddr_node)
+/* Base chunks that make up one chunk of @desc */
+static inline unsigned long contig_desc_nr(const struct contig_desc *desc)
+{
+	return 1UL << (desc->chunk_log - contig_chunk_size_log);
+}
+
+/* First base chunk of a free, aligned run of @nr base chunks of @ddr_node */
+static unsigned long contig_find_area(int ddr_node, unsigned long nr)
+{
+	return bitmap_find_next_zero_area(chunk_map[ddr_node], node_chunks[ddr_node], 0, nr, nr - 1);
+}
+
+/* Whether @ddr_node has room for one more chunk of @desc */
+static bool contig_node_fits(int ddr_node, const struct contig_desc *desc)
+{
+	unsigned long nr = contig_desc_nr(desc);
+
+	if (mem_size[ddr_node] - mem_allocated[ddr_node] < nr << contig_chunk_size_log)
+		return false;
+	return nr == 1 || contig_find_area(ddr_node, nr) < node_chunks[ddr_node];
+}
+
+/* The first node from @ddr_node on with room for a chunk of @desc, or -1 */
+static int get_next_ddr_node(int ddr_node, int first_ddr_node, const struct contig_desc *desc)
 {
 	BUG_ON(mem_allocated[ddr_node] > mem_size[ddr_node]);
-	while (mem_allocated[ddr_node] == mem_size[ddr_node]) {
+	while (!contig_node_fits(ddr_node, desc)) {
 		ddr_node = (ddr_node + 1) % nddr;
-		BUG_ON(ddr_node == first_ddr_node);
+		if (ddr_node == first_ddr_node)
+			return -1;
 	}
 	return ddr_node;
 }
 
-static void allocate_chunk(struct contig_desc **desc, int ddr_node, int chunk_index)
+/* DDR node of the chunk at @paddr, or -1 if it is none of ours */
+static int contig_paddr_node(unsigned long paddr)
 {
-	struct contig_chunk *ch;
+	int i;
 
-	BUG_ON(list_empty(&inactive_chunks[ddr_node]));
-	ch = list_first_entry(&inactive_chunks[ddr_node], struct contig_chunk, node);
-	/* pr_info("Allocating chunk %d @ address 0x%08lx\n", chunk_index, ch->paddr); */
-	list_del(&ch->node);
-	list_add(&ch->node, &(*desc)->alloc_list);
-	(*desc)->arr[chunk_index] = ch->paddr;
-	mem_allocated[ddr_node] += chunk_size;
+	for (i = 0; i < nddr; i++)
+		if (paddr >= node_base[i] && paddr - node_base[i] < mem_size[i])
+			return i;
+	return -1;
+}
+
+/*
+ * First base chunk of the free run of @ddr_node that best fits @want base
+ * chunks, counting only from the first multiple of @nr in each run: the
+ * shortest run that holds them all or, if none does, the longest one that
+ * holds at least @nr.
+ */
+static unsigned long contig_best_run(int ddr_node, unsigned long want, unsigned long nr)
+{
+	unsigned long *map = chunk_map[ddr_node];
+	unsigned long n = node_chunks[ddr_node];
+	unsigned long start, end, len;
+	unsigned long best = n, best_len = 0;
+
+	for (start = find_next_zero_bit(map, n, 0); start < n; start = find_next_zero_bit(map, n, end)) {
+		end = find_next_bit(map, n, start);
+		start = ALIGN(start, nr);
+		if (start >= end || end - start < nr)
+			continue;
+		len = end - start;
+		if (best_len < want ? len > best_len : (len >= want && len < best_len)) {
+			best = start;
+			best_len = len;
+			if (len == want)
+				break;
+		}
+	}
+	return best;
+}
+
+/*
+ * Continue the run of the previous chunk of the buffer if the next chunk is
+ * free; otherwise start a new run where the rest of the buffer fits best.
+ * Fails if @ddr_node has no free aligned run for a chunk of the buffer.
+ */
+static int allocate_chunk(struct contig_desc **desc, int ddr_node, int chunk_index)
+{
+	unsigned long nr = contig_desc_nr(*desc);
+	unsigned long n = node_chunks[ddr_node];
+	unsigned long idx = n;
+
+	if (chunk_index) {
+		unsigned long prev = (*desc)->arr[chunk_index - 1];
+
+		if (contig_paddr_node(prev) == ddr_node) {
+			idx = ((prev - node_base[ddr_node]) >> contig_chunk_size_log) + nr;
+			if (idx + nr <= n && find_next_bit(chunk_map[ddr_node], idx + nr, idx) < idx + nr)
+				idx = n;
+		}
+	}
+	if (idx + nr > n)
+		idx = contig_best_run(ddr_node, ((*desc)->n - chunk_index) * nr, nr);
+	if (idx + nr > n)
+		return -ENOMEM;
+
+	bitmap_set(chunk_map[ddr_node], idx, nr);
+	(*desc)->arr[chunk_index] = node_base[ddr_node] + (idx << contig_chunk_size_log);
+	mem_allocated[ddr_node] += nr << contig_chunk_size_log;
+	return 0;
+}
+
+/* Called with resv->lock held */
+static void __contig_resv_put(struct contig_resv *resv, struct contig_desc *desc, unsigned int n)
+{
+	unsigned long nr = contig_desc_nr(desc);
+	unsigned long base = node_base[resv->ddr_node];
+	int i;
+
+	for (i = 0; i < n; i++)
+		bitmap_clear(resv->map, ((desc->arr[i] - base) >> contig_chunk_size_log) - resv->first, nr);
+	resv->allocated -= (unsigned long)n << desc->chunk_log;
+}
+
+/* Give back the first @n chunks of @desc */
+static void release_chunks(struct contig_desc *desc, unsigned int n)
+{
+	unsigned long nr = contig_desc_nr(desc);
+	int ddr_node;
+	int i;
+
+	if (desc->resv) {
+		mutex_lock(&desc->resv->lock);
+		__contig_resv_put(desc->resv, desc, n);
+		mutex_unlock(&desc->resv->lock);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		ddr_node = contig_paddr_node(desc->arr[i]);
+		BUG_ON(ddr_node < 0);
+		bitmap_clear(chunk_map[ddr_node],
+			(desc->arr[i] - node_base[ddr_node]) >> contig_chunk_size_log, nr);
+		mem_allocated[ddr_node] -= nr << contig_chunk_size_log;
+	}
 }
 
 static int contig_alloc_preferred(struct contig_desc *desc, const struct contig_alloc_params *params)
 {
-	unsigned long allocated = 0;
 	int ddr_node;
 	int i;
 
@@ -155,12 +360,13 @@ static int contig_alloc_preferred(struct contig_desc *desc, const struct contig_
 
 	ddr_node = params->pol.first.ddr_node;
 	for (i = 0; i < desc->n; i++) {
-		ddr_node = get_next_ddr_node(ddr_node, params->pol.first.ddr_node);
-		allocate_chunk(&desc, ddr_node, i);
-		allocated += chunk_size;
+		ddr_node = get_next_ddr_node(ddr_node, params->pol.first.ddr_node, desc);
+		if (ddr_node < 0 || allocate_chunk(&desc, ddr_node, i)) {
+			release_chunks(desc, i);
+			return -ENOMEM;
+		}
 		n_per_node[ddr_node]++;
 	}
-	BUG_ON(allocated != desc->n * chunk_size);
 
 	/* Compute which DDR holds most of the data */
 	ddr_node = 0;
@@ -176,21 +382,21 @@ static int contig_alloc_preferred(struct contig_desc *desc, const struct contig_
 	return 0;
 }
 
-static bool least_loaded_alloc_ok(unsigned int n_chunks)
+static bool least_loaded_alloc_ok(unsigned long bytes)
 {
 	int i;
 	for (i = 0; i < nddr; i++)
-		if (mem_size[i] - mem_allocated[i] >= n_chunks * chunk_size)
+		if (mem_size[i] - mem_allocated[i] >= bytes)
 			return true;
 	return false;
 }
 
-static int get_least_loaded_ddr_node(unsigned int n_chunks, unsigned int threshold)
+static int get_least_loaded_ddr_node(unsigned long bytes, unsigned int threshold)
 {
 	int i;
 	unsigned long min_allocated = mem_size[1];
 	int least_loaded = 0;
-	unsigned long tba = n_chunks * chunk_size;
+	unsigned long tba = bytes;
 	unsigned long th = threshold * chunk_size;
 
 	for (i = 1; i < nddr; i++)
@@ -207,19 +413,20 @@ static int get_least_loaded_ddr_node(unsigned int n_chunks, unsigned int thresho
 
 static int contig_alloc_least_loaded(struct contig_desc *desc, const struct contig_alloc_params *params)
 {
-	unsigned long allocated = 0;
+	unsigned long bytes = (unsigned long)desc->n << desc->chunk_log;
 	int ddr_node;
 	int i;
 
-	if (unlikely(!least_loaded_alloc_ok(desc->n)))
+	if (unlikely(!least_loaded_alloc_ok(bytes)))
 		return -ENOMEM;
 
-	ddr_node = get_least_loaded_ddr_node(desc->n, params->pol.lloaded.threshold);
+	ddr_node = get_least_loaded_ddr_node(bytes, params->pol.lloaded.threshold);
 	for (i = 0; i < desc->n; i++) {
-		allocate_chunk(&desc, ddr_node, i);
-		allocated += chunk_size;
+		if (allocate_chunk(&desc, ddr_node, i)) {
+			release_chunks(desc, i);
+			return -ENOMEM;
+		}
 	}
-	BUG_ON(allocated != desc->n * chunk_size);
 
 	desc->most_allocated = ddr_node;
 
@@ -228,7 +435,6 @@ static int contig_alloc_least_loaded(struct contig_desc *desc, const struct cont
 
 static int contig_alloc_balanced(struct contig_desc *desc, const struct contig_alloc_params *params)
 {
-	unsigned long allocated = 0;
 	int next_ddr_node;
 	int cluster_chunk;
 	int ddr_node;
@@ -239,15 +445,19 @@ static int contig_alloc_balanced(struct contig_desc *desc, const struct contig_a
 	for (i = 0; i < nddr; i++)
 		n_per_node[i] = 0;
 
-	ddr_node = get_least_loaded_ddr_node(1,	params->pol.balanced.threshold);
+	ddr_node = get_least_loaded_ddr_node(1UL << desc->chunk_log, params->pol.balanced.threshold);
 
 	cluster_chunk = 0;
 	for (i = 0; i < desc->n; i++) {
 		if (cluster_chunk == params->pol.balanced.cluster_size) {
 			next_ddr_node = (ddr_node + 1) % nddr;
-			next_ddr_node = get_next_ddr_node(next_ddr_node, next_ddr_node);
+			next_ddr_node = get_next_ddr_node(next_ddr_node, next_ddr_node, desc);
 		} else {
-			next_ddr_node = get_next_ddr_node(ddr_node, ddr_node);
+			next_ddr_node = get_next_ddr_node(ddr_node, ddr_node, desc);
+		}
+		if (next_ddr_node < 0) {
+			release_chunks(desc, i);
+			return -ENOMEM;
 		}
 
 		if (ddr_node != next_ddr_node) {
@@ -257,12 +467,13 @@ static int contig_alloc_balanced(struct contig_desc *desc, const struct contig_a
 			cluster_chunk++;
 		}
 
-		allocate_chunk(&desc, ddr_node, i);
-		allocated += chunk_size;
+		if (allocate_chunk(&desc, ddr_node, i)) {
+			release_chunks(desc, i);
+			return -ENOMEM;
+		}
 
 		n_per_node[ddr_node]++;
 	}
-	BUG_ON(allocated != desc->n * chunk_size);
 
 	/* Compute which DDR holds most of the data */
 	ddr_node = 0;
@@ -278,12 +489,119 @@ static int contig_alloc_balanced(struct contig_desc *desc, const struct contig_a
 	return 0;
 }
 
-static struct contig_desc *__contig_alloc_chunks(const struct contig_alloc_params *params, unsigned int n_chunks)
+/* NoC hops between the tile at @y, @x and the memory tile of @ddr_node */
+static unsigned int contig_node_hops(int ddr_node, int y, int x)
+{
+	if (y < 0 || x < 0 || n_ddr_y != nddr || n_ddr_x != nddr)
+		return 0;
+	return abs(y - ddr_y[ddr_node]) + abs(x - ddr_x[ddr_node]);
+}
+
+/*
+ * Recent traffic of @ddr_node, in words per sampling period. Buffers placed
+ * since the last sample count as read once, so that a burst of allocations
+ * spreads before the monitors see it. Without monitors, allocated memory
+ * stands in for traffic.
+ */
+static unsigned long contig_node_busy(int ddr_node)
+{
+	if (!node_mon[ddr_node])
+		return mem_allocated[ddr_node] / sizeof(long);
+	return node_busy[ddr_node] + node_placed[ddr_node] / sizeof(long);
+}
+
+/*
+ * Place the whole buffer on the node with the lowest traffic plus hop cost.
+ * A node with enough free memory may still lack aligned runs for every
+ * chunk: the buffer then goes to the next node in that order.
+ */
+static int contig_alloc_least_busy(struct contig_desc *desc, const struct contig_alloc_params *params)
+{
+	const struct contig_alloc_least_busy *lbusy = &params->pol.lbusy;
+	unsigned long bytes = (unsigned long)desc->n << desc->chunk_log;
+	unsigned long score, best_score = 0;
+	unsigned int hops, best_hops = 0;
+	bool tried[MAX_DDR_NODES] = { false };
+	int ddr_node;
+	int i;
+
+	for (;;) {
+		ddr_node = -1;
+		for (i = 0; i < nddr; i++) {
+			if (tried[i] || mem_size[i] - mem_allocated[i] < bytes ||
+				!contig_node_fits(i, desc))
+				continue;
+			hops = contig_node_hops(i, lbusy->y, lbusy->x);
+			score = contig_node_busy(i) + (unsigned long)lbusy->hop_cost * hops;
+			if (ddr_node < 0 || score < best_score ||
+				(score == best_score && hops < best_hops)) {
+				ddr_node = i;
+				best_score = score;
+				best_hops = hops;
+			}
+		}
+		if (ddr_node < 0)
+			return -ENOMEM;
+
+		for (i = 0; i < desc->n; i++)
+			if (allocate_chunk(&desc, ddr_node, i))
+				break;
+		if (i == desc->n)
+			break;
+		release_chunks(desc, i);
+		tried[ddr_node] = true;
+	}
+
+	node_placed[ddr_node] += bytes;
+	desc->most_allocated = ddr_node;
+
+	return 0;
+}
+
+static int contig_alloc_interleaved(struct contig_desc *desc, const struct contig_alloc_params *params)
+{
+	unsigned int first = interleave_next % nddr;
+	int ddr_node;
+	int i;
+
+	unsigned int n_per_node_max;
+	unsigned int n_per_node[MAX_DDR_NODES];
+	for (i = 0; i < nddr; i++)
+		n_per_node[i] = 0;
+
+	/* chunk i goes to node first + i, or the next one with room */
+	for (i = 0; i < desc->n; i++) {
+		ddr_node = (first + i) % nddr;
+		ddr_node = get_next_ddr_node(ddr_node, ddr_node, desc);
+		if (ddr_node < 0 || allocate_chunk(&desc, ddr_node, i)) {
+			release_chunks(desc, i);
+			return -ENOMEM;
+		}
+		n_per_node[ddr_node]++;
+	}
+	interleave_next = first + 1;
+
+	/* Compute which DDR holds most of the data */
+	ddr_node = 0;
+	n_per_node_max = n_per_node[0];
+
+	for (i = 1; i < nddr; i++)
+		if (n_per_node[i] > n_per_node_max) {
+			ddr_node = i;
+			n_per_node_max = n_per_node[i];
+		}
+	desc->most_allocated = ddr_node;
+
+	return 0;
+}
+
+static struct contig_desc *__contig_alloc_chunks(const struct contig_alloc_params *params,
+						unsigned int n_chunks, unsigned int chunk_log)
 {
 	struct contig_desc *desc;
 	int rc;
 
-	desc = contig_alloc_descriptor(n_chunks);
+	desc = contig_alloc_descriptor(n_chunks, chunk_log);
 	if (unlikely(IS_ERR(desc)))
 		return desc;
 
@@ -297,6 +615,12 @@ static struct contig_desc *__contig_alloc_chunks(const struct contig_alloc_param
 	case CONTIG_ALLOC_BALANCED:
 		rc = contig_alloc_balanced(desc, params);
 		break;
+	case CONTIG_ALLOC_LEAST_BUSY:
+		rc = contig_alloc_least_busy(desc, params);
+		break;
+	case CONTIG_ALLOC_INTERLEAVED:
+		rc = contig_alloc_interleaved(desc, params);
+		break;
 	default:
 		BUG();
 	}
@@ -310,11 +634,43 @@ static struct contig_desc *__contig_alloc_chunks(const struct contig_alloc_param
 	return desc;
 }
 
+/*
+ * Index of the chunk class for @size bytes: the largest class whose chunks
+ * waste at most an eighth of the buffer in the last chunk, or the smallest.
+ */
+static int contig_auto_class(unsigned long size)
+{
+	int c;
+
+	for (c = nclasses - 1; c > 0; c--) {
+		unsigned long csize = 1UL << class_log[c];
+
+		if (csize <= size && round_up(size, csize) - size <= size / 8)
+			break;
+	}
+	return c;
+}
+
+static int contig_class_index(unsigned int chunk_log)
+{
+	int c;
+
+	for (c = 0; c < nclasses; c++)
+		if (class_log[c] == chunk_log)
+			return c;
+	return -1;
+}
+
+/*
+ * Without an explicit class, fall back to smaller chunks when there is free
+ * memory but no free aligned run of the chosen size.
+ */
 static struct contig_desc *__contig_alloc(const struct contig_alloc_params *params, unsigned long size)
 {
+	struct contig_desc *desc = ERR_PTR(-ENOMEM);
 	unsigned long mem_free = 0;
-	unsigned int n_chunks;
-	int i;
+	unsigned int chunk_log;
+	int i, c;
 
 	for (i = 0; i < nddr; i++)
 		mem_free += mem_size[i] - mem_allocated[i];
@@ -322,9 +678,21 @@ static struct contig_desc *__contig_alloc(const struct contig_alloc_params *para
 	if (size > mem_free)
 		return ERR_PTR(-ENOMEM);
 
-	n_chunks = DIV_ROUND_UP(size, chunk_size);
-	BUG_ON(n_chunks > mem_free / chunk_size);
-	return __contig_alloc_chunks(params, n_chunks);
+	if (params->chunk_log)
+		c = contig_class_index(params->chunk_log);
+	else if (params->policy == CONTIG_ALLOC_INTERLEAVED)
+		c = 0; /* interleave as finely as the page table allows */
+	else
+		c = contig_auto_class(size);
+	if (c < 0)
+		return ERR_PTR(-EINVAL);
+	for (; c >= 0; c--) {
+		chunk_log = class_log[c];
+		desc = __contig_alloc_chunks(params, DIV_ROUND_UP(size, 1UL << chunk_log), chunk_log);
+		if (!IS_ERR(desc) || PTR_ERR(desc) != -ENOMEM || params->chunk_log)
+			break;
+	}
+	return desc;
 }
 
 struct contig_desc *contig_alloc(const struct contig_alloc_params *params, unsigned long size)
@@ -342,22 +710,175 @@ struct contig_desc *contig_alloc(const struct contig_alloc_params *params, unsig
 }
 EXPORT_SYMBOL_GPL(contig_alloc);
 
-void __contig_free(struct contig_desc *desc)
+/* Called with resv->lock held */
+static int __contig_resv_get(struct contig_resv *resv, struct contig_desc *desc)
 {
-	struct contig_chunk *ch, *nxt;
-	unsigned int deallocated = 0;
+	unsigned long nr = contig_desc_nr(desc);
+	unsigned long idx = 0;
+	int i;
 
-	list_for_each_entry_safe(ch, nxt, &desc->alloc_list, node) {
-		list_del(&ch->node);
-		list_add(&ch->node, &inactive_chunks[ch->ddr_node]);
-		deallocated += chunk_size;
-		mem_allocated[ch->ddr_node] -= chunk_size;
+	for (i = 0; i < desc->n; i++) {
+		/*
+		 * First fit after the previous chunk, then from the start. The
+		 * chunks are aligned on the node, not on the reservation.
+		 */
+		idx = bitmap_find_next_zero_area_off(resv->map, resv->n, i ? idx + nr : 0, nr,
+						nr - 1, resv->first);
+		if (idx + nr > resv->n && i)
+			idx = bitmap_find_next_zero_area_off(resv->map, resv->n, 0, nr,
+							nr - 1, resv->first);
+		if (idx + nr > resv->n) {
+			resv->allocated += (unsigned long)i << desc->chunk_log;
+			__contig_resv_put(resv, desc, i);
+			return -ENOMEM;
+		}
+		bitmap_set(resv->map, idx, nr);
+		desc->arr[i] = node_base[resv->ddr_node] + ((resv->first + idx) << contig_chunk_size_log);
 	}
-	BUG_ON(deallocated != desc->n * chunk_size);
-	list_del(&desc->desc_node);
+	resv->allocated += (unsigned long)desc->n << desc->chunk_log;
+	return 0;
+}
+
+/*
+ * Allocate from @resv, in the smallest chunks unless @params asks for a
+ * class; the policy does not matter, since the range is on a single node.
+ */
+static struct contig_desc *contig_resv_alloc(struct contig_resv *resv,
+					const struct contig_alloc_params *params, unsigned long size)
+{
+	unsigned int chunk_log = params->chunk_log ? params->chunk_log : contig_chunk_size_log;
+	struct contig_desc *desc;
+	int rc;
+
+	desc = contig_alloc_descriptor(DIV_ROUND_UP(size, 1UL << chunk_log), chunk_log);
+	if (unlikely(IS_ERR(desc)))
+		return desc;
+	desc->resv = resv;
+	desc->most_allocated = resv->ddr_node;
+
+	mutex_lock(&resv->lock);
+	rc = __contig_resv_get(resv, desc);
+	mutex_unlock(&resv->lock);
+	if (rc) {
+		contig_free_descriptor(desc);
+		return ERR_PTR(rc);
+	}
+
+	mutex_lock(&contig_lock);
+	list_add(&desc->desc_node, &desc_list);
+	mutex_unlock(&contig_lock);
+	return desc;
+}
+
+/* Called with contig_lock held */
+static struct contig_resv *contig_resv_find(const char *name)
+{
+	struct contig_resv *resv;
+
+	list_for_each_entry(resv, &resv_list, node)
+		if (!strcmp(resv->name, name))
+			return resv;
+	return NULL;
+}
+
+static int contig_resv_create(const char *name, unsigned long size, int ddr_node, kuid_t uid)
+{
+	unsigned long n = DIV_ROUND_UP(size, chunk_size);
+	struct contig_resv *resv;
+	unsigned long first;
+	int rc = 0;
+
+	if (!name[0] || strlen(name) >= CONTIG_RESV_NAME_MAX || ddr_node < 0 || ddr_node >= nddr || !n)
+		return -EINVAL;
+
+	resv = kzalloc(sizeof(*resv), GFP_KERNEL);
+	if (resv == NULL)
+		return -ENOMEM;
+	resv->map = bitmap_zalloc(n, GFP_KERNEL);
+	if (resv->map == NULL) {
+		kfree(resv);
+		return -ENOMEM;
+	}
+	strscpy(resv->name, name, sizeof(resv->name));
+	resv->ddr_node = ddr_node;
+	resv->n = n;
+	resv->uid = uid;
+	mutex_init(&resv->lock);
+
+	mutex_lock(&contig_lock);
+	first = bitmap_find_next_zero_area(chunk_map[ddr_node], node_chunks[ddr_node], 0, n, 0);
+	if (contig_resv_find(name)) {
+		rc = -EEXIST;
+	} else if (first + n > node_chunks[ddr_node]) {
+		rc = -ENOMEM;
+	} else {
+		bitmap_set(chunk_map[ddr_node], first, n);
+		mem_allocated[ddr_node] += n << contig_chunk_size_log;
+		resv->first = first;
+		list_add_tail(&resv->node, &resv_list);
+	}
+	mutex_unlock(&contig_lock);
+
+	if (rc) {
+		bitmap_free(resv->map);
+		kfree(resv);
+	}
+	return rc;
+}
+
+/* Called with contig_lock held */
+static void __contig_resv_destroy(struct contig_resv *resv)
+{
+	list_del(&resv->node);
+	bitmap_clear(chunk_map[resv->ddr_node], resv->first, resv->n);
+	mem_allocated[resv->ddr_node] -= resv->n << contig_chunk_size_log;
+	bitmap_free(resv->map);
+	kfree(resv);
+}
+
+/* Fails while files are attached or buffers, even freed but mapped, remain */
+static int contig_resv_destroy(const char *name)
+{
+	struct contig_resv *resv;
+	int rc = 0;
+
+	mutex_lock(&contig_lock);
+	resv = contig_resv_find(name);
+	if (resv == NULL) {
+		rc = -ENOENT;
+	} else if (resv->users) {
+		rc = -EBUSY;
+	} else {
+		mutex_lock(&resv->lock);
+		if (resv->allocated)
+			rc = -EBUSY;
+		mutex_unlock(&resv->lock);
+		if (!rc)
+			__contig_resv_destroy(resv);
+	}
+	mutex_unlock(&contig_lock);
+	return rc;
+}
+
+/* Called with contig_lock held, once the last reference is gone */
+static void contig_desc_release(struct kref *kref)
+{
+	struct contig_desc *desc = container_of(kref, struct contig_desc, kref);
+
+	release_chunks(desc, desc->n);
 	contig_free_descriptor(desc);
 }
 
+/*
+ * The handle stops resolving right away; the chunks go back to the free
+ * lists when the last contig_get() reference is dropped.
+ */
+void __contig_free(struct contig_desc *desc)
+{
+	list_del(&desc->desc_node);
+	kref_put(&desc->kref, contig_desc_release);
+}
+
 void contig_free(struct contig_desc *desc)
 {
 	mutex_lock(&contig_lock);
@@ -386,21 +907,64 @@ struct contig_desc *contig_khandle_to_desc(contig_khandle_t khandle)
 }
 EXPORT_SYMBOL_GPL(contig_khandle_to_desc);
 
+/*
+ * Like contig_khandle_to_desc(), but the returned descriptor stays valid
+ * until contig_put(), even if user space frees the buffer meanwhile.
+ */
+struct contig_desc *contig_get(contig_khandle_t khandle)
+{
+	struct contig_desc *handle = (struct contig_desc *)khandle;
+	struct contig_desc *desc;
+
+	mutex_lock(&contig_lock);
+	list_for_each_entry(desc, &desc_list, desc_node) {
+		if (desc == handle) {
+			kref_get(&desc->kref);
+			break;
+		}
+	}
+	mutex_unlock(&contig_lock);
+
+	return desc == handle ? desc : NULL;
+}
+EXPORT_SYMBOL_GPL(contig_get);
+
+void contig_put(struct contig_desc *desc)
+{
+	mutex_lock(&contig_lock);
+	kref_put(&desc->kref, contig_desc_release);
+	mutex_unlock(&contig_lock);
+}
+EXPORT_SYMBOL_GPL(contig_put);
+
+/*
+ * Called once every cache level has been flushed: the buffer is clean until
+ * user space touches it again, which the fault on its unmapped pages tells.
+ */
+void contig_clean(struct contig_desc *desc)
+{
+	mutex_lock(&contig_lock);
+	WRITE_ONCE(desc->cached, false);
+	if (desc->mapping)
+		unmap_mapping_range(desc->mapping, desc->arr[0],
+				(loff_t)desc->n << desc->chunk_log, 1);
+	mutex_unlock(&contig_lock);
+}
+EXPORT_SYMBOL_GPL(contig_clean);
+
 static void __contig_chunks_remove(void)
 {
-	struct contig_chunk *ch, *nxt;
 	int i;
 
-	for (i = 0; i < nddr; i++)
-		list_for_each_entry_safe(ch, nxt, &inactive_chunks[i], node) {
-			list_del(&ch->node);
-			kfree(ch);
-		}
+	for (i = 0; i < nddr; i++) {
+		bitmap_free(chunk_map[i]);
+		chunk_map[i] = NULL;
+	}
 }
 
 #ifdef CONFIG_BIGPHYS_AREA
 
-static unsigned long __init contig_chunk_paddr(struct contig_chunk *ch, int n_chunk)
+static unsigned long __init contig_chunk_paddr(int ddr_node, int n_chunk)
 {
 	return virt_to_phys(bp_buf) + chunk_size * n_chunk;
 }
@@ -420,7 +984,7 @@ static void contig_phys_free(void)
 
 #else
 
-static unsigned long __init contig_chunk_paddr(int ddr_node, struct contig_chunk *ch, int n_chunk)
+static unsigned long __init contig_chunk_paddr(int ddr_node, int n_chunk)
 {
 	return mem_start[ddr_node] + chunk_size * n_chunk;
 }
@@ -437,22 +1001,15 @@ static void contig_phys_free(void)
 
 static int __init contig_chunks_create(int ddr_node, int n_chunks)
 {
-	int i;
-
 	if (contig_phys_alloc(n_chunks))
 		return -ENOMEM;
 
-	for (i = 0; i < n_chunks; i++) {
-		struct contig_chunk *ch;
+	chunk_map[ddr_node] = bitmap_zalloc(n_chunks, GFP_KERNEL);
+	if (chunk_map[ddr_node] == NULL)
+		goto err;
 
-		ch = kmalloc(sizeof(*ch), GFP_KERNEL);
-		if (ch == NULL)
-			goto err;
-
-		ch->paddr = contig_chunk_paddr(ddr_node, ch, i);
-		ch->ddr_node = ddr_node;
-		list_add_tail(&ch->node, &inactive_chunks[ddr_node]);
-	}
+	node_chunks[ddr_node] = n_chunks;
+	node_base[ddr_node] = contig_chunk_paddr(ddr_node, 0);
 	return 0;
  err:
 	__contig_chunks_remove();
@@ -464,10 +1021,12 @@ static int contig_open(struct inode *inode, struct file *file)
 {
 	struct contig_file *priv;
 
-	priv = kmalloc(sizeof(*priv), GFP_KERNEL);
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
 	if (priv == NULL)
 		return -ENOMEM;
+	mutex_init(&priv->lock);
 	INIT_LIST_HEAD(&priv->desc_list);
+	priv->quota = READ_ONCE(file_quota);
 	file->private_data = priv;
 	return 0;
 }
@@ -481,12 +1040,20 @@ static int contig_release(struct inode *inode, struct file *file)
 		list_del(&desc->file_node);
 		contig_free(desc);
 	}
+	if (priv->resv) {
+		mutex_lock(&contig_lock);
+		priv->resv->users--;
+		mutex_unlock(&contig_lock);
+	}
 	kfree(priv);
 	return 0;
 }
 
 static bool contig_alloc_ok(const struct contig_alloc_params *params)
 {
+	if (params->chunk_log && contig_class_index(params->chunk_log) < 0)
+		return false;
+
 	switch (params->policy) {
 	case CONTIG_ALLOC_PREFERRED:
 		if (params->pol.first.ddr_node < 0 || params->pol.first.ddr_node > nddr)
@@ -502,17 +1069,65 @@ static bool contig_alloc_ok(const struct contig_alloc_params *params)
 		if (params->pol.balanced.cluster_size < 1)
 			return false;
 		break;
+	case CONTIG_ALLOC_LEAST_BUSY:
+	case CONTIG_ALLOC_INTERLEAVED:
+		break;
 	default:
 		return false;
 	}
 	return true;
 }
 
+static unsigned long contig_desc_bytes(const struct contig_desc *desc)
+{
+	return (unsigned long)desc->n << desc->chunk_log;
+}
+
+/*
+ * Take from the reservation of the file first, if any, then from the shared
+ * memory within the quota of the file. Called with priv->lock held.
+ */
+static struct contig_desc *contig_file_alloc(struct contig_file *priv,
+					const struct contig_alloc_params *params, unsigned long size)
+{
+	struct contig_desc *desc;
+
+	if (unlikely(size == 0))
+		return ERR_PTR(-EINVAL);
+
+	if (priv->resv) {
+		desc = contig_resv_alloc(priv->resv, params, size);
+		if (!IS_ERR(desc) || PTR_ERR(desc) != -ENOMEM)
+			return desc;
+	}
+
+	if (priv->quota && priv->shared + size > priv->quota)
+		return ERR_PTR(-EDQUOT);
+	desc = contig_alloc(params, size);
+	if (IS_ERR(desc))
+		return desc;
+	if (priv->quota && priv->shared + contig_desc_bytes(desc) > priv->quota) {
+		contig_free(desc);
+		return ERR_PTR(-EDQUOT);
+	}
+	priv->shared += contig_desc_bytes(desc);
+	return desc;
+}
+
+/* Called with priv->lock held */
+static void contig_file_free(struct contig_file *priv, struct contig_desc *desc)
+{
+	if (!desc->resv)
+		priv->shared -= contig_desc_bytes(desc);
+	contig_free(desc);
+}
+
 static long contig_alloc_ioctl(struct file *file, void __user *arg)
 {
 	struct contig_file *priv = file->private_data;
 	struct contig_alloc_req req;
 	struct contig_desc *desc;
+	long rc = 0;
 
 	if (copy_from_user(&req, arg, sizeof(req)))
 		return -EFAULT;
@@ -522,28 +1137,38 @@ static long contig_alloc_ioctl(struct file *file, void __user *arg)
 	if (!contig_alloc_ok(&req.params))
 		return -EINVAL;
 
-	desc = contig_alloc(&req.params, req.size);
-	if (IS_ERR(desc))
-		return PTR_ERR(desc);
+	mutex_lock(&priv->lock);
+	desc = contig_file_alloc(priv, &req.params, req.size);
+	if (IS_ERR(desc)) {
+		rc = PTR_ERR(desc);
+		goto out;
+	}
 
 	if (desc->n > req.n_max) {
-		contig_free(desc);
-		return -EINVAL;
+		rc = -EINVAL;
+		goto err;
 	}
 
 	if (copy_to_user(req.arr, desc->arr, sizeof(*desc->arr) * desc->n)) {
-		contig_free(desc);
-		return -EFAULT;
+		rc = -EFAULT;
+		goto err;
 	}
 	req.n = desc->n;
+	req.chunk_log = desc->chunk_log;
 	req.khandle = (contig_khandle_t)desc;
 	req.most_allocated = desc->most_allocated;
 	if (copy_to_user(arg, &req, sizeof(req))) {
-		contig_free(desc);
-		return -EFAULT;
+		rc = -EFAULT;
+		goto err;
 	}
 	list_add(&desc->file_node, &priv->desc_list);
-	return 0;
+	goto out;
+
+ err:
+	contig_file_free(priv, desc);
+ out:
+	mutex_unlock(&priv->lock);
+	return rc;
 }
 
 static long contig_free_ioctl(struct file *file, contig_khandle_t __user *arg)
@@ -558,6 +1183,7 @@ static long contig_free_ioctl(struct file *file, contig_khandle_t __user *arg)
 	del = (struct contig_desc *)del_addr;
 
 	/* is it a valid descriptor for this file? */
+	mutex_lock(&priv->lock);
 	list_for_each_entry_safe(desc, next, &priv->desc_list, file_node) {
 		if (desc == del) {
 			list_del(&del->file_node);
@@ -565,10 +1191,10 @@ static long contig_free_ioctl(struct file *file, contig_khandle_t __user *arg)
 			break;
 		}
 	}
-	if (!found)
-		return -EFAULT;
-	contig_free(del);
-	return 0;
+	if (found)
+		contig_file_free(priv, del);
+	mutex_unlock(&priv->lock);
+	return found ? 0 : -EFAULT;
 }
 
 static long contig_chunk_size_ioctl(struct file *file, void __user *arg)
@@ -578,6 +1204,80 @@ static long contig_chunk_size_ioctl(struct file *file, void __user *arg)
 	return 0;
 }
 
+static long contig_resv_ioctl(struct file *file, unsigned int cm, void __user *arg)
+{
+	struct contig_resv_req req;
+	kuid_t uid = INVALID_UID;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	req.name[CONTIG_RESV_NAME_MAX - 1] = '\0';
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (cm == CONTIG_IOC_RESV_DESTROY)
+		return contig_resv_destroy(req.name);
+
+	if (req.uid >= 0) {
+		uid = make_kuid(current_user_ns(), req.uid);
+		if (!uid_valid(uid))
+			return -EINVAL;
+	}
+	return contig_resv_create(req.name, req.size, req.ddr_node, uid);
+}
+
+/* An empty name detaches the file from its reservation */
+static long contig_resv_attach_ioctl(struct file *file, void __user *arg)
+{
+	struct contig_file *priv = file->private_data;
+	struct contig_resv *resv = NULL;
+	struct contig_resv_req req;
+	long rc = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	req.name[CONTIG_RESV_NAME_MAX - 1] = '\0';
+
+	mutex_lock(&priv->lock);
+	mutex_lock(&contig_lock);
+	if (req.name[0]) {
+		resv = contig_resv_find(req.name);
+		if (resv == NULL)
+			rc = -ENOENT;
+		else if (uid_valid(resv->uid) && !uid_eq(resv->uid, current_euid()) && !capable(CAP_SYS_ADMIN))
+			rc = -EPERM;
+		else
+			resv->users++;
+	}
+	if (!rc) {
+		if (priv->resv)
+			priv->resv->users--;
+		priv->resv = resv;
+	}
+	mutex_unlock(&contig_lock);
+	mutex_unlock(&priv->lock);
+	return rc;
+}
+
+/* Anyone may tighten the quota of a file; relaxing it needs CAP_SYS_ADMIN */
+static long contig_set_quota_ioctl(struct file *file, unsigned long __user *arg)
+{
+	struct contig_file *priv = file->private_data;
+	unsigned long quota;
+	long rc = 0;
+
+	if (get_user(quota, arg))
+		return -EFAULT;
+
+	mutex_lock(&priv->lock);
+	if (priv->quota && (!quota || quota > priv->quota) && !capable(CAP_SYS_ADMIN))
+		rc = -EPERM;
+	else
+		priv->quota = quota;
+	mutex_unlock(&priv->lock);
+	return rc;
+}
+
 static long contig_do_ioctl(struct file *file, unsigned int cm, void __user *arg)
 {
 	switch (cm) {
@@ -587,6 +1287,13 @@ static long contig_do_ioctl(struct file *file, unsigned int cm, void __user *arg
 		return contig_free_ioctl(file, arg);
 	case CONTIG_IOC_CHUNK_LOG:
 		return contig_chunk_size_ioctl(file, arg);
+	case CONTIG_IOC_RESV_CREATE:
+	case CONTIG_IOC_RESV_DESTROY:
+		return contig_resv_ioctl(file, cm, arg);
+	case CONTIG_IOC_RESV_ATTACH:
+		return contig_resv_attach_ioctl(file, arg);
+	case CONTIG_IOC_SET_QUOTA:
+		return contig_set_quota_ioctl(file, arg);
 	default:
 		return -ENOTTY;
 	}
@@ -597,6 +1304,50 @@ static long contig_ioctl(struct file *file, unsigned int cm, unsigned long arg)
 	return contig_do_ioctl(file, cm, (void __user *)arg);
 }
 
+/* Each mapping holds a reference, so that the chunks outlive CONTIG_IOC_FREE */
+static void contig_vm_open(struct vm_area_struct *vma)
+{
+	struct contig_desc *desc = vma->vm_private_data;
+
+	mutex_lock(&contig_lock);
+	kref_get(&desc->kref);
+	desc->nmaps++;
+	mutex_unlock(&contig_lock);
+}
+
+static void contig_vm_close(struct vm_area_struct *vma)
+{
+	struct contig_desc *desc = vma->vm_private_data;
+
+	mutex_lock(&contig_lock);
+	if (--desc->nmaps == 0)
+		desc->mapping = NULL;
+	kref_put(&desc->kref, contig_desc_release);
+	mutex_unlock(&contig_lock);
+}
+
+/* Map back a page unmapped by contig_clean(): the CPU touches the buffer */
+static vm_fault_t contig_vm_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct contig_desc *desc = vma->vm_private_data;
+	unsigned long offset = (vmf->pgoff - vma->vm_pgoff) << PAGE_SHIFT;
+	unsigned long chunk = offset >> desc->chunk_log;
+
+	if (chunk >= desc->n)
+		return VM_FAULT_SIGBUS;
+
+	contig_set_cached(desc);
+	return vmf_insert_pfn(vma, vmf->address,
+			PHYS_PFN(desc->arr[chunk] + (offset & ((1UL << desc->chunk_log) - 1))));
+}
+
+static const struct vm_operations_struct contig_vm_ops = {
+	.open	= contig_vm_open,
+	.close	= contig_vm_close,
+	.fault	= contig_vm_fault,
+};
+
 static int contig_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	int i, rc;
@@ -610,6 +1361,10 @@ static int contig_mmap(struct file *file, struct vm_area_struct *vma)
 		if (itr->arr[0] == paddr) {
 			found = true;
 			desc = itr;
+			kref_get(&desc->kref);
+			desc->nmaps++;
+			desc->mapping = file->f_mapping;
+			desc->cached = true;
 			break;
 		}
 	}
@@ -620,21 +1375,232 @@ static int contig_mmap(struct file *file, struct vm_area_struct *vma)
 		return -EFAULT;
 	}
 
-
+	vma->vm_private_data = desc;
 	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 
 	for (i = 0; i < desc->n; i++) {
 		/* pr_info("contig_mmap: paddr[%d] = %08lX\n", i, desc->arr[i]); */
-		rc = remap_pfn_range(vma, vma->vm_start + i * chunk_size, PHYS_PFN(desc->arr[i]),
-				chunk_size, vma->vm_page_prot);
+		rc = remap_pfn_range(vma, vma->vm_start + ((unsigned long)i << desc->chunk_log),
+				PHYS_PFN(desc->arr[i]), 1UL << desc->chunk_log, vma->vm_page_prot);
 
-		if (rc)
+		if (rc) {
+			contig_vm_close(vma);
 			return rc;
+		}
 	}
 
+	vma->vm_ops = &contig_vm_ops;
 	return 0;
 }
 
+/* Number of runs of physically adjacent chunks in @desc */
+static unsigned int contig_desc_runs(const struct contig_desc *desc)
+{
+	unsigned int runs = 1;
+	int i;
+
+	for (i = 1; i < desc->n; i++)
+		if (desc->arr[i] != desc->arr[i - 1] + (1UL << desc->chunk_log))
+			runs++;
+	return runs;
+}
+
+/*
+ * One "node free_chunks free_runs largest_run" line per DDR node, in
+ * chunk_log chunks, then one line per chunk class with the number of live
+ * buffers, their chunks, and the runs of adjacent chunks they are made of.
+ */
+static ssize_t fragmentation_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	unsigned long chunks[MAX_CHUNK_CLASSES] = { 0 }, runs[MAX_CHUNK_CLASSES] = { 0 };
+	unsigned int buffers[MAX_CHUNK_CLASSES] = { 0 };
+	unsigned long start, end, len;
+	unsigned long free, free_runs, largest;
+	struct contig_desc *desc;
+	ssize_t count = 0;
+	int i, c;
+
+	mutex_lock(&contig_lock);
+	for (i = 0; i < nddr; i++) {
+		unsigned long *map = chunk_map[i];
+		unsigned long n = node_chunks[i];
+
+		free = free_runs = largest = 0;
+		for (start = find_next_zero_bit(map, n, 0); start < n;
+		     start = find_next_zero_bit(map, n, end)) {
+			end = find_next_bit(map, n, start);
+			len = end - start;
+			free += len;
+			free_runs++;
+			largest = max(largest, len);
+		}
+		count += scnprintf(buf + count, PAGE_SIZE - count,
+				"node %d free_chunks %lu free_runs %lu largest_run %lu\n",
+				i, free, free_runs, largest);
+	}
+
+	list_for_each_entry(desc, &desc_list, desc_node) {
+		c = contig_class_index(desc->chunk_log);
+		buffers[c]++;
+		chunks[c] += desc->n;
+		runs[c] += contig_desc_runs(desc);
+	}
+	mutex_unlock(&contig_lock);
+
+	for (c = 0; c < nclasses; c++)
+		count += scnprintf(buf + count, PAGE_SIZE - count,
+				"chunk_log %u buffers %u chunks %lu runs %lu\n",
+				class_log[c], buffers[c], chunks[c], runs[c]);
+	return count;
+}
+static DEVICE_ATTR_RO(fragmentation);
+
+/*
+ * One "node busy placed allocated" line per DDR node: the average traffic in
+ * words per sampling period (0 without monitors), then the bytes placed by
+ * the least-busy policy since the last sample and the bytes allocated.
+ */
+static ssize_t ddr_load_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	ssize_t count = 0;
+	int i;
+
+	mutex_lock(&contig_lock);
+	for (i = 0; i < nddr; i++)
+		count += scnprintf(buf + count, PAGE_SIZE - count, "%d %lu %lu %lu\n",
+				i, node_busy[i], node_placed[i], mem_allocated[i]);
+	mutex_unlock(&contig_lock);
+	return count;
+}
+static DEVICE_ATTR_RO(ddr_load);
+
+/* One "name node size allocated users" line per reservation, sizes in bytes */
+static ssize_t reservations_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct contig_resv *resv;
+	unsigned long allocated;
+	ssize_t count = 0;
+
+	mutex_lock(&contig_lock);
+	list_for_each_entry(resv, &resv_list, node) {
+		mutex_lock(&resv->lock);
+		allocated = resv->allocated;
+		mutex_unlock(&resv->lock);
+		count += scnprintf(buf + count, PAGE_SIZE - count, "%s %d %lu %lu %u\n",
+				resv->name, resv->ddr_node, resv->n << contig_chunk_size_log,
+				allocated, resv->users);
+	}
+	mutex_unlock(&contig_lock);
+	return count;
+}
+static DEVICE_ATTR_RO(reservations);
+
+/* Create the reservations listed in the reserve parameter */
+static void __init contig_resv_init(void)
+{
+	char *list, *p, *spec, *name, *size;
+	int ddr_node;
+	int rc;
+
+	if (reserve == NULL)
+		return;
+	list = kstrdup(reserve, GFP_KERNEL);
+	if (list == NULL)
+		return;
+
+	p = list;
+	while ((spec = strsep(&p, ",")) != NULL) {
+		name = strsep(&spec, ":");
+		size = strsep(&spec, ":");
+		ddr_node = 0;
+		if (size == NULL || (spec && kstrtoint(spec, 0, &ddr_node))) {
+			pr_warn(PFX "reservations are name:size[:node]\n");
+			continue;
+		}
+		rc = contig_resv_create(name, memparse(size, NULL), ddr_node, INVALID_UID);
+		if (rc)
+			pr_warn(PFX "cannot reserve %s for %s: %d\n", size, name, rc);
+	}
+	kfree(list);
+}
+
+/* Latch the monitors of every memory tile and read their DDR and DMA counters */
+static void contig_mon_read(u32 *now)
+{
+	int i;
+
+	for (i = 0; i < nddr; i++)
+		iowrite32(1, node_mon[i] + MON_BURST_REG);
+	mb();
+	/* both counters wrap, but so does their sum */
+	for (i = 0; i < nddr; i++)
+		now[i] = ioread32(node_mon[i] + MON_DDR_WORDS_REG) +
+			ioread32(node_mon[i] + MON_DMA_REQS_REG);
+	mb();
+	/* let the counters run again, as libmonitors does after its reads */
+	for (i = 0; i < nddr; i++)
+		iowrite32(0, node_mon[i] + MON_BURST_REG);
+}
+
+static void contig_mon_sample(struct work_struct *work)
+{
+	u32 now[MAX_DDR_NODES];
+	int i;
+
+	contig_mon_read(now);
+
+	mutex_lock(&contig_lock);
+	for (i = 0; i < nddr; i++) {
+		node_busy[i] = (3 * node_busy[i] + (u32)(now[i] - node_mon_last[i])) / 4;
+		node_mon_last[i] = now[i];
+		node_placed[i] = 0;
+	}
+	mutex_unlock(&contig_lock);
+
+	schedule_delayed_work(&contig_mon_work, msecs_to_jiffies(mon_period_ms));
+}
+
+static void contig_mon_exit(void)
+{
+	int i;
+
+	if (node_mon[0])
+		cancel_delayed_work_sync(&contig_mon_work);
+	for (i = 0; i < nddr; i++) {
+		if (node_mon[i])
+			iounmap(node_mon[i]);
+		node_mon[i] = NULL;
+	}
+}
+
+/* Without monitors, the least-busy policy goes by allocated memory */
+static void __init contig_mon_init(void)
+{
+	int i;
+
+	if (!mon_base)
+		return;
+	if (!noc_cols || !mon_period_ms || n_ddr_y != nddr || n_ddr_x != nddr) {
+		pr_warn(PFX "mon_base needs noc_cols, mon_period_ms, ddr_y and ddr_x; not sampling DDR traffic\n");
+		return;
+	}
+
+	for (i = 0; i < nddr; i++) {
+		unsigned long tile = ddr_y[i] * noc_cols + ddr_x[i];
+
+		node_mon[i] = ioremap(mon_base + tile * MON_TILE_SIZE, MON_TILE_SIZE);
+		if (!node_mon[i]) {
+			pr_warn(PFX "cannot map the monitors of DDR node %d; not sampling DDR traffic\n", i);
+			contig_mon_exit();
+			return;
+		}
+	}
+
+	contig_mon_read(node_mon_last);
+	INIT_DELAYED_WORK(&contig_mon_work, contig_mon_sample);
+	schedule_delayed_work(&contig_mon_work, msecs_to_jiffies(mon_period_ms));
+}
+
 static int __init contig_create_file(void)
 {
 	contig_class = class_create(THIS_MODULE, "contig_alloc");
@@ -644,9 +1610,17 @@ static int __init contig_create_file(void)
 	if (register_chrdev(CONTIG_MAJOR, "contig_alloc", &contig_fops))
 		goto err_chrdev;
 
-	if (IS_ERR(device_create(contig_class, NULL, MKDEV(CONTIG_MAJOR, CONTIG_MINOR), NULL, "contig_alloc")))
+	contig_dev = device_create(contig_class, NULL, MKDEV(CONTIG_MAJOR, CONTIG_MINOR), NULL, "contig_alloc");
+	if (IS_ERR(contig_dev))
 		goto err_device_create;
 
+	if (device_create_file(contig_dev, &dev_attr_fragmentation))
+		pr_info(PFX "cannot create fragmentation attribute\n");
+	if (device_create_file(contig_dev, &dev_attr_ddr_load))
+		pr_info(PFX "cannot create ddr_load attribute\n");
+	if (device_create_file(contig_dev, &dev_attr_reservations))
+		pr_info(PFX "cannot create reservations attribute\n");
+
 	return 0;
 
  err_device_create:
@@ -658,6 +1632,9 @@ static int __init contig_create_file(void)
 
 static void contig_remove_file(void)
 {
+	device_remove_file(contig_dev, &dev_attr_reservations);
+	device_remove_file(contig_dev, &dev_attr_ddr_load);
+	device_remove_file(contig_dev, &dev_attr_fragmentation);
 	device_destroy(contig_class, MKDEV(CONTIG_MAJOR, CONTIG_MINOR));
 	unregister_chrdev(CONTIG_MAJOR, "contig_alloc");
 	class_destroy(contig_class);
@@ -672,6 +1649,16 @@ static int __init contig_init(void)
 		return -EINVAL;
 	chunk_size = BIT(contig_chunk_size_log);
 
+	class_log[0] = contig_chunk_size_log;
+	for (i = 0; i < n_extra_classes; i++) {
+		if (extra_class_log[i] <= class_log[i] || extra_class_log[i] >= 32) {
+			pr_err(PFX "chunk classes must grow from chunk_log and stay below 32\n");
+			return -EINVAL;
+		}
+		class_log[i + 1] = extra_class_log[i];
+	}
+	nclasses = n_extra_classes + 1;
+
 #ifndef CONFIG_BIGPHYS_AREA
 	if (!mem_start[0])
 		return -EINVAL;
@@ -683,7 +1670,6 @@ static int __init contig_init(void)
 	}
 
 	for (i = 0; i < nddr; i++) {
-		INIT_LIST_HEAD(&inactive_chunks[i]);
 		if (mem_size[i] % chunk_size) {
 			pr_warn(PFX "chunk_size (0x%lx) does not divide evenly mem_size[%d] (0x%lx); discarding %ld bytes\n",
 				chunk_size, i, mem_size[i], mem_size[i] % chunk_size);
@@ -708,6 +1694,8 @@ static int __init contig_init(void)
 			goto err_chunks;
 	}
 
+	contig_resv_init();
+	contig_mon_init();
 	return 0;
 
  err_chunks:
@@ -718,10 +1706,15 @@ static int __init contig_init(void)
 static void contig_exit(void)
 {
 	struct contig_desc *desc, *nxt;
+	struct contig_resv *resv, *rnxt;
 
+	contig_mon_exit();
 	list_for_each_entry_safe(desc, nxt, &desc_list, desc_node) {
 		__contig_free(desc);
 	}
+	list_for_each_entry_safe(resv, rnxt, &resv_list, node) {
+		__contig_resv_destroy(resv);
+	}
 	__contig_chunks_remove();
 	contig_phys_free();
 	contig_remove_file();
@@ -50,7 +50,7 @@ static int contig_init(void)
 	int local_fd;
 	int rc = -1;
 
-	if (likely(atomic_read(&fd)))
+	if (likely(__atomic_load_n(&fd, __ATOMIC_ACQUIRE)))
 		return 0;
 
 	local_fd = open(CONTIG_ALLOC_DEV, O_RDWR);
@@ -63,74 +63,316 @@ static int contig_init(void)
 	if (atomic_read(&fd)) {
 		if (close(local_fd) < 0)
 			goto unlock;
-	} else {
-		atomic_set(&fd, local_fd);
+		rc = 0;
+		goto unlock;
 	}
 
-	if (ioctl(fd, CONTIG_IOC_CHUNK_LOG, &chunk_log) < 0)
+	if (ioctl(local_fd, CONTIG_IOC_CHUNK_LOG, &chunk_log) < 0) {
+		close(local_fd);
 		goto unlock;
+	}
 	chunk_size = 1 << chunk_log;
 	chunk_mask = ~(chunk_size - 1);
+
+	/* publish fd only once the chunk size is known */
+	__atomic_store_n(&fd, local_fd, __ATOMIC_RELEASE);
 	rc = 0;
  unlock:
 	pthread_mutex_unlock(&lock);
 	return rc;
 }
 
-void *contig_alloc(unsigned long size, contig_handle_t *handle)
+/*
+ * Buffer pool. Freed buffers are kept mapped and handed out again to
+ * allocations of the same number of chunks and the same policy, saving the
+ * alloc/free ioctls and the mmap/munmap. Idle buffers are bounded by
+ * pool_retain bytes; a small per-thread cache in front of the shared pool
+ * serves threads that free and allocate the same buffers without locking.
+ * Reused buffers are not cleared, so the pool is off until the application
+ * sets a bound with contig_pool_set_retain().
+ */
+#define CONTIG_POOL_BUCKETS		64
+#define CONTIG_POOL_THREAD_MAX		16
+#define CONTIG_POOL_DEFAULT_THREAD	4
+
+/* the handle points to req, so req must stay first */
+struct contig_buf {
+	struct contig_alloc_req req;
+	struct contig_buf *next;
+};
+
+struct contig_thread_cache {
+	unsigned int n;
+	unsigned int gen;	/* pool_gen when the cache was last trimmed */
+	struct contig_buf *bufs[CONTIG_POOL_THREAD_MAX];
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct contig_buf *pool[CONTIG_POOL_BUCKETS];
+static unsigned long pool_retain;
+static unsigned int pool_gen;	/* bumped each time pool_retain changes */
+static unsigned int pool_thread_max = CONTIG_POOL_DEFAULT_THREAD;
+static struct contig_pool_stats pool_stats;
+
+static __thread struct contig_thread_cache *tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+#define stat_add(field, v)	__atomic_add_fetch(&pool_stats.field, (v), __ATOMIC_RELAXED)
+#define stat_sub(field, v)	__atomic_sub_fetch(&pool_stats.field, (v), __ATOMIC_RELAXED)
+#define stat_read(field)	__atomic_load_n(&pool_stats.field, __ATOMIC_RELAXED)
+
+static inline unsigned long buf_bytes(const struct contig_buf *buf)
 {
-	struct contig_alloc_req *req;
-	unsigned long flags = PROT_READ | PROT_WRITE;
+	return (unsigned long)buf->req.n << buf->req.chunk_log;
+}
 
-	if (unlikely(contig_init()))
-		return NULL;
-	req = calloc(1, sizeof(*req));
-	if (unlikely(req == NULL))
-		return NULL;
-	req->n_max = DIV_ROUND_UP(size, chunk_size);
+static bool params_match(const struct contig_alloc_params *a, const struct contig_alloc_params *b)
+{
+	if (a->policy != b->policy || a->chunk_log != b->chunk_log)
+		return false;
+
+	switch (a->policy) {
+	case CONTIG_ALLOC_PREFERRED:
+		return a->pol.first.ddr_node == b->pol.first.ddr_node;
+	case CONTIG_ALLOC_LEAST_LOADED:
+		return a->pol.lloaded.threshold == b->pol.lloaded.threshold;
+	case CONTIG_ALLOC_BALANCED:
+		return a->pol.balanced.threshold == b->pol.balanced.threshold &&
+			a->pol.balanced.cluster_size == b->pol.balanced.cluster_size;
+	case CONTIG_ALLOC_LEAST_BUSY:
+		return a->pol.lbusy.y == b->pol.lbusy.y && a->pol.lbusy.x == b->pol.lbusy.x &&
+			a->pol.lbusy.hop_cost == b->pol.lbusy.hop_cost;
+	case CONTIG_ALLOC_INTERLEAVED:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	req->arr = calloc(req->n_max, sizeof(*req->arr));
-	if (unlikely(req->arr == NULL))
-		goto err_arr;
+static void contig_release(struct contig_buf *buf)
+{
+	struct contig_alloc_req *req = &buf->req;
 
-	req->size = size;
+	if (ioctl(fd, CONTIG_IOC_FREE, &req->khandle)) {
+		fprintf(stderr, PFX "error: %s: cannot free handle %p\n", __func__, req);
+		perror(NULL);
+		abort();
+	}
+	if (munmap(req->mm, (unsigned long)req->n << req->chunk_log))
+		fprintf(stderr, PFX "munmap failed for %p\n", req->mm);
+	free(req->arr);
+	free(buf);
+}
 
-	/* Default policy is get chunks in order */
-	req->params.policy = CONTIG_ALLOC_PREFERRED;
-	req->params.pol.first.ddr_node = 0;
+/* Called with pool_lock held */
+static void pool_put(struct contig_buf *buf)
+{
+	struct contig_buf **head = &pool[buf->req.n_max % CONTIG_POOL_BUCKETS];
 
-	if (ioctl(fd, CONTIG_IOC_ALLOC, req) < 0)
-		goto err_ioctl;
+	buf->next = *head;
+	*head = buf;
+	stat_add(idle_buffers, 1);
+}
 
-	req->mm = mmap(NULL, req->n * chunk_size, flags, MAP_SHARED, fd, req->arr[0]);
-	if (req->mm == MAP_FAILED) {
-		goto err_mmap;
-	}
+/* Called with pool_lock held */
+static struct contig_buf *pool_get(unsigned int n_max, const struct contig_alloc_params *params)
+{
+	struct contig_buf **pp;
 
-	*handle = (contig_handle_t)req;
-	return req->mm;
+	for (pp = &pool[n_max % CONTIG_POOL_BUCKETS]; *pp != NULL; pp = &(*pp)->next) {
+		struct contig_buf *buf = *pp;
 
- err_mmap:
-	if (munmap(req->mm, chunk_size))
-		fprintf(stderr, PFX "munmap failed for %p\n", req->mm);
- err_ioctl:
-	free(req->arr);
- err_arr:
-	free(req);
+		if (buf->req.n_max == n_max && params_match(&buf->req.params, params)) {
+			*pp = buf->next;
+			stat_sub(idle_buffers, 1);
+			return buf;
+		}
+	}
 	return NULL;
 }
 
-void *contig_alloc_policy(struct contig_alloc_params params, unsigned long size, contig_handle_t *handle)
+/*
+ * Unlink idle buffers until they fit in @retain bytes and return them, for
+ * pool_release() once pool_lock is dropped. Called with pool_lock held.
+ */
+static struct contig_buf *pool_trim(unsigned long retain)
+{
+	struct contig_buf *victims = NULL;
+	int i;
+
+	for (i = 0; i < CONTIG_POOL_BUCKETS && stat_read(idle_bytes) > retain; i++) {
+		while (pool[i] != NULL && stat_read(idle_bytes) > retain) {
+			struct contig_buf *buf = pool[i];
+
+			pool[i] = buf->next;
+			stat_sub(idle_buffers, 1);
+			stat_sub(idle_bytes, buf_bytes(buf));
+			buf->next = victims;
+			victims = buf;
+		}
+	}
+	return victims;
+}
+
+/* Give the buffers returned by pool_trim() back to the kernel */
+static void pool_release(struct contig_buf *victims)
+{
+	struct contig_buf *buf;
+
+	while (victims != NULL) {
+		buf = victims;
+		victims = buf->next;
+		stat_add(releases, 1);
+		contig_release(buf);
+	}
+}
+
+/*
+ * Move the buffers of a per-thread cache to the shared pool, then trim the
+ * pool to pool_retain, or to nothing if @drain is set.
+ */
+static void tcache_flush(struct contig_thread_cache *cache, bool drain)
+{
+	struct contig_buf *victims;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool_lock);
+	if (cache != NULL) {
+		for (i = 0; i < cache->n; i++)
+			pool_put(cache->bufs[i]);
+		cache->n = 0;
+		cache->gen = pool_gen;
+	}
+	victims = pool_trim(drain ? 0 : pool_retain);
+	pthread_mutex_unlock(&pool_lock);
+	pool_release(victims);
+}
+
+/*
+ * contig_pool_set_retain() only trims the shared pool; each thread trims
+ * its own cache on its next pool operation after the bound changed.
+ */
+static inline void tcache_check(void)
+{
+	if (unlikely(tcache != NULL && tcache->gen != atomic_read(&pool_gen)))
+		tcache_flush(tcache, false);
+}
+
+static void tcache_destroy(void *ptr)
+{
+	struct contig_thread_cache *cache = ptr;
+
+	tcache_flush(cache, false);
+	free(cache);
+}
+
+static void tcache_key_init(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static struct contig_thread_cache *tcache_get(void)
+{
+	if (likely(tcache != NULL))
+		return tcache;
+
+	pthread_once(&tcache_once, tcache_key_init);
+	tcache = calloc(1, sizeof(*tcache));
+	if (tcache != NULL) {
+		tcache->gen = atomic_read(&pool_gen);
+		pthread_setspecific(tcache_key, tcache);
+	}
+	return tcache;
+}
+
+static struct contig_buf *contig_pool_alloc(unsigned int n_max, const struct contig_alloc_params *params)
+{
+	struct contig_thread_cache *cache = NULL;
+	struct contig_buf *buf = NULL;
+	unsigned int i;
+
+	tcache_check();
+	if (!atomic_read(&pool_retain))
+		return NULL;
+
+	if (atomic_read(&pool_thread_max))
+		cache = tcache_get();
+	if (cache != NULL) {
+		for (i = cache->n; i > 0; i--) {
+			if (cache->bufs[i - 1]->req.n_max == n_max &&
+				params_match(&cache->bufs[i - 1]->req.params, params)) {
+				buf = cache->bufs[i - 1];
+				cache->bufs[i - 1] = cache->bufs[--cache->n];
+				stat_add(thread_hits, 1);
+				break;
+			}
+		}
+	}
+
+	if (buf == NULL) {
+		pthread_mutex_lock(&pool_lock);
+		buf = pool_get(n_max, params);
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	if (buf != NULL) {
+		stat_sub(idle_bytes, buf_bytes(buf));
+		stat_add(hits, 1);
+	}
+	return buf;
+}
+
+/* Returns false if the pool is full and the buffer must be released */
+static bool contig_pool_free(struct contig_buf *buf)
+{
+	struct contig_thread_cache *cache = NULL;
+	unsigned long bytes = buf_bytes(buf);
+	unsigned int thread_max = atomic_read(&pool_thread_max);
+
+	tcache_check();
+	if (stat_add(idle_bytes, bytes) > atomic_read(&pool_retain)) {
+		stat_sub(idle_bytes, bytes);
+		return false;
+	}
+
+	if (thread_max)
+		cache = tcache_get();
+	if (cache != NULL && cache->n < thread_max) {
+		cache->bufs[cache->n++] = buf;
+		return true;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_put(buf);
+	pthread_mutex_unlock(&pool_lock);
+	return true;
+}
+
+static void *contig_do_alloc(const struct contig_alloc_params *params, unsigned long size, contig_handle_t *handle)
 {
 	struct contig_alloc_req *req;
+	struct contig_buf *buf;
 	unsigned long flags = PROT_READ | PROT_WRITE;
+	unsigned int n_max;
 
 	if (unlikely(contig_init()))
 		return NULL;
-	req = calloc(1, sizeof(*req));
-	if (unlikely(req == NULL))
+	n_max = DIV_ROUND_UP(size, chunk_size);
+
+	buf = contig_pool_alloc(n_max, params);
+	if (buf != NULL) {
+		buf->req.size = size;
+		*handle = (contig_handle_t)&buf->req;
+		return buf->req.mm;
+	}
+	stat_add(misses, 1);
+
+	buf = calloc(1, sizeof(*buf));
+	if (unlikely(buf == NULL))
 		return NULL;
-	req->n_max = DIV_ROUND_UP(size, chunk_size);
+	req = &buf->req;
+	req->n_max = n_max;
 
 	req->arr = calloc(req->n_max, sizeof(*req->arr));
 	if (unlikely(req->arr == NULL))
@@ -138,12 +380,12 @@ void *contig_alloc_policy(struct contig_alloc_params params, unsigned long size,
 
 	req->size = size;
 
-	req->params = params;
+	req->params = *params;
 
 	if (ioctl(fd, CONTIG_IOC_ALLOC, req) < 0)
 		goto err_ioctl;
 
-	req->mm = mmap(NULL, req->n * chunk_size, flags, MAP_SHARED, fd, req->arr[0]);
+	req->mm = mmap(NULL, (unsigned long)req->n << req->chunk_log, flags, MAP_SHARED, fd, req->arr[0]);
 	if (req->mm == MAP_FAILED) {
 		goto err_mmap;
 	}
@@ -152,33 +394,99 @@ void *contig_alloc_policy(struct contig_alloc_params params, unsigned long size,
 	return req->mm;
 
  err_mmap:
-	if (munmap(req->mm, chunk_size))
-		fprintf(stderr, PFX "munmap failed for %p\n", req->mm);
+	if (ioctl(fd, CONTIG_IOC_FREE, &req->khandle))
+		fprintf(stderr, PFX "cannot free handle %p\n", req);
  err_ioctl:
 	free(req->arr);
  err_arr:
-	free(req);
+	free(buf);
 	return NULL;
 }
 
+void *contig_alloc(unsigned long size, contig_handle_t *handle)
+{
+	struct contig_alloc_params params;
+
+	memset(&params, 0, sizeof(params));
+
+	/* Default policy is get chunks in order */
+	params.policy = CONTIG_ALLOC_PREFERRED;
+	params.pol.first.ddr_node = 0;
+
+	return contig_do_alloc(&params, size, handle);
+}
+
+void *contig_alloc_policy(struct contig_alloc_params params, unsigned long size, contig_handle_t *handle)
+{
+	return contig_do_alloc(&params, size, handle);
+}
+
 void contig_free(contig_handle_t handle)
 {
-	struct contig_alloc_req *req = (struct contig_alloc_req *)handle;
+	struct contig_buf *buf = (struct contig_buf *)handle;
 
-	assert(req);
+	assert(buf);
 	if (unlikely(contig_init())) {
 		fprintf(stderr, PFX "error: %s: cannot init contig\n", __func__);
 		abort();
 	}
-	if (ioctl(fd, CONTIG_IOC_FREE, &req->khandle)) {
-		fprintf(stderr, PFX "error: %s: cannot free handle %p\n", __func__, handle);
-		perror(NULL);
-		abort();
-	}
-	if (munmap(req->mm, chunk_size))
-		fprintf(stderr, PFX "munmap failed for %p\n", req->mm);
-	free(req->arr);
-	free(req);
+	stat_add(frees, 1);
+	if (contig_pool_free(buf))
+		return;
+	stat_add(releases, 1);
+	contig_release(buf);
+}
+
+void contig_pool_set_retain(unsigned long bytes)
+{
+	struct contig_buf *victims;
+
+	pthread_mutex_lock(&pool_lock);
+	atomic_set(&pool_retain, bytes);
+	atomic_set(&pool_gen, pool_gen + 1);
+	victims = pool_trim(bytes);
+	pthread_mutex_unlock(&pool_lock);
+	pool_release(victims);
+}
+
+void contig_pool_set_thread_cache(unsigned int nbufs)
+{
+	atomic_set(&pool_thread_max, min(nbufs, (unsigned int) CONTIG_POOL_THREAD_MAX));
+}
+
+void contig_pool_drain(void)
+{
+	tcache_flush(tcache, true);
+}
+
+void contig_pool_get_stats(struct contig_pool_stats *stats)
+{
+	stats->hits = stat_read(hits);
+	stats->thread_hits = stat_read(thread_hits);
+	stats->misses = stat_read(misses);
+	stats->frees = stat_read(frees);
+	stats->releases = stat_read(releases);
+	stats->idle_bytes = stat_read(idle_bytes);
+	stats->idle_buffers = stat_read(idle_buffers);
+}
+
+int contig_reserve_attach(const char *name)
+{
+	struct contig_resv_req req;
+
+	if (unlikely(contig_init()))
+		return -1;
+	memset(&req, 0, sizeof(req));
+	if (name != NULL)
+		strncpy(req.name, name, CONTIG_RESV_NAME_MAX - 1);
+	return ioctl(fd, CONTIG_IOC_RESV_ATTACH, &req);
+}
+
+int contig_set_quota(unsigned long bytes)
+{
+	if (unlikely(contig_init()))
+		return -1;
+	return ioctl(fd, CONTIG_IOC_SET_QUOTA, &bytes);
 }
 
 contig_khandle_t contig_to_khandle(contig_handle_t handle)
@@ -214,7 +522,7 @@ static void contig_copy(contig_handle_t handle, unsigned long offset, void *vadd
 		abort();
 	}
 
-	if (offset + size > req->n * chunk_size) {
+	if (offset + size > (unsigned long)req->n << req->chunk_log) {
 		fprintf(stderr, PFX "error: %s: out of bounds (offset 0x%lx + size %ld)\n",
 			__func__, offset, size);
 		abort();
@@ -6,13 +6,14 @@
 /*
  * esp.c
  * Accelerator-independent Linux module to manage an ESP accelerator.
- * The module requires these flags when it is installed:
- * - line_bytes
- * - l2_sets
- * - l2_ways
- * - llc_sets
- * - llc_ways
- * - llc_banks
+ * The cache geometry comes from the cache nodes of the device tree; the
+ * line_bytes, l2_sets, l2_ways, llc_sets, llc_ways and llc_banks flags
+ * override it when the module is installed, and are otherwise not needed.
+ * The rest is configured at run time through sysfs:
+ * - /sys/module/esp/parameters: flush_tracking, coh_learning, coh_explore
+ *   and wait_spin_us
+ * - the attributes of each accelerator device: wait_mode, coherence_table,
+ *   and the read-only tile, reconfigurable, wait_stats and sched_clients
  */
 
 #include <linux/platform_device.h>
@@ -33,6 +34,7 @@
 
 #define PFX "esp: "
 #define ESP_MAX_DEVICES	64
+#define ESP_PREPARED_MAX	64
 
 static DEFINE_SPINLOCK(esp_devices_lock);
 static LIST_HEAD(esp_devices);
@@ -44,401 +46,1734 @@ EXPORT_SYMBOL_GPL(esp_drivers_lock);
 EXPORT_SYMBOL_GPL(esp_drivers);
 
 
-/* These are overwritten whith insmod flags */
-static unsigned long cache_line_bytes = 16;
+/*
+ * Cache geometry. The defaults are replaced by the properties of the cache
+ * nodes in the device tree, which are in turn overridden by insmod flags.
+ */
+static unsigned long cache_line_bytes;
 module_param_named(line_bytes, cache_line_bytes, ulong, S_IRUGO);
-static unsigned long cache_l2_sets = 512;
+static unsigned long cache_l2_sets;
 module_param_named(l2_sets, cache_l2_sets, ulong, S_IRUGO);
-static unsigned long cache_l2_ways = 4;
+static unsigned long cache_l2_ways;
 module_param_named(l2_ways, cache_l2_ways, ulong, S_IRUGO);
-static unsigned long cache_llc_sets = 1024;
+static unsigned long cache_llc_sets;
 module_param_named(llc_sets, cache_llc_sets, ulong, S_IRUGO);
-static unsigned long cache_llc_ways = 16;
+static unsigned long cache_llc_ways;
 module_param_named(llc_ways, cache_llc_ways, ulong, S_IRUGO);
-static unsigned long cache_llc_banks = 1;
+static unsigned long cache_llc_banks;
 module_param_named(llc_banks, cache_llc_banks, ulong, S_IRUGO);
 static unsigned long rtl_cache = 1;
 module_param(rtl_cache, ulong, S_IRUGO);
 
-/* These are overwritten when the module initializes based on input flags */
+/* Skip the flush for buffers that nothing may have cached since the last one */
+static bool flush_tracking;
+module_param(flush_tracking, bool, S_IRUGO | S_IWUSR);
+
+/* Resolve ACC_COH_AUTO from measured run times rather than fixed thresholds */
+static bool coh_learning;
+module_param(coh_learning, bool, S_IRUGO | S_IWUSR);
+/* With coh_learning, one ACC_COH_AUTO invocation in coh_explore tries another mode */
+static unsigned int coh_explore = 16;
+module_param(coh_explore, uint, S_IRUGO | S_IWUSR);
+
+/* Longest a blocking invocation spins on STATUS_REG before sleeping, in us */
+static unsigned int wait_spin_us = 20;
+module_param(wait_spin_us, uint, S_IRUGO | S_IWUSR);
+
+static const char * const esp_wait_mode_names[ESP_WAIT_MODES] = {
+	[ESP_WAIT_IRQ] = "irq",
+	[ESP_WAIT_SPIN] = "spin",
+	[ESP_WAIT_ADAPTIVE] = "adaptive",
+};
+
+/* These are overwritten when the module initializes */
 static size_t cache_l2_size = 32768;
 static size_t cache_llc_bank_size = 262144;
 static size_t cache_llc_size = 262144;
 
+static const struct of_device_id esp_l2_match[] = {
+	{ .compatible = "sld,l2_cache" },
+	{ .compatible = "uiuc,spandex_l2" },
+	{ },
+};
+
+static const struct of_device_id esp_llc_match[] = {
+	{ .compatible = "sld,llc_cache" },
+	{ .compatible = "uiuc,spandex_llc" },
+	{ },
+};
+
 struct esp_status esp_status;
 
-static irqreturn_t esp_irq(int irq, void *dev)
+/* Time the invocations of a file waited for the accelerator, in ns */
+struct esp_sched_stats {
+	u64 dispatched;
+	u64 wait_ns;
+	u64 wait_max_ns;
+	u64 run_ns; /* accelerator time charged to the file */
+	u64 missed; /* invocations started after their deadline hint */
+};
+
+/*
+ * Per-open state. Invocations queued with ESP_IOC_SUBMIT belong to the file
+ * that submitted them and are returned to it by ESP_IOC_REAP.
+ */
+struct esp_file {
+	struct esp_device *esp;
+	/* the below are protected by esp->queue_lock */
+	struct list_head done;
+	unsigned int ndone;
+	unsigned int inflight; /* queued, running or done but not reaped */
+	wait_queue_head_t wq;
+	/* prepared invocations, protected by esp->lock */
+	struct esp_job *prepared[ESP_PREPARED_MAX];
+	/* mapped by user space, written under esp->queue_lock */
+	struct page *status_page;
+	struct esp_status_page *status;
+	/* scheduling, protected by esp->queue_lock */
+	struct list_head client; /* in esp->clients */
+	pid_t pid;
+	struct esp_sched_param sched;
+	u64 vruntime; /* accelerator time used, scaled by the weight */
+	unsigned int pending; /* invocations waiting for the accelerator */
+	struct esp_sched_stats stats;
+};
+
+/*
+ * An invocation waiting for the accelerator. Stages of a chain have no
+ * client and go before everything else.
+ */
+struct esp_sched_req {
+	struct esp_file *client;
+	unsigned int sched_class;
+	u64 issued;
+	u64 deadline; /* absolute, 0 if none */
+};
+
+/* A blocking invocation waiting in esp_queue_acquire() */
+struct esp_sync_waiter {
+	struct list_head list;
+	struct esp_sched_req sched;
+	bool granted;
+};
+
+/* An invocation; the driver-specific access struct follows it in memory */
+struct esp_job {
+	struct list_head list;
+	struct esp_file *owner;
+	struct contig_desc *contig; /* pinned with contig_get() */
+	struct esp_access *access;
+	struct esp_xfer_regs regs;
+	enum accelerator_coherence coherence; /* as requested by user space */
+	u64 tag;
+	int err;
+	ktime_t start;
+	unsigned long long hw_ns;
+	u64 ts_flush, ts_run, ts_done; /* synchronous runs only */
+	u64 flush_ns;
+	int coh_bucket, coh_load; /* learning table row, coh_bucket < 0 if none */
+	struct esp_chain *chain; /* set for the stages of ESP_IOC_RUN_CHAIN */
+	unsigned int stage;
+	struct esp_sched_req sched;
+};
+
+/*
+ * An ESP_IOC_RUN_CHAIN in progress. The stages of a segment are queued one
+ * after the other from the interrupt of the previous stage; the calling
+ * thread flushes the caches and starts each segment. The coherence of a
+ * stage is resolved when it comes up, and one that then needs a flush ends
+ * the segment.
+ */
+struct esp_chain {
+	struct esp_device *esp[ESP_CHAIN_MAX];
+	struct esp_job *job[ESP_CHAIN_MAX];
+	unsigned int n;
+	unsigned int n_config; /* stages resolved with esp_job_resolve() */
+	unsigned int n_done; /* stages that completed successfully */
+	enum accelerator_coherence flushed; /* as for esp_job_flush() */
+	bool abort; /* do not start further stages */
+	struct completion done; /* end of the segment in progress */
+};
+
+static void esp_run(struct esp_device *esp)
+{
+	iowrite32be(0x1, esp->iomem + CMD_REG);
+}
+
+#define esp_write_xfer_reg(_esp, _regs, _field, _reg)				\
+	do {									\
+		if (!(_esp)->regs_valid || (_esp)->regs._field != (_regs)->_field) \
+			iowrite32be((_regs)->_field, (_esp)->iomem + (_reg));	\
+	} while (0)
+
+/*
+ * Program the page table, coherence and P2P registers, skipping the ones that
+ * already hold the right value. The caller must own the accelerator.
+ */
+static void esp_transfer(struct esp_device *esp, const struct esp_xfer_regs *regs)
+{
+	esp_write_xfer_reg(esp, regs, pt_address, PT_ADDRESS_REG);
+	esp_write_xfer_reg(esp, regs, pt_address_ext, PT_ADDRESS_EXTENDED_REG);
+	esp_write_xfer_reg(esp, regs, pt_shift, PT_SHIFT_REG);
+	esp_write_xfer_reg(esp, regs, pt_nchunk, PT_NCHUNK_REG);
+	esp_write_xfer_reg(esp, regs, coherence, COHERENCE_REG);
+	esp_write_xfer_reg(esp, regs, p2p, P2P_REG);
+
+	esp->regs = *regs;
+	esp->regs_valid = true;
+}
+
+/* Program the accelerator-specific registers. The caller must own the accelerator. */
+static void esp_prep_xfer(struct esp_device *esp, struct esp_access *access)
+{
+	iowrite32be(access->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(access->dst_offset, esp->iomem + DST_OFFSET_REG);
+
+	if (esp->driver->prep_xfer)
+		esp->driver->prep_xfer(esp, access);
+}
+
+static void esp_job_set_device(struct esp_device *esp, struct esp_job *job)
+{
+	struct esp_access *access = job->access;
+
+	esp->coherence = access->coherence;
+	esp->footprint = access->footprint;
+	esp->alloc_policy = access->alloc_policy;
+	esp->ddr_node = access->ddr_node;
+	esp->in_place = access->in_place;
+	esp->reuse_factor = access->reuse_factor;
+}
+
+static void esp_status_account(struct esp_access *access);
+static void esp_update_status(struct esp_access *access);
+
+/*
+ * Program the accelerator for @job, which counts in esp_status until it
+ * completes. Called with esp->queue_lock held.
+ */
+static void esp_job_start(struct esp_device *esp, struct esp_job *job)
+{
+	esp_job_set_device(esp, job);
+	esp_status_account(job->access);
+	esp_transfer(esp, &job->regs);
+	esp_prep_xfer(esp, job->access);
+
+	esp->last_prepared = NULL;
+	esp->running = job;
+	job->start = ktime_get();
+	esp_run(esp);
+}
+
+/*
+ * Scheduler. Invocations are served by class, then by deadline hint, then
+ * by the accelerator time their file used, scaled by its weight (vruntime).
+ * A file that starts waiting after being idle catches up with the others,
+ * so that it cannot bank the time it did not use. Called with
+ * esp->queue_lock held.
+ */
+static void esp_sched_enqueue(struct esp_device *esp, struct esp_sched_req *req,
+			struct esp_file *client)
+{
+	u64 now = ktime_get_ns();
+
+	req->client = client;
+	req->sched_class = client->sched.sched_class;
+	req->issued = now;
+	req->deadline = client->sched.deadline_ns ? now + client->sched.deadline_ns : 0;
+
+	if (!client->pending++)
+		client->vruntime = max(client->vruntime, esp->min_vruntime);
+}
+
+/* @req stops waiting without getting the accelerator */
+static void esp_sched_cancel(struct esp_sched_req *req)
+{
+	if (req->client)
+		req->client->pending--;
+}
+
+/* @req gets the accelerator */
+static void esp_sched_dispatch(struct esp_device *esp, struct esp_sched_req *req)
+{
+	struct esp_file *client = req->client;
+	struct esp_sched_stats *stats;
+	u64 now, wait;
+
+	if (client == NULL)
+		return;
+
+	now = ktime_get_ns();
+	wait = now - req->issued;
+	stats = &client->stats;
+	stats->dispatched++;
+	stats->wait_ns += wait;
+	stats->wait_max_ns = max(stats->wait_max_ns, wait);
+	if (req->deadline && now > req->deadline)
+		stats->missed++;
+
+	client->pending--;
+	esp->min_vruntime = max(esp->min_vruntime, client->vruntime);
+}
+
+/* Charge @ns of accelerator time to @client */
+static void esp_sched_charge(struct esp_file *client, u64 ns)
+{
+	if (client == NULL)
+		return;
+
+	client->stats.run_ns += ns;
+	client->vruntime += div_u64(ns * ESP_SCHED_WEIGHT_DEFAULT, client->sched.weight);
+}
+
+/* Whether @a should get the accelerator before @b */
+static bool esp_sched_before(const struct esp_sched_req *a, const struct esp_sched_req *b)
+{
+	if (!a->client || !b->client)
+		return !a->client && b->client;
+	if (a->sched_class != b->sched_class)
+		return a->sched_class < b->sched_class;
+	if (a->deadline != b->deadline) {
+		if (!a->deadline || !b->deadline)
+			return a->deadline != 0;
+		return a->deadline < b->deadline;
+	}
+	return a->client->vruntime < b->client->vruntime;
+}
+
+/*
+ * Give the idle accelerator to the queued invocation or blocking access
+ * ioctl that the scheduler picks; ties go to the earliest one, blocking
+ * ones first. Called with esp->queue_lock held.
+ */
+static void esp_queue_next(struct esp_device *esp)
+{
+	struct esp_sync_waiter *waiter, *best_waiter = NULL;
+	struct esp_job *job, *best_job = NULL;
+	struct esp_sched_req *best = NULL;
+
+	if (esp->running || esp->sync_running)
+		return;
+	if (esp->quiesced) {
+		/* esp_device_quiesce() waits for the accelerator to go idle */
+		wake_up(&esp->idle_wq);
+		return;
+	}
+
+	list_for_each_entry(waiter, &esp->sync_waiters, list) {
+		if (best == NULL || esp_sched_before(&waiter->sched, best)) {
+			best = &waiter->sched;
+			best_waiter = waiter;
+		}
+	}
+
+	list_for_each_entry(job, &esp->queue, list) {
+		if (best == NULL || esp_sched_before(&job->sched, best)) {
+			best = &job->sched;
+			best_job = job;
+			best_waiter = NULL;
+		}
+	}
+
+	if (best == NULL)
+		return;
+
+	esp_sched_dispatch(esp, best);
+
+	if (best_waiter) {
+		list_del(&best_waiter->list);
+		best_waiter->granted = true;
+		esp->sync_running = true;
+		esp->sync_client = best_waiter->sched.client;
+		esp->sync_start = ktime_get_ns();
+		wake_up(&esp->idle_wq);
+		return;
+	}
+
+	list_del(&best_job->list);
+	esp->nqueued--;
+	esp_job_start(esp, best_job);
+}
+
+/* Bracket updates of the status page of @priv, with esp->queue_lock held */
+static void esp_status_page_begin(struct esp_file *priv)
+{
+	WRITE_ONCE(priv->status->seq, priv->status->seq + 1);
+	smp_wmb();
+}
+
+static void esp_status_page_end(struct esp_file *priv)
+{
+	smp_wmb();
+	WRITE_ONCE(priv->status->seq, priv->status->seq + 1);
+}
+
+/* Hand @job back to the file that submitted it. Called with esp->queue_lock held. */
+static void esp_job_return(struct esp_job *job, u64 now)
+{
+	struct esp_file *owner = job->owner;
+	struct esp_status_page *status = owner->status;
+
+	esp_status_page_begin(owner);
+	status->flags = ESP_STATUS_DONE | (job->err ? ESP_STATUS_ERR : 0);
+	status->completed++;
+	if (job->err)
+		status->errors++;
+	status->ts_start = ktime_to_ns(job->start);
+	status->ts_done = now;
+	esp_status_page_end(owner);
+
+	list_add_tail(&job->list, &owner->done);
+	owner->ndone++;
+	wake_up(&owner->wq);
+}
+
+/*
+ * Retire the invocation that just completed and start the next one. Called
+ * with esp->queue_lock held. Returns the completed stage of a chain, if any,
+ * whose successor must be started once the lock is dropped.
+ */
+static struct esp_job *esp_queue_complete(struct esp_device *esp, int err)
+{
+	struct esp_job *job, *chained = NULL;
+
+	job = esp->running;
+	if (job)
+		esp_update_status(job->access);
+	if (job && job->chain) {
+		job->hw_ns = ktime_get_ns() - ktime_to_ns(job->start);
+		job->err = err ? -EIO : 0;
+		chained = job;
+		esp->running = NULL;
+	} else if (job) {
+		u64 now = ktime_get_ns();
+
+		job->hw_ns = now - ktime_to_ns(job->start);
+		job->err = err ? -EIO : 0;
+		esp_sched_charge(job->owner, job->hw_ns);
+		esp_job_return(job, now);
+		esp->running = NULL;
+	} else {
+		esp->err = err;
+		esp->sync_running = false;
+		esp->done_ns = ktime_get_ns();
+		esp_sched_charge(esp->sync_client, esp->done_ns - esp->sync_start);
+		esp->sync_client = NULL;
+		complete_all(&esp->completion);
+	}
+	esp_queue_next(esp);
+	return chained;
+}
+
+/*
+ * Retire the running invocation if STATUS_REG reports it done; the interrupt
+ * handler and a spinning waiter race for it. Called with esp->queue_lock held;
+ * *chained is set as returned by esp_queue_complete().
+ */
+static bool esp_queue_retire(struct esp_device *esp, struct esp_job **chained)
 {
-	struct esp_device *esp = dev_get_drvdata(dev);
 	u32 status, error, done;
 
 	status = ioread32be(esp->iomem + STATUS_REG);
 	error = status & STATUS_MASK_ERR;
 	done = status & STATUS_MASK_DONE;
 
-	/* printk(KERN_INFO "IRQ: %08x\n", status); */
+	if (!error && !done)
+		return false;
+
+	iowrite32be(0, esp->iomem + CMD_REG);
+	*chained = esp_queue_complete(esp, error ? -1 : 0);
+	return true;
+}
 
-	if (error) {
-		iowrite32be(0, esp->iomem + CMD_REG);
-		esp->err = -1;
-		complete_all(&esp->completion);
-		return IRQ_HANDLED;
+/*
+ * Take the accelerator for a blocking access ioctl of @priv, when the
+ * scheduler picks it over the other blocking and queued invocations.
+ * Fails with -EAGAIN while the device is quiesced for reconfiguration.
+ */
+static int esp_queue_acquire(struct esp_device *esp, struct esp_file *priv)
+{
+	struct esp_sync_waiter waiter = { .granted = false };
+	int rc;
+
+	spin_lock_irq(&esp->queue_lock);
+	if (esp->quiesced) {
+		spin_unlock_irq(&esp->queue_lock);
+		return -EAGAIN;
 	}
-	if (done) {
-		iowrite32be(0, esp->iomem + CMD_REG);
-		complete_all(&esp->completion);
-		return IRQ_HANDLED;
+	esp_sched_enqueue(esp, &waiter.sched, priv);
+	list_add_tail(&waiter.list, &esp->sync_waiters);
+	esp_queue_next(esp);
+	rc = wait_event_interruptible_lock_irq(esp->idle_wq, waiter.granted || esp->quiesced,
+					esp->queue_lock);
+	if (waiter.granted) {
+		rc = 0;
+	} else {
+		list_del(&waiter.list);
+		esp_sched_cancel(&waiter.sched);
+		rc = rc ? -EINTR : -EAGAIN;
+	}
+	spin_unlock_irq(&esp->queue_lock);
+
+	return rc;
+}
+
+/* Give the accelerator back when the blocking ioctl did not start it */
+static void esp_queue_release(struct esp_device *esp)
+{
+	spin_lock_irq(&esp->queue_lock);
+	esp->sync_running = false;
+	esp_sched_charge(esp->sync_client, ktime_get_ns() - esp->sync_start);
+	esp->sync_client = NULL;
+	esp_queue_next(esp);
+	spin_unlock_irq(&esp->queue_lock);
+}
+
+static void esp_chain_advance(struct esp_job *job);
+
+/*
+ * Queue stage @i of @chain ahead of the invocations submitted by user space.
+ * The stage fails with -EAGAIN if its device is quiesced.
+ */
+static void esp_chain_queue(struct esp_chain *chain, unsigned int i)
+{
+	struct esp_device *esp = chain->esp[i];
+	struct esp_job *job = chain->job[i];
+	unsigned long flags;
+	bool quiesced;
+
+	spin_lock_irqsave(&esp->queue_lock, flags);
+	quiesced = esp->quiesced;
+	if (!quiesced) {
+		job->sched.client = NULL;
+		list_add(&job->list, &esp->queue);
+		esp->nqueued++;
+		esp_queue_next(esp);
+	}
+	spin_unlock_irqrestore(&esp->queue_lock, flags);
+
+	if (quiesced) {
+		job->err = -EAGAIN;
+		esp_chain_advance(job);
+	}
+}
+
+static void esp_job_resolve(struct esp_device *esp, struct esp_job *job);
+
+/*
+ * Retire the completed @job and start the stage that follows it, or hand the
+ * chain back to the calling thread at the end of a segment. Called without
+ * locks held.
+ */
+static void esp_chain_advance(struct esp_job *job)
+{
+	struct esp_chain *chain = job->chain;
+	unsigned int next = job->stage + 1;
+	struct esp_job *next_job;
+
+	if (!job->err)
+		chain->n_done = next;
+
+	if (job->err || next == chain->n || READ_ONCE(chain->abort))
+		goto segment_end;
+
+	next_job = chain->job[next];
+	esp_job_resolve(chain->esp[next], next_job);
+	chain->n_config = next + 1;
+
+	/* the flush cannot run from the interrupt of the previous stage */
+	if (next_job->access->coherence < ACC_COH_RECALL &&
+		next_job->access->coherence < chain->flushed)
+		goto segment_end;
+
+	/* coherent accelerators leave the buffer in the caches */
+	if (next_job->access->coherence != ACC_COH_NONE) {
+		contig_set_cached(next_job->contig);
+		chain->flushed = ACC_COH_AUTO;
 	}
-	return IRQ_NONE;
+	esp_chain_queue(chain, next);
+	return;
+
+segment_end:
+	/* the calling thread may free the chain as soon as it is woken */
+	complete(&chain->done);
+}
+
+static irqreturn_t esp_irq(int irq, void *dev)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+	struct esp_job *chained = NULL;
+	unsigned long flags;
+	bool handled;
+
+	spin_lock_irqsave(&esp->queue_lock, flags);
+	handled = esp_queue_retire(esp, &chained);
+	spin_unlock_irqrestore(&esp->queue_lock, flags);
+
+	if (chained)
+		esp_chain_advance(chained);
+
+	return handled ? IRQ_HANDLED : IRQ_NONE;
 }
 
-static int esp_flush(struct esp_device *esp)
+static int esp_flush(enum accelerator_coherence coherence)
 {
 	int rc = 0;
-	if (esp->coherence < ACC_COH_RECALL)
+	if (coherence < ACC_COH_RECALL)
 		rc |= esp_private_cache_flush();
 
-	if (esp->coherence < ACC_COH_LLC)
+	if (coherence < ACC_COH_LLC)
 		rc |= esp_cache_flush();
 
 	return rc;
 }
 
+/*
+ * Flush the caches before @job runs, unless the caller already flushed for
+ * *flushed or a lower coherence level. With flush_tracking, the flush is
+ * also skipped if neither the CPU nor a coherent accelerator touched the
+ * buffer since a flush of every level, after which the buffer is clean.
+ * The buffer is marked clean before the flush, so that a CPU access racing
+ * with it marks it cached again.
+ */
+static int esp_job_flush(struct esp_job *job, enum accelerator_coherence *flushed)
+{
+	enum accelerator_coherence coherence = job->access->coherence;
+	bool clean;
+	u64 start;
+	int rc;
+
+	job->flush_ns = 0;
+	if (coherence < *flushed && (!flush_tracking || contig_is_cached(job->contig))) {
+		start = ktime_get_ns();
+		clean = flush_tracking && coherence == ACC_COH_NONE;
+		if (clean)
+			contig_clean(job->contig);
+		rc = esp_flush(coherence);
+		if (rc) {
+			if (clean)
+				contig_set_cached(job->contig);
+			return rc;
+		}
+		*flushed = coherence;
+		job->flush_ns = ktime_get_ns() - start;
+	}
+
+	/* coherent accelerators leave the buffer in the caches */
+	if (coherence != ACC_COH_NONE)
+		contig_set_cached(job->contig);
+	return 0;
+}
+
+static void esp_job_free(struct esp_job *job);
+static void esp_prepared_free(struct esp_device *esp, struct esp_job *job);
+
 static int esp_open(struct inode *inode, struct file *file)
 {
 	struct esp_device *esp;
+	struct esp_file *priv;
 
 	esp = container_of(inode->i_cdev, struct esp_device, cdev);
-	file->private_data = esp;
-	if (!try_module_get(esp->module))
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (priv == NULL)
+		return -ENOMEM;
+
+	priv->esp = esp;
+	INIT_LIST_HEAD(&priv->done);
+	init_waitqueue_head(&priv->wq);
+	priv->pid = task_tgid_vnr(current);
+	priv->sched.sched_class = ESP_SCHED_NORMAL;
+	priv->sched.weight = ESP_SCHED_WEIGHT_DEFAULT;
+
+	priv->status_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (priv->status_page == NULL) {
+		kfree(priv);
+		return -ENOMEM;
+	}
+	priv->status = page_address(priv->status_page);
+
+	if (!try_module_get(esp->module)) {
+		__free_page(priv->status_page);
+		kfree(priv);
 		return -ENODEV;
+	}
+
+	spin_lock_irq(&esp->queue_lock);
+	list_add_tail(&priv->client, &esp->clients);
+	spin_unlock_irq(&esp->queue_lock);
+
+	file->private_data = priv;
 	return 0;
 }
 
+/* Map the status page of the file, read-only */
+static int esp_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct esp_file *priv = file->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return vm_insert_page(vma, vma->vm_start, priv->status_page);
+}
+
 static int esp_release(struct inode *inode, struct file *file)
 {
-	struct esp_device *esp;
+	struct esp_file *priv = file->private_data;
+	struct esp_device *esp = priv->esp;
+	struct esp_job *job, *tmp;
+	LIST_HEAD(reaped);
+	int i;
+
+	mutex_lock(&esp->lock);
+	for (i = 0; i < ESP_PREPARED_MAX; i++)
+		if (priv->prepared[i])
+			esp_prepared_free(esp, priv->prepared[i]);
+	mutex_unlock(&esp->lock);
 
-	esp = file->private_data;
+	/* drop what has not started yet and wait for what is running */
+	spin_lock_irq(&esp->queue_lock);
+	list_for_each_entry_safe(job, tmp, &esp->queue, list) {
+		if (job->owner != priv)
+			continue;
+		list_move_tail(&job->list, &reaped);
+		esp_sched_cancel(&job->sched);
+		esp->nqueued--;
+		priv->inflight--;
+	}
+	wait_event_lock_irq(priv->wq, priv->ndone == priv->inflight, esp->queue_lock);
+	list_splice_init(&priv->done, &reaped);
+	list_del(&priv->client);
+	/* a blocking run interrupted by a signal may still be running */
+	if (esp->sync_client == priv)
+		esp->sync_client = NULL;
+	spin_unlock_irq(&esp->queue_lock);
+
+	list_for_each_entry_safe(job, tmp, &reaped, list)
+		esp_job_free(job);
+
+	/* mappings hold their own reference to the page */
+	__free_page(priv->status_page);
+	kfree(priv);
 	module_put(esp->module);
 	return 0;
 }
 
+/* Size of one cache instance as described by the device tree, or 0 */
+static size_t esp_of_cache_size(struct device_node *np)
+{
+	u32 size, line;
+
+	if (of_property_read_u32(np, "cache-size", &size))
+		return 0;
+	if (!cache_line_bytes && !of_property_read_u32(np, "cache-line-size", &line))
+		cache_line_bytes = line;
+	return size;
+}
+
 void esp_status_init(void) {
 
+	struct device_node *np;
+	size_t size = 0;
 	int i;
 
-	cache_l2_size = cache_l2_sets * cache_l2_ways * cache_line_bytes;
-	
-    if (rtl_cache) {
-        cache_llc_size = cache_llc_sets * cache_llc_ways * cache_line_bytes;
-        cache_llc_bank_size = cache_llc_sets * cache_llc_ways * cache_line_bytes / cache_llc_banks;
-    } else {
-        cache_llc_size = cache_llc_sets * cache_llc_ways * cache_line_bytes * cache_llc_banks;
-        cache_llc_bank_size = cache_llc_sets * cache_llc_ways * cache_line_bytes;
-    }
+	np = of_find_matching_node(NULL, esp_l2_match);
+	if (np) {
+		size = esp_of_cache_size(np);
+		of_node_put(np);
+	}
+	if (cache_l2_sets && cache_l2_ways)
+		size = cache_l2_sets * cache_l2_ways * (cache_line_bytes ? cache_line_bytes : 16);
+	if (size)
+		cache_l2_size = size;
+
+	size = 0;
+	i = 0;
+	for_each_matching_node(np, esp_llc_match) {
+		if (!size)
+			size = esp_of_cache_size(np);
+		i++;
+	}
+	if (!cache_llc_banks)
+		cache_llc_banks = i ? i : 1;
+	if (cache_llc_banks > ESP_LLC_BANKS_MAX) {
+		pr_warn(PFX "%lu LLC banks, accounting only %d\n", cache_llc_banks, ESP_LLC_BANKS_MAX);
+		cache_llc_banks = ESP_LLC_BANKS_MAX;
+	}
+	if (!cache_line_bytes)
+		cache_line_bytes = 16;
+
+	if (cache_llc_sets && cache_llc_ways) {
+		if (rtl_cache)
+			size = cache_llc_sets * cache_llc_ways * cache_line_bytes / cache_llc_banks;
+		else
+			size = cache_llc_sets * cache_llc_ways * cache_line_bytes;
+	}
+	if (size)
+		cache_llc_bank_size = size;
+	cache_llc_size = cache_llc_bank_size * cache_llc_banks;
+
+	pr_info(PFX "L2 %zu bytes, LLC %lu x %zu bytes, %lu-byte lines\n",
+		cache_l2_size, cache_llc_banks, cache_llc_bank_size, cache_line_bytes);
+
+	atomic_set(&esp_status.active_acc_cnt, 0);
+	atomic_set(&esp_status.active_acc_cnt_full, 0);
+	atomic_set(&esp_status.active_footprint, 0);
+	for (i = 0; i < ESP_LLC_BANKS_MAX; i++)
+		atomic_set(&esp_status.active_footprint_split[i], 0);
+}
+
+/* Add @sign times the footprint of @access to the LLC banks it maps to */
+static void esp_status_footprint_add(struct esp_access *access, int sign)
+{
+	int footprint = sign * (int) access->footprint;
+
+	atomic_add(footprint, &esp_status.active_footprint);
+
+	if (access->alloc_policy == CONTIG_ALLOC_PREFERRED ||
+		access->alloc_policy == CONTIG_ALLOC_LEAST_LOADED ||
+		access->alloc_policy == CONTIG_ALLOC_LEAST_BUSY) {
+
+		atomic_add(footprint, &esp_status.active_footprint_split[access->ddr_node % cache_llc_banks]);
+
+	} else { // CONTIG_ALLOC_BALANCED, CONTIG_ALLOC_INTERLEAVED
+
+		int i;
+		for (i = 0; i < cache_llc_banks; i++)
+			atomic_add(footprint / (int) cache_llc_banks, &esp_status.active_footprint_split[i]);
+	}
+}
+
+/* Bucket i holds footprints below 4 KB << i, the last one is unbounded */
+static int esp_footprint_bucket(unsigned int footprint)
+{
+	int b = 0;
 
-	mutex_init(&esp_status.lock);
-	esp_status.active_acc_cnt = 0;
-	esp_status.active_footprint = 0;
-	for (i = 0; i < cache_llc_banks; i++)
-		esp_status.active_footprint_split[i] = 0;
+	while (b < ESP_FOOTPRINT_BUCKETS - 1 && footprint >= (4096U << b))
+		b++;
+	return b;
 }
 
-static void esp_runtime_config(struct esp_device *esp)
+/*
+ * Pick the coherence mode with the lowest measured cost for the footprint
+ * of @job under the current load, or @guess while nothing was measured. One
+ * pick in coh_explore instead tries the mode measured the fewest times, so
+ * that the table follows changes in the system load.
+ */
+static enum accelerator_coherence esp_coh_select(struct esp_device *esp, struct esp_job *job,
+						enum accelerator_coherence guess, int others)
 {
+	struct esp_coh_learn *learn = &esp->coh;
+	struct esp_coh_cell *row;
+	enum accelerator_coherence best = guess;
+	enum accelerator_coherence mode;
+	unsigned long flags;
+
+	job->coh_bucket = esp_footprint_bucket(job->access->footprint);
+	job->coh_load = others ? 1 : 0;
+	row = learn->cell[job->coh_bucket][job->coh_load];
+
+	/* chain stages are configured from the interrupt of the previous one */
+	spin_lock_irqsave(&learn->lock, flags);
+	if (coh_explore && ++learn->picks % coh_explore == 0) {
+		for (mode = ACC_COH_NONE; mode < ACC_COH_AUTO; mode++)
+			if (row[mode].samples < row[best].samples)
+				best = mode;
+	} else {
+		for (mode = ACC_COH_NONE; mode < ACC_COH_AUTO; mode++)
+			if (row[mode].samples && (!row[best].samples || row[mode].ns < row[best].ns))
+				best = mode;
+	}
+	spin_unlock_irqrestore(&learn->lock, flags);
+
+	return best;
+}
+
+/* Fold the flush and run time of a completed @job into the learning table */
+static void esp_coh_record(struct esp_device *esp, struct esp_job *job)
+{
+	struct esp_coh_learn *learn = &esp->coh;
+	struct esp_coh_cell *cell;
+	u64 ns = job->flush_ns + job->hw_ns;
+	unsigned long flags;
+
+	if (job->coh_bucket < 0)
+		return;
+
+	cell = &learn->cell[job->coh_bucket][job->coh_load][job->access->coherence];
+	spin_lock_irqsave(&learn->lock, flags);
+	if (cell->samples)
+		cell->ns = cell->ns - (cell->ns >> ESP_COH_EWMA_SHIFT) + (ns >> ESP_COH_EWMA_SHIFT);
+	else
+		cell->ns = ns;
+	if (cell->samples < UINT_MAX)
+		cell->samples++;
+	spin_unlock_irqrestore(&learn->lock, flags);
+}
+
+/*
+ * The counters are updated without a lock: the coherence choice below reads
+ * a snapshot that may be stale by the invocations racing with this one, which
+ * at worst picks the mode that the serialized order would have picked for a
+ * neighbour.
+ */
+static void esp_runtime_config(struct esp_device *esp, struct esp_job *job)
+{
+	struct esp_access *access = job->access;
 	unsigned int footprint, footprint_llc_threshold;
+	int others;
+
+	// Number of accelerators running now
+	others = atomic_read(&esp_status.active_acc_cnt);
+
+    if  (access->coherence == ACC_COH_AUTO){
+
+        // Evaluate footprint
+        if (access->alloc_policy == CONTIG_ALLOC_PREFERRED ||
+            access->alloc_policy == CONTIG_ALLOC_LEAST_LOADED ||
+            access->alloc_policy == CONTIG_ALLOC_LEAST_BUSY) {
+
+            footprint = atomic_read(&esp_status.active_footprint_split[access->ddr_node % cache_llc_banks])
+                + access->footprint;
+            footprint_llc_threshold = cache_llc_bank_size;
+
+        } else { // CONTIG_ALLOC_BALANCED, CONTIG_ALLOC_INTERLEAVED
+
+            footprint = atomic_read(&esp_status.active_footprint) + access->footprint;
+            footprint_llc_threshold = cache_llc_size;
+        }
+
+        // Cache coherence choice
+        if (access->footprint < cache_l2_size) {
+            if (access->reuse_factor > 1){
+                access->coherence =  ACC_COH_FULL;
+            } else {
+                access->coherence = ACC_COH_RECALL;
+            }
+        } else if (access->footprint < cache_llc_bank_size) {
+            access->coherence = ACC_COH_RECALL;
+
+        } else {
+            access->coherence = ACC_COH_NONE;
+        }
+
+        if (coh_learning)
+            access->coherence = esp_coh_select(esp, job, access->coherence, others);
+    }
+
+	return;
+}
+
+/* Count @access in esp_status while it runs; undone by esp_update_status() */
+static void esp_status_account(struct esp_access *access)
+{
 	// Update number of active accelerators
-	esp_status.active_acc_cnt += 1;
+	atomic_inc(&esp_status.active_acc_cnt);
+
+	if (access->coherence == ACC_COH_FULL)
+		atomic_inc(&esp_status.active_acc_cnt_full);
 
-	if (esp->coherence == ACC_COH_FULL) {
+	// Update footprint
+	if (access->coherence != ACC_COH_NONE)
+		esp_status_footprint_add(access, 1);
+}
 
-		esp_status.active_acc_cnt_full++;
+/* How long to spin for the blocking @job before sleeping, in ns */
+static u64 esp_wait_spin_ns(struct esp_device *esp, struct esp_job *job, enum esp_wait_mode mode)
+{
+	u64 budget = (u64) READ_ONCE(wait_spin_us) * NSEC_PER_USEC;
+	u64 expected;
+
+	switch (mode) {
+	case ESP_WAIT_SPIN:
+		return budget;
+	case ESP_WAIT_ADAPTIVE:
+		/* spin until twice the usual run time, if it fits the budget */
+		expected = esp->wait_run_ns[esp_footprint_bucket(job->access->footprint)];
+		if (!expected)
+			return budget;
+		return expected <= budget ? min(2 * expected, budget) : 0;
+	default:
+		return 0;
+	}
+}
 
-		return;
+/* Spin on STATUS_REG for up to @spin_ns; true if the invocation completed */
+static bool esp_wait_spin(struct esp_device *esp, u64 start, u64 spin_ns)
+{
+	struct esp_job *chained = NULL;
+	bool done = false;
+
+	while (!done && ktime_get_ns() - start < spin_ns) {
+		spin_lock_irq(&esp->queue_lock);
+		done = completion_done(&esp->completion) || esp_queue_retire(esp, &chained);
+		spin_unlock_irq(&esp->queue_lock);
+		if (chained) {
+			esp_chain_advance(chained);
+			chained = NULL;
+		}
+		cpu_relax();
 	}
+	return done;
+}
+
+/* Wait for the blocking @job to complete, as set by the wait_mode attribute */
+static int esp_wait(struct esp_device *esp, struct esp_job *job)
+{
+	enum esp_wait_mode mode = READ_ONCE(esp->wait_mode);
+	struct esp_wait_stats *stats = &esp->wait_stats[mode];
+	u64 start = ktime_get_ns();
+	u64 spin_ns = esp_wait_spin_ns(esp, job, mode);
+	u64 spun = 0, now, *run_ns;
+	bool polled = false;
+	int wait;
+
+	if (spin_ns) {
+		polled = esp_wait_spin(esp, start, spin_ns);
+		spun = ktime_get_ns() - start;
+	}
+	if (!polled) {
+		wait = wait_for_completion_interruptible(&esp->completion);
+		if (wait < 0)
+			return -EINTR;
+	}
+	now = ktime_get_ns();
+
+	spin_lock_irq(&esp->queue_lock);
+	stats->waits++;
+	if (polled)
+		stats->polled++;
+	stats->spin_ns += spun;
+	stats->wake_ns += now - esp->done_ns;
+	stats->wake_max_ns = max(stats->wake_max_ns, now - esp->done_ns);
+	spin_unlock_irq(&esp->queue_lock);
+
+	/* run time of the invocation, for the adaptive mode */
+	run_ns = &esp->wait_run_ns[esp_footprint_bucket(job->access->footprint)];
+	if (*run_ns)
+		*run_ns = *run_ns - (*run_ns >> ESP_WAIT_EWMA_SHIFT) +
+			((esp->done_ns - job->ts_run) >> ESP_WAIT_EWMA_SHIFT);
+	else
+		*run_ns = esp->done_ns - job->ts_run;
+
+	if (esp->err) {
+		pr_info(PFX "Error occured\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void esp_update_status(struct esp_access *access)
+{
+	if (access->coherence == ACC_COH_FULL)
+		atomic_dec(&esp_status.active_acc_cnt_full);
+
+	// Update number of active accelerators
+	atomic_dec(&esp_status.active_acc_cnt);
+
+	// Update footprints
+	if (access->coherence != ACC_COH_NONE)
+		esp_status_footprint_add(access, -1);
+}
+
+/*
+ * Point the page table of @job at the chunks from the first one that either
+ * offset falls in to the end of the buffer, and rebase the offsets on it, so
+ * that a slice of a buffer larger than the accelerator can map still runs.
+ * Only for drivers that set xfer_window: for the others the page table
+ * starts at the first chunk of the buffer.
+ */
+static bool esp_xfer_window(struct esp_device *esp, struct esp_job *job)
+{
+	struct esp_access *access = job->access;
+	const struct contig_desc *contig = job->contig;
+	unsigned nchunk_max = ioread32be(esp->iomem + PT_NCHUNK_MAX_REG);
+	u64 size = (u64) contig->n << contig->chunk_log;
+	dma_addr_t pt_address;
+	unsigned int skip;
+
+	if (access->src_offset >= size || access->dst_offset >= size)
+		return false;
+
+	skip = 0;
+	if (esp->driver->xfer_window)
+		skip = min(access->src_offset, access->dst_offset) >> contig->chunk_log;
+	access->src_offset -= skip << contig->chunk_log;
+	access->dst_offset -= skip << contig->chunk_log;
+
+	pt_address = contig->arr_dma_addr + skip * sizeof(*contig->arr);
+	job->regs.pt_address = lower_32_bits(pt_address);
+	job->regs.pt_address_ext = upper_32_bits(pt_address);
+	job->regs.pt_shift = contig->chunk_log;
+	job->regs.pt_nchunk = contig->n - skip;
+
+	/* No check needed if memory is not accessed (PT_NCHUNK_MAX == 0) */
+	if (!nchunk_max)
+		return true;
+
+	if (!job->regs.pt_nchunk || job->regs.pt_nchunk > nchunk_max)
+		return false;
+	return true;
+}
+
+#define esp_get_y(_dev) (YX_MASK_YX & (ioread32be(_dev->iomem + YX_REG) >> YX_SHIFT_Y))
+#define esp_get_x(_dev) (YX_MASK_YX & (ioread32be(_dev->iomem + YX_REG) >> YX_SHIFT_X))
+
+static bool esp_p2p_set_src(struct esp_device *esp, char *src_name, int src_index, u32 *p2p)
+{
+	struct list_head *ele;
+	struct esp_device *dev;
+
+	dev_dbg(esp->pdev, "searching P2P source %s\n", src_name);
+	spin_lock(&esp_devices_lock);
+	list_for_each(ele, &esp_devices) {
+		dev = list_entry(ele, struct esp_device, list);
+		if (!strncmp(src_name, dev->dev->kobj.name, strlen(dev->dev->kobj.name))) {
+			unsigned y = esp_get_y(dev);
+			unsigned x = esp_get_x(dev);
+			*p2p |= (P2P_MASK_SRCS_YX & y) << P2P_SHIFT_SRCS_Y(src_index);
+			*p2p |= (P2P_MASK_SRCS_YX & x) << P2P_SHIFT_SRCS_X(src_index);
+			spin_unlock(&esp_devices_lock);
+			dev_dbg(esp->pdev, "P2P source %s on tile %d,%d\n", dev->dev->kobj.name, y, x);
+			return true;
+		}
+	}
+	spin_unlock(&esp_devices_lock);
 
-    if  (esp->coherence == ACC_COH_AUTO){
+	dev_info(esp->pdev, "ESP device %s not found\n", src_name);
+	return false;
+}
+
+/* Compute the P2P register for @access */
+static long esp_p2p_init(struct esp_device *esp, struct esp_access *access, u32 *p2p)
+{
+	int i = 0;
+
+	*p2p = 0;
+
+	for (i = 0; i < access->p2p_nsrcs; i++)
+		if (!esp_p2p_set_src(esp, access->p2p_srcs[i], i, p2p))
+			return -ENODEV;
+
+	if (access->p2p_store) {
+		dev_dbg(esp->pdev, "P2P store enabled\n");
+		*p2p |= P2P_MASK_DST_IS_P2P;
+	}
+
+	if (access->p2p_nsrcs != 0) {
+		*p2p |= P2P_MASK_SRC_IS_P2P;
+		*p2p |= P2P_MASK_NSRCS & (access->p2p_nsrcs - 1);
+	}
+
+	return 0;
+}
+
+/* Copy in and validate an access struct; the job is not linked anywhere yet */
+static struct esp_job *esp_job_alloc(struct esp_device *esp, void __user *argp)
+{
+	struct esp_job *job;
+	struct esp_access *access;
+	int rc;
+
+	job = kzalloc(sizeof(*job) + esp->driver->arg_size, GFP_KERNEL);
+	if (job == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&job->list);
+	access = job->access = (struct esp_access *)(job + 1);
+
+	if (copy_from_user(access, argp, esp->driver->arg_size)) {
+		rc = -EFAULT;
+		goto err;
+	}
+
+	if (access->p2p_nsrcs > 4) {
+		rc = -EINVAL;
+		goto err;
+	}
+
+	job->contig = contig_get(access->contig);
+	if (job->contig == NULL) {
+		rc = -EFAULT;
+		goto err;
+	}
+
+	if (!esp_xfer_window(esp, job)) {
+		rc = -EINVAL;
+		goto err_contig;
+	}
+
+	if (esp->driver->xfer_input_ok && !esp->driver->xfer_input_ok(esp, access)) {
+		rc = -EINVAL;
+		goto err_contig;
+	}
+
+	rc = esp_p2p_init(esp, access, &job->regs.p2p);
+	if (rc)
+		goto err_contig;
+
+	job->coherence = access->coherence;
+
+	return job;
+
+err_contig:
+	contig_put(job->contig);
+err:
+	kfree(job);
+	return ERR_PTR(rc);
+}
+
+/* Resolve ACC_COH_AUTO into job->access from the current load */
+static void esp_job_resolve(struct esp_device *esp, struct esp_job *job)
+{
+	job->coh_bucket = -1;
+	job->access->coherence = job->coherence;
+	esp_runtime_config(esp, job);
+	job->regs.coherence = job->access->coherence;
+}
+
+/*
+ * Resolve a blocking job and account it in esp_status for its run. Queued
+ * jobs are accounted by esp_job_start() instead.
+ */
+static void esp_job_config(struct esp_device *esp, struct esp_job *job)
+{
+	esp_job_resolve(esp, job);
+	esp_status_account(job->access);
+}
+
+/* Undo esp_job_config() */
+static void esp_job_unconfig(struct esp_job *job)
+{
+	esp_update_status(job->access);
+}
+
+static void esp_job_free(struct esp_job *job)
+{
+	contig_put(job->contig);
+	kfree(job);
+}
+
+/*
+ * Run @job and wait for it, with esp->lock held and the accelerator taken
+ * with esp_queue_acquire(), which this gives back. Prepared jobs skip the
+ * accelerator-specific registers when they were the last ones programmed.
+ */
+static int esp_job_run_sync(struct esp_device *esp, struct esp_job *job, bool prepared)
+{
+	enum accelerator_coherence flushed = ACC_COH_AUTO;
+	struct esp_access *access = job->access;
+	int rc;
+
+	esp_job_config(esp, job);
+	esp_job_set_device(esp, job);
+
+	job->ts_flush = ktime_get_ns();
+	rc = esp_job_flush(job, &flushed);
+	if (rc)
+		goto out_status;
+
+	esp->err = 0;
+	reinit_completion(&esp->completion);
+	esp_transfer(esp, &job->regs);
+
+	if (!prepared || esp->last_prepared != job)
+		esp_prep_xfer(esp, access);
+	esp->last_prepared = prepared ? job : NULL;
+
+	job->ts_run = ktime_get_ns();
+	if (access->run) {
+		/* the interrupt hands the accelerator back to the queue */
+		esp_run(esp);
+		rc = esp_wait(esp, job);
+	} else {
+		esp_queue_release(esp);
+	}
+	job->ts_done = ktime_get_ns();
+	if (access->run && !rc) {
+		job->hw_ns = job->ts_done - job->ts_run;
+		esp_coh_record(esp, job);
+	}
+
+	esp_job_unconfig(job);
+	return rc;
+
+out_status:
+	esp_job_unconfig(job);
+	esp_queue_release(esp);
+	return rc;
+}
+
+/*
+ * Take the accelerator, then dpr_lock and esp->lock, for a blocking
+ * invocation; waiters queue in the scheduler rather than on the mutexes.
+ */
+static int esp_sync_lock(struct esp_file *priv)
+{
+	struct esp_device *esp = priv->esp;
+	int rc;
+
+	rc = esp_queue_acquire(esp, priv);
+	if (rc)
+		return rc;
+
+	mutex_lock(&esp->dpr_lock);
+	if (mutex_lock_interruptible(&esp->lock)) {
+		mutex_unlock(&esp->dpr_lock);
+		esp_queue_release(esp);
+		return -EINTR;
+	}
+
+	return 0;
+}
+
+static void esp_sync_unlock(struct esp_device *esp)
+{
+	mutex_unlock(&esp->lock);
+	mutex_unlock(&esp->dpr_lock);
+}
+
+static int esp_access_ioctl(struct esp_file *priv, void __user *argp)
+{
+	struct esp_device *esp = priv->esp;
+	struct esp_job *job;
+	int rc;
 
-        // Evaluate footprint
-        if (esp->alloc_policy == CONTIG_ALLOC_PREFERRED ||
-            esp->alloc_policy == CONTIG_ALLOC_LEAST_LOADED) {
+	job = esp_job_alloc(esp, argp);
+	if (IS_ERR(job))
+		return PTR_ERR(job);
 
-            footprint = esp_status.active_footprint_split[esp->ddr_node]
-                + esp->footprint;
-            footprint_llc_threshold = cache_llc_bank_size;
+	rc = esp_sync_lock(priv);
+	if (rc)
+		goto out;
 
-        } else { // CONTIG_ALLOC_BALANCED
+	rc = esp_job_run_sync(esp, job, false);
 
-            footprint = esp_status.active_footprint + esp->footprint;;
-            footprint_llc_threshold = cache_llc_size;
-        }
+	esp_sync_unlock(esp);
 
-        // Cache coherence choice
-        if (esp->footprint < cache_l2_size) {
-            if (esp->reuse_factor > 1){
-                esp->coherence =  ACC_COH_FULL;
-                esp_status.active_acc_cnt_full++;
-            } else {
-                esp->coherence = ACC_COH_RECALL;
-            }
-        } else if (esp->footprint < cache_llc_bank_size) {
-            esp->coherence = ACC_COH_RECALL;
+	if (!rc) {
+		struct esp_access __user *uaccess = argp;
+		u64 ts[3] = { job->ts_flush, job->ts_run, job->ts_done };
 
-        } else {
-            esp->coherence = ACC_COH_NONE;
-        }
-    }
+		if (copy_to_user(&uaccess->ts_flush, ts, sizeof(ts)))
+			rc = -EFAULT;
+	}
+out:
+	esp_job_free(job);
+	return rc;
+}
 
-	// Update footprint
-	if (esp->coherence != ACC_COH_NONE) {
+/* Called with esp->lock held */
+static void esp_prepared_free(struct esp_device *esp, struct esp_job *job)
+{
+	struct esp_file *priv = job->owner;
 
-		esp_status.active_footprint += esp->footprint;
+	priv->prepared[job->tag] = NULL;
 
-		if (esp->alloc_policy == CONTIG_ALLOC_PREFERRED ||
-			esp->alloc_policy == CONTIG_ALLOC_LEAST_LOADED) {
+	spin_lock_irq(&esp->queue_lock);
+	if (esp->last_prepared == job)
+		esp->last_prepared = NULL;
+	spin_unlock_irq(&esp->queue_lock);
 
-			esp_status.active_footprint_split[esp->ddr_node] +=
-				esp->footprint;
+	esp_job_free(job);
+}
 
-		} else { // CONTIG_ALLOC_BALANCED
+static long esp_prepare_ioctl(struct esp_file *priv, void __user *argp)
+{
+	struct esp_device *esp = priv->esp;
+	struct esp_prepare_req __user *ureq = argp;
+	struct esp_prepare_req req;
+	struct esp_job *job;
+	unsigned int token;
+	long rc = 0;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	job = esp_job_alloc(esp, req.access);
+	if (IS_ERR(job))
+		return PTR_ERR(job);
+	job->owner = priv;
+	job->access->run = true;
 
-			int i;
-			for (i = 0; i < cache_llc_banks; i++) {
-				esp_status.active_footprint_split[i] +=
-					(esp->footprint / cache_llc_banks);
-			}
-		}
+	if (mutex_lock_interruptible(&esp->lock)) {
+		esp_job_free(job);
+		return -EINTR;
 	}
 
-	return;
-}
+	for (token = 0; token < ESP_PREPARED_MAX; token++)
+		if (priv->prepared[token] == NULL)
+			break;
 
-static void esp_transfer(struct esp_device *esp, const struct contig_desc *contig)
-{
-	esp->err = 0;
-	reinit_completion(&esp->completion);
+	if (token == ESP_PREPARED_MAX) {
+		rc = -ENOSPC;
+	} else if (put_user(token, &ureq->token)) {
+		rc = -EFAULT;
+	} else {
+		job->tag = token;
+		priv->prepared[token] = job;
+	}
 
-	iowrite32be(contig->arr_dma_addr, esp->iomem + PT_ADDRESS_REG);
-	iowrite32be(contig_chunk_size_log, esp->iomem + PT_SHIFT_REG);
-	iowrite32be(contig->n, esp->iomem + PT_NCHUNK_REG);
-	iowrite32be(esp->coherence, esp->iomem + COHERENCE_REG);
-	iowrite32be(0x0, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(0x0, esp->iomem + DST_OFFSET_REG);
-}
+	mutex_unlock(&esp->lock);
 
-static void esp_run(struct esp_device *esp)
-{
-	iowrite32be(0x1, esp->iomem + CMD_REG);
+	if (rc)
+		esp_job_free(job);
+	return rc;
 }
 
-static int esp_wait(struct esp_device *esp)
+static long esp_run_prepared_ioctl(struct esp_file *priv, void __user *argp)
 {
-	/* Interrupt */
-	int wait;
+	struct esp_device *esp = priv->esp;
+	unsigned int token;
+	long rc;
 
-	wait = wait_for_completion_interruptible(&esp->completion);
-	if (wait < 0)
-		return -EINTR;
-	if (esp->err) {
-		pr_info(PFX "Error occured\n");
-		return -1;
+	if (get_user(token, (unsigned int __user *)argp))
+		return -EFAULT;
+	if (token >= ESP_PREPARED_MAX)
+		return -EINVAL;
+
+	rc = esp_sync_lock(priv);
+	if (rc)
+		return rc;
+
+	if (priv->prepared[token]) {
+		rc = esp_job_run_sync(esp, priv->prepared[token], true);
+	} else {
+		esp_queue_release(esp);
+		rc = -EINVAL;
 	}
 
-	return 0;
+	esp_sync_unlock(esp);
+	return rc;
 }
 
-static void esp_update_status(struct esp_device *esp)
+static long esp_release_prepared_ioctl(struct esp_file *priv, void __user *argp)
 {
-	if (esp->coherence == ACC_COH_FULL)
-		esp_status.active_acc_cnt_full--;
-
-	// Update number of active accelerators
-	esp_status.active_acc_cnt -= 1;
+	struct esp_device *esp = priv->esp;
+	unsigned int token;
+	long rc = 0;
+
+	if (get_user(token, (unsigned int __user *)argp))
+		return -EFAULT;
+	if (token >= ESP_PREPARED_MAX)
+		return -EINVAL;
+
+	mutex_lock(&esp->lock);
+	if (priv->prepared[token])
+		esp_prepared_free(esp, priv->prepared[token]);
+	else
+		rc = -EINVAL;
+	mutex_unlock(&esp->lock);
 
-	// Update footprints
-	if (esp->coherence != ACC_COH_NONE) {
+	return rc;
+}
 
-		esp_status.active_footprint -= esp->footprint;
+static long esp_submit_ioctl(struct esp_file *priv, void __user *argp)
+{
+	struct esp_device *esp = priv->esp;
+	struct esp_submit_req __user *ureq = argp;
+	struct esp_submit_req req;
+	struct esp_job_desc desc;
+	struct esp_job *job;
+	enum accelerator_coherence flushed = ACC_COH_AUTO;
+	unsigned int i;
+	long rc = 0;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	for (i = 0; i < req.n; i++) {
+		if (copy_from_user(&desc, &req.jobs[i], sizeof(desc))) {
+			rc = -EFAULT;
+			break;
+		}
 
-		if (esp->alloc_policy == CONTIG_ALLOC_PREFERRED ||
-			esp->alloc_policy == CONTIG_ALLOC_LEAST_LOADED) {
+		if (READ_ONCE(esp->nqueued) >= ESP_QUEUE_DEPTH) {
+			rc = -EAGAIN;
+			break;
+		}
 
-			esp_status.active_footprint_split[esp->ddr_node] -= esp->footprint;
+		job = esp_job_alloc(esp, desc.access);
+		if (IS_ERR(job)) {
+			rc = PTR_ERR(job);
+			break;
+		}
+		job->owner = priv;
+		job->tag = desc.tag;
+
+		/* P2P needs the source tiles programmed in lockstep */
+		if (job->access->p2p_store || job->access->p2p_nsrcs) {
+			esp_job_free(job);
+			rc = -EINVAL;
+			break;
+		}
 
-		} else {
+		esp_job_resolve(esp, job);
 
-			int i;
-			for (i = 0; i < cache_llc_banks; i++) {
-				esp_status.active_footprint_split[i] -= (esp->footprint / cache_llc_banks);
-			}
+		/* one flush covers every later job of the batch that needs less */
+		rc = esp_job_flush(job, &flushed);
+		if (rc) {
+			esp_job_free(job);
+			break;
+		}
+		/* ...until a coherent job may fill the caches before they run */
+		if (job->access->coherence != ACC_COH_NONE)
+			flushed = ACC_COH_AUTO;
+
+		spin_lock_irq(&esp->queue_lock);
+		if (esp->quiesced || esp->nqueued >= ESP_QUEUE_DEPTH) {
+			spin_unlock_irq(&esp->queue_lock);
+			esp_job_free(job);
+			rc = -EAGAIN;
+			break;
 		}
+		list_add_tail(&job->list, &esp->queue);
+		esp_sched_enqueue(esp, &job->sched, priv);
+		esp->nqueued++;
+		priv->inflight++;
+		esp_status_page_begin(priv);
+		priv->status->submitted++;
+		esp_status_page_end(priv);
+		esp_queue_next(esp);
+		spin_unlock_irq(&esp->queue_lock);
 	}
+
+	if (put_user(i, &ureq->n_submitted))
+		return -EFAULT;
+
+	return i ? 0 : rc;
 }
 
-static bool esp_xfer_input_ok(struct esp_device *esp, const struct contig_desc *contig)
+static long esp_reap_ioctl(struct esp_file *priv, void __user *argp)
 {
-	unsigned nchunk_max = ioread32be(esp->iomem + PT_NCHUNK_MAX_REG);
+	struct esp_device *esp = priv->esp;
+	struct esp_reap_req __user *ureq = argp;
+	struct esp_reap_req req;
+	struct esp_job_done done;
+	struct esp_job *job, *tmp;
+	unsigned int want, n = 0;
+	LIST_HEAD(reaped);
+	long rc;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	want = min(req.min_complete, req.n_max);
+
+	spin_lock_irq(&esp->queue_lock);
+	rc = wait_event_interruptible_lock_irq(priv->wq,
+				priv->ndone >= want || priv->ndone == priv->inflight,
+				esp->queue_lock);
+	if (!rc) {
+		while (n < req.n_max && !list_empty(&priv->done)) {
+			list_move_tail(priv->done.next, &reaped);
+			n++;
+		}
+		priv->ndone -= n;
+		priv->inflight -= n;
+	}
+	spin_unlock_irq(&esp->queue_lock);
 
-	/* No check needed if memory is not accessed (PT_NCHUNK_MAX == 0) */
-	if (!nchunk_max)
-		return true;
+	if (rc)
+		return -EINTR;
 
-	if (!contig->n || contig->n > nchunk_max)
-		return false;
-	return true;
-}
+	n = 0;
+	list_for_each_entry_safe(job, tmp, &reaped, list) {
+		done.tag = job->tag;
+		done.err = job->err;
+		done.hw_ns = job->hw_ns;
+		done.flush_ns = job->flush_ns;
+		if (!rc && copy_to_user(&req.done[n], &done, sizeof(done)))
+			rc = -EFAULT;
+		if (!job->err)
+			esp_coh_record(esp, job);
+		esp_job_free(job);
+		n++;
+	}
 
-#define esp_get_y(_dev) (YX_MASK_YX & (ioread32be(_dev->iomem + YX_REG) >> YX_SHIFT_Y))
-#define esp_get_x(_dev) (YX_MASK_YX & (ioread32be(_dev->iomem + YX_REG) >> YX_SHIFT_X))
-#define esp_p2p_reset(_dev) iowrite32be(0, _dev->iomem + P2P_REG)
-#define esp_p2p_enable_dst(_dev) iowrite32be(ioread32be(_dev->iomem + P2P_REG) | P2P_MASK_DST_IS_P2P, _dev->iomem + P2P_REG)
-#define esp_p2p_enable_src(_dev) iowrite32be(ioread32be(_dev->iomem + P2P_REG) | P2P_MASK_SRC_IS_P2P, _dev->iomem + P2P_REG)
-#define esp_p2p_set_nsrcs(_dev, _n) iowrite32be(ioread32be(_dev->iomem + P2P_REG) | (P2P_MASK_NSRCS & (_n - 1)), _dev->iomem + P2P_REG)
-#define esp_p2p_set_y(_dev, _n, _y) iowrite32be(ioread32be(_dev->iomem + P2P_REG) | ((P2P_MASK_SRCS_YX & _y) << P2P_SHIFT_SRCS_Y(_n)), _dev->iomem + P2P_REG)
-#define esp_p2p_set_x(_dev, _n, _x) iowrite32be(ioread32be(_dev->iomem + P2P_REG) | ((P2P_MASK_SRCS_YX & _x) << P2P_SHIFT_SRCS_X(_n)), _dev->iomem + P2P_REG)
+	if (put_user(n, &ureq->n))
+		return -EFAULT;
 
-static long esp_p2p_set_src(struct esp_device *esp, char *src_name, int src_index)
+	return rc;
+}
+
+/* Find the accelerator named @name in /dev and take a reference to its driver */
+static struct esp_device *esp_device_get(const char *name)
 {
-	struct list_head *ele;
 	struct esp_device *dev;
 
-	dev_dbg(esp->pdev, "searching P2P source %s\n", src_name);
 	spin_lock(&esp_devices_lock);
-	list_for_each(ele, &esp_devices) {
-		dev = list_entry(ele, struct esp_device, list);
-		if (!strncmp(src_name, dev->dev->kobj.name, strlen(dev->dev->kobj.name))) {
-			unsigned y = esp_get_y(dev);
-			unsigned x = esp_get_x(dev);
-			esp_p2p_set_y(esp, src_index, y);
-			esp_p2p_set_x(esp, src_index, x);
+	list_for_each_entry(dev, &esp_devices, list) {
+		if (!strcmp(name, dev->dev->kobj.name)) {
+			if (!try_module_get(dev->module))
+				break;
 			spin_unlock(&esp_devices_lock);
-			dev_dbg(esp->pdev, "P2P source %s on tile %d,%d\n", dev->dev->kobj.name, y, x);
-			return true;
+			return dev;
 		}
 	}
 	spin_unlock(&esp_devices_lock);
-
-	dev_info(esp->pdev, "ESP device %s not found\n", src_name);
-	return false;
+	return NULL;
 }
 
-static long esp_p2p_init(struct esp_device *esp, struct esp_access *access)
+/* Validate every stage; each is configured only when it comes up */
+static long esp_chain_init(struct esp_chain *chain, struct esp_chain_req *req)
 {
-	int i = 0;
+	struct esp_chain_stage stage;
+	struct esp_device *esp;
+	struct esp_job *job;
+	unsigned int i;
 
-	esp_p2p_reset(esp);
+	for (i = 0; i < req->n; i++) {
+		if (copy_from_user(&stage, &req->stages[i], sizeof(stage)))
+			return -EFAULT;
+		stage.devname[sizeof(stage.devname) - 1] = '\0';
 
-	for (i = 0; i < access->p2p_nsrcs; i++)
-		if (!esp_p2p_set_src(esp, access->p2p_srcs[i], i))
+		esp = esp_device_get(stage.devname);
+		if (esp == NULL)
 			return -ENODEV;
 
-	if (access->p2p_store) {
-		dev_dbg(esp->pdev, "P2P store enabled\n");
-		esp_p2p_enable_dst(esp);
-	}
+		job = esp_job_alloc(esp, stage.access);
+		if (IS_ERR(job)) {
+			module_put(esp->module);
+			return PTR_ERR(job);
+		}
 
-	if (access->p2p_nsrcs != 0) {
-		esp_p2p_enable_src(esp);
-		esp_p2p_set_nsrcs(esp, access->p2p_nsrcs);
+		/* P2P needs the source tiles programmed in lockstep */
+		if (job->access->p2p_store || job->access->p2p_nsrcs) {
+			esp_job_free(job);
+			module_put(esp->module);
+			return -EINVAL;
+		}
+
+		job->chain = chain;
+		job->stage = i;
+		chain->esp[i] = esp;
+		chain->job[i] = job;
+		chain->n++;
 	}
 
 	return 0;
 }
 
-static int esp_access_ioctl(struct esp_device *esp, void __user *argp)
+/*
+ * Flush for stage @i and run the segment it starts to its end. One flush
+ * covers every later stage of the segment that needs less, until a coherent
+ * stage may fill the caches before they run.
+ */
+static long esp_chain_run_segment(struct esp_chain *chain, unsigned int i)
 {
-	struct contig_desc *contig;
-	struct esp_access *access;
-	void *arg;
-	int rc = 0;
-
-	arg = kmalloc(esp->driver->arg_size, GFP_KERNEL);
-	if (arg == NULL)
-		return -ENOMEM;
-
-	if (copy_from_user(arg, argp, esp->driver->arg_size)) {
-		rc = -EFAULT;
-		goto out;
-	}
-
-	access = arg;
-	contig = contig_khandle_to_desc(access->contig);
-	if (contig == NULL) {
-		rc = -EFAULT;
-		goto out;
-	}
-
-	if (access->p2p_nsrcs > 4) {
-		rc = -EINVAL;
-		goto out;
-	}
-
-	if (!esp_xfer_input_ok(esp, contig)) {
-		rc = -EINVAL;
-		goto out;
-	}
-
-	if (esp->driver->xfer_input_ok && !esp->driver->xfer_input_ok(esp, arg)) {
-		rc = -EINVAL;
-		goto out;
-	}
+	struct esp_job *job = chain->job[i];
+	long rc;
 
-	if (mutex_lock_interruptible(&esp->lock)) {
-		rc = -EINTR;
-		goto out;
+	/* the interrupt of the previous stage resolved it if it ended the segment */
+	if (chain->n_config == i) {
+		esp_job_resolve(chain->esp[i], job);
+		chain->n_config = i + 1;
 	}
 
-	rc = esp_p2p_init(esp, access);
+	rc = esp_job_flush(job, &chain->flushed);
 	if (rc)
-		goto out;
+		return rc;
+	if (job->access->coherence != ACC_COH_NONE)
+		chain->flushed = ACC_COH_AUTO;
 
-	esp->coherence = access->coherence;
-	esp->footprint = access->footprint;
-        esp->alloc_policy = access->alloc_policy;
-        esp->ddr_node = access->ddr_node;
-	esp->in_place = access->in_place;
-	esp->reuse_factor = access->reuse_factor;
+	reinit_completion(&chain->done);
+	esp_chain_queue(chain, i);
 
-    if (mutex_lock_interruptible(&esp_status.lock)) {
-        rc = -EINTR;
-        goto out;
-    }
+	/* a stage that was queued runs anyway: wait for it before returning */
+	if (wait_for_completion_interruptible(&chain->done)) {
+		WRITE_ONCE(chain->abort, true);
+		wait_for_completion(&chain->done);
+		return -EINTR;
+	}
 
-    esp_runtime_config(esp);
+	return 0;
+}
 
-    mutex_unlock(&esp_status.lock);
+static long esp_run_chain_ioctl(void __user *argp)
+{
+	struct esp_chain_req __user *ureq = argp;
+	struct esp_chain_req req;
+	struct esp_chain *chain;
+	struct esp_job *job;
+	unsigned int i;
+	long rc;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	if (req.n == 0 || req.n > ESP_CHAIN_MAX)
+		return -EINVAL;
+
+	chain = kzalloc(sizeof(*chain), GFP_KERNEL);
+	if (chain == NULL)
+		return -ENOMEM;
+	init_completion(&chain->done);
+	chain->flushed = ACC_COH_AUTO;
 
-	rc = esp_flush(esp);
+	rc = esp_chain_init(chain, &req);
 	if (rc)
 		goto out;
 
-	esp_transfer(esp, contig);
-
-	if (esp->driver->prep_xfer)
-		esp->driver->prep_xfer(esp, arg);
-
-	if (access->run) {
-		esp_run(esp);
-		rc = esp_wait(esp);
+	while (!rc && chain->n_done < chain->n) {
+		i = chain->n_done;
+		rc = esp_chain_run_segment(chain, i);
+		if (chain->n_done == i)
+			break;
 	}
-
-    if (mutex_lock_interruptible(&esp_status.lock)) {
-        rc = -EINTR;
-        goto out;
-    }
-
-    esp_update_status(esp);
-
-    mutex_unlock(&esp_status.lock);
-
-	mutex_unlock(&esp->lock);
+	if (!rc && chain->n_done < chain->n)
+		rc = chain->job[chain->n_done]->err == -EAGAIN ? -EAGAIN : -EIO;
+
+	for (i = 0; i < chain->n; i++) {
+		struct esp_chain_stage __user *ustage = &req.stages[i];
+		int err = i < chain->n_done ? 0 : -ECANCELED;
+
+		job = chain->job[i];
+		if (i == chain->n_done && job->err)
+			err = job->err;
+		if (put_user(err, &ustage->err) ||
+			put_user(job->flush_ns, &ustage->flush_ns) ||
+			put_user(job->hw_ns, &ustage->hw_ns))
+			rc = -EFAULT;
+		if (!err)
+			esp_coh_record(chain->esp[i], job);
+	}
+	if (put_user(chain->n_done, &ureq->n_done))
+		rc = -EFAULT;
 
 out:
-	kfree(arg);
+	for (i = 0; i < chain->n; i++) {
+		esp_job_free(chain->job[i]);
+		module_put(chain->esp[i]->module);
+	}
+	kfree(chain);
 	return rc;
 }
 
+static long esp_set_sched_ioctl(struct esp_file *priv, void __user *argp)
+{
+	struct esp_device *esp = priv->esp;
+	struct esp_sched_param param;
+
+	if (copy_from_user(&param, argp, sizeof(param)))
+		return -EFAULT;
+	if (param.sched_class >= ESP_SCHED_CLASSES || !param.weight ||
+		param.weight > ESP_SCHED_WEIGHT_MAX)
+		return -EINVAL;
+	if (param.sched_class == ESP_SCHED_REALTIME && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	/* invocations already waiting keep their class and deadline */
+	spin_lock_irq(&esp->queue_lock);
+	priv->sched = param;
+	spin_unlock_irq(&esp->queue_lock);
+	return 0;
+}
+
 static int esp_run_ioctl(struct esp_device *esp)
 {
 	esp_run(esp);
@@ -462,7 +1797,7 @@ static long esp_flush_ioctl(struct esp_device *esp, void __user *argp)
 
 	access = arg;
 	esp->coherence = access->coherence;
-	rc = esp_flush(esp);
+	rc = esp_flush(esp->coherence);
 out:
 	kfree(arg);
 	return rc;
@@ -470,8 +1805,27 @@ out:
 
 static long esp_do_ioctl(struct file *file, unsigned int cm, void __user *arg)
 {
-	struct esp_device *esp = file->private_data;
-	int ret;
+	struct esp_file *priv = file->private_data;
+	struct esp_device *esp = priv->esp;
+	long ret;
+
+	/*
+	 * reaping and chains sleep until completion: do not block reconfiguration,
+	 * which stops the chains with esp_device_quiesce() instead
+	 */
+	if (cm == ESP_IOC_REAP)
+		return esp_reap_ioctl(priv, arg);
+	if (cm == ESP_IOC_RUN_CHAIN)
+		return esp_run_chain_ioctl(arg);
+	if (cm == ESP_IOC_SET_SCHED)
+		return esp_set_sched_ioctl(priv, arg);
+
+	/* blocking invocations wait in the scheduler and take dpr_lock after */
+	if (cm == ESP_IOC_RUN_PREPARED)
+		return esp_run_prepared_ioctl(priv, arg);
+	if (cm == esp->driver->ioctl_cm)
+		return esp_access_ioctl(priv, arg);
+
 	mutex_lock(&esp->dpr_lock);
 
 
@@ -482,9 +1836,16 @@ static long esp_do_ioctl(struct file *file, unsigned int cm, void __user *arg)
 	case ESP_IOC_FLUSH:
 		ret = esp_flush_ioctl(esp, arg);
 		break;
+	case ESP_IOC_SUBMIT:
+		ret = esp_submit_ioctl(priv, arg);
+		break;
+	case ESP_IOC_PREPARE:
+		ret = esp_prepare_ioctl(priv, arg);
+		break;
+	case ESP_IOC_RELEASE_PREPARED:
+		ret = esp_release_prepared_ioctl(priv, arg);
+		break;
 	default:
-		if (cm == esp->driver->ioctl_cm)
-			ret = esp_access_ioctl(esp, arg);
 		ret = -ENOTTY;
 		break;
 	}
@@ -502,9 +1863,170 @@ static const struct file_operations esp_fops = {
 	.owner		= THIS_MODULE,
 	.open		= esp_open,
 	.release	= esp_release,
+	.mmap		= esp_mmap,
 	.unlocked_ioctl	= esp_ioctl,
 };
 
+/* NoC coordinates of the accelerator tile, as "y x" */
+static ssize_t tile_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u %u\n", esp_get_y(esp), esp_get_x(esp));
+}
+static DEVICE_ATTR_RO(tile);
+
+/* 1 if the accelerator sits on a partially reconfigurable tile */
+static ssize_t reconfigurable_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", esp->driver->dpr);
+}
+static DEVICE_ATTR_RO(reconfigurable);
+
+/*
+ * Learned cost of each coherence mode, one "bucket load mode ns samples" line
+ * per measured entry: bucket i holds footprints below 4 KB << i, load is 0
+ * when no other accelerator was active, ns is the average flush and run time.
+ * Writing such a line seeds an entry; writing "clear" forgets all of them.
+ */
+static ssize_t coherence_table_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+	struct esp_coh_learn *learn = &esp->coh;
+	ssize_t len = 0;
+	int b, l, m;
+
+	spin_lock_irq(&learn->lock);
+	for (b = 0; b < ESP_FOOTPRINT_BUCKETS; b++)
+		for (l = 0; l < ESP_COH_LOADS; l++)
+			for (m = ACC_COH_NONE; m < ACC_COH_AUTO; m++) {
+				struct esp_coh_cell *cell = &learn->cell[b][l][m];
+
+				if (cell->samples)
+					len += scnprintf(buf + len, PAGE_SIZE - len, "%d %d %d %llu %u\n",
+							b, l, m, cell->ns, cell->samples);
+			}
+	spin_unlock_irq(&learn->lock);
+
+	return len;
+}
+
+static ssize_t coherence_table_store(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+	struct esp_coh_learn *learn = &esp->coh;
+	unsigned int b, l, m, samples = 1;
+	unsigned long long ns;
+
+	if (sysfs_streq(buf, "clear")) {
+		spin_lock_irq(&learn->lock);
+		memset(learn->cell, 0, sizeof(learn->cell));
+		spin_unlock_irq(&learn->lock);
+		return count;
+	}
+
+	if (sscanf(buf, "%u %u %u %llu %u", &b, &l, &m, &ns, &samples) < 4)
+		return -EINVAL;
+	if (b >= ESP_FOOTPRINT_BUCKETS || l >= ESP_COH_LOADS || m >= ACC_COH_AUTO)
+		return -EINVAL;
+
+	spin_lock_irq(&learn->lock);
+	learn->cell[b][l][m].ns = ns;
+	learn->cell[b][l][m].samples = samples;
+	spin_unlock_irq(&learn->lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(coherence_table);
+
+/* How blocking invocations wait for the accelerator: irq, spin or adaptive */
+static ssize_t wait_mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", esp_wait_mode_names[READ_ONCE(esp->wait_mode)]);
+}
+
+static ssize_t wait_mode_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+	int mode;
+
+	mode = sysfs_match_string(esp_wait_mode_names, buf);
+	if (mode < 0)
+		return mode;
+
+	WRITE_ONCE(esp->wait_mode, mode);
+	return count;
+}
+static DEVICE_ATTR_RW(wait_mode);
+
+/*
+ * One line per wait mode: blocking invocations waited for, how many of them
+ * completed while spinning, and the average spin time and average and worst
+ * wakeup latency in ns, from completion to the waiter running again.
+ */
+static ssize_t wait_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct esp_device *esp = dev_get_drvdata(dev);
+	struct esp_wait_stats stats[ESP_WAIT_MODES];
+	ssize_t len = 0;
+	int m;
+
+	spin_lock_irq(&esp->queue_lock);
+	memcpy(stats, esp->wait_stats, sizeof(stats));
+	spin_unlock_irq(&esp->queue_lock);
+
+	for (m = 0; m < ESP_WAIT_MODES; m++) {
+		u64 n = stats[m].waits ? stats[m].waits : 1;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"%s waits %llu polled %llu spin_avg_ns %llu wake_avg_ns %llu wake_max_ns %llu\n",
+				esp_wait_mode_names[m], stats[m].waits, stats[m].polled,
+				div64_u64(stats[m].spin_ns, n), div64_u64(stats[m].wake_ns, n),
+				stats[m].wake_max_ns);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(wait_stats);
+
+/*
+ * One line per open file: the process that opened it, its scheduling class,
+ * weight and deadline hint, its invocations waiting and started, their
+ * average and worst wait in ns, the accelerator time charged to the file,
+ * and how many invocations started after their deadline.
+ */
+static ssize_t sched_clients_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	static const char * const names[ESP_SCHED_CLASSES] = { "realtime", "normal", "batch" };
+	struct esp_device *esp = dev_get_drvdata(dev);
+	struct esp_file *priv;
+	ssize_t len = 0;
+
+	spin_lock_irq(&esp->queue_lock);
+	list_for_each_entry(priv, &esp->clients, client) {
+		struct esp_sched_stats *stats = &priv->stats;
+		u64 n = stats->dispatched ? stats->dispatched : 1;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"pid %d class %s weight %u deadline_ns %llu pending %u dispatched %llu "
+				"wait_avg_ns %llu wait_max_ns %llu run_ns %llu missed %llu\n",
+				priv->pid, names[priv->sched.sched_class], priv->sched.weight,
+				priv->sched.deadline_ns, priv->pending, stats->dispatched,
+				div64_u64(stats->wait_ns, n), stats->wait_max_ns, stats->run_ns,
+				stats->missed);
+	}
+	spin_unlock_irq(&esp->queue_lock);
+
+	return len;
+}
+static DEVICE_ATTR_RO(sched_clients);
+
 static int esp_create_cdev(struct esp_device *esp, int ndev)
 {
 	dev_t devno = MKDEV(MAJOR(esp->driver->devno), ndev);
@@ -528,6 +2050,25 @@ static int esp_create_cdev(struct esp_device *esp, int ndev)
 	}
 
 	dev_set_drvdata(esp->dev, esp);
+
+	rc = device_create_file(esp->dev, &dev_attr_tile);
+	if (rc)
+		dev_info(esp->pdev, "cannot create tile attribute\n");
+	rc = device_create_file(esp->dev, &dev_attr_reconfigurable);
+	if (rc)
+		dev_info(esp->pdev, "cannot create reconfigurable attribute\n");
+	rc = device_create_file(esp->dev, &dev_attr_coherence_table);
+	if (rc)
+		dev_info(esp->pdev, "cannot create coherence_table attribute\n");
+	rc = device_create_file(esp->dev, &dev_attr_wait_mode);
+	if (rc)
+		dev_info(esp->pdev, "cannot create wait_mode attribute\n");
+	rc = device_create_file(esp->dev, &dev_attr_wait_stats);
+	if (rc)
+		dev_info(esp->pdev, "cannot create wait_stats attribute\n");
+	rc = device_create_file(esp->dev, &dev_attr_sched_clients);
+	if (rc)
+		dev_info(esp->pdev, "cannot create sched_clients attribute\n");
 	return 0;
 
 device_create_failed:
@@ -540,10 +2081,92 @@ static void esp_destroy_cdev(struct esp_device *esp, int ndev)
 {
 	dev_t devno = MKDEV(MAJOR(esp->driver->devno), ndev);
 
+	if (esp->dev) {
+		device_remove_file(esp->dev, &dev_attr_tile);
+		device_remove_file(esp->dev, &dev_attr_reconfigurable);
+		device_remove_file(esp->dev, &dev_attr_coherence_table);
+		device_remove_file(esp->dev, &dev_attr_wait_mode);
+		device_remove_file(esp->dev, &dev_attr_wait_stats);
+		device_remove_file(esp->dev, &dev_attr_sched_clients);
+	}
+
 	device_destroy(esp->driver->class, devno);
 	cdev_del(&esp->cdev);
 }
 
+/*
+ * Set up the locks, queues and scheduler of @esp. Called once per device:
+ * by esp_device_register(), except for reconfigurable tiles, whose files
+ * and queues stay across the drivers registered in turn on the tile.
+ */
+void esp_device_init(struct esp_device *esp)
+{
+	mutex_init(&esp->lock);
+	mutex_init(&esp->dpr_lock);
+	init_completion(&esp->completion);
+	spin_lock_init(&esp->queue_lock);
+	spin_lock_init(&esp->coh.lock);
+	INIT_LIST_HEAD(&esp->queue);
+	esp->nqueued = 0;
+	esp->running = NULL;
+	INIT_LIST_HEAD(&esp->sync_waiters);
+	esp->sync_running = false;
+	esp->quiesced = false;
+	init_waitqueue_head(&esp->idle_wq);
+	INIT_LIST_HEAD(&esp->clients);
+	esp->sync_client = NULL;
+	esp->min_vruntime = 0;
+}
+EXPORT_SYMBOL_GPL(esp_device_init);
+
+/*
+ * Stop giving the accelerator out before the tile is reconfigured: the
+ * queued invocations complete with -EAGAIN, as do the blocking ones that
+ * wait for the accelerator and any submitted until esp_device_resume().
+ * Returns once the invocation that owns the accelerator, if any, is done.
+ * Must not be called with esp->dpr_lock held.
+ */
+void esp_device_quiesce(struct esp_device *esp)
+{
+	struct esp_job *job, *tmp;
+	u64 now = ktime_get_ns();
+	LIST_HEAD(stages);
+
+	spin_lock_irq(&esp->queue_lock);
+	esp->quiesced = true;
+	list_for_each_entry_safe(job, tmp, &esp->queue, list) {
+		list_del(&job->list);
+		esp_sched_cancel(&job->sched);
+		esp->nqueued--;
+		job->err = -EAGAIN;
+		if (job->chain)
+			list_add_tail(&job->list, &stages);
+		else
+			esp_job_return(job, now);
+	}
+	/* the blocking invocations that wait give up */
+	wake_up(&esp->idle_wq);
+	wait_event_lock_irq(esp->idle_wq, !esp->running && !esp->sync_running, esp->queue_lock);
+	spin_unlock_irq(&esp->queue_lock);
+
+	/* the chains of the failed stages go no further */
+	list_for_each_entry_safe(job, tmp, &stages, list) {
+		list_del_init(&job->list);
+		esp_chain_advance(job);
+	}
+}
+EXPORT_SYMBOL_GPL(esp_device_quiesce);
+
+/* Undo esp_device_quiesce() */
+void esp_device_resume(struct esp_device *esp)
+{
+	spin_lock_irq(&esp->queue_lock);
+	esp->quiesced = false;
+	esp_queue_next(esp);
+	spin_unlock_irq(&esp->queue_lock);
+}
+EXPORT_SYMBOL_GPL(esp_device_resume);
+
 int esp_device_register(struct esp_device *esp, struct platform_device *pdev)
 {
 	struct resource *res;
@@ -553,8 +2176,13 @@ int esp_device_register(struct esp_device *esp, struct platform_device *pdev)
 	esp->driver->esp = esp;
 	esp->driver->pdev = pdev;
 	esp->pdev = &pdev->dev;
-	mutex_init(&esp->lock);
-	init_completion(&esp->completion);
+	/* the device of a reconfigurable tile outlives its drivers */
+	if (!esp->driver->dpr)
+		esp_device_init(esp);
+	spin_lock_irq(&esp->queue_lock);
+	esp->regs_valid = false;
+	esp->last_prepared = NULL;
+	spin_unlock_irq(&esp->queue_lock);
 
 	rc = esp_create_cdev(esp, esp->number);
 	if (rc)
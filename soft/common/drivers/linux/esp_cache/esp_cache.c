@@ -13,9 +13,9 @@ static LIST_HEAD(esp_cache_list);
 struct esp_cache_device {
 	struct device *pdev; /* platform device */
 	struct module *module;
-	struct mutex lock;
 	void __iomem *iomem; /* mmapped registers */
 	struct list_head list;
+	bool flushing; /* protected by esp_cache_flush_lock */
 };
 
 
@@ -39,40 +39,105 @@ static struct of_device_id esp_cache_device_ids[] = {
 };
 
 
-static void esp_cache_do_flush(struct esp_cache_device *esp_cache)
+/* Spin this long on the status registers before sleeping between polls */
+#define ESP_CACHE_SPIN_US	5
+#define ESP_CACHE_POLL_MIN_US	10
+#define ESP_CACHE_POLL_MAX_US	20
+
+/* Serializes flushes; callers blocked on it coalesce onto the next flush */
+static DEFINE_MUTEX(esp_cache_flush_lock);
+static unsigned long esp_cache_flushes; /* completed flushes */
+static unsigned long esp_cache_flush_avg_us; /* moving average latency */
+
+/* Returns true if the flush was started, false if one was already pending */
+static bool esp_cache_start_flush(struct esp_cache_device *esp_cache)
 {
 	int cmd = 1 << ESP_CACHE_CMD_FLUSH_BIT;
 	u32 cmd_reg;
-	u32 satus_reg;
 
 	/* Check if flush is already in progress */
 	cmd_reg = ioread32be(esp_cache->iomem + ESP_CACHE_REG_CMD);
+	if (cmd_reg)
+		return false;
 
-	if (!cmd_reg) {
+	/* Set flush due for LLC cache */
+	iowrite32be(cmd, esp_cache->iomem + ESP_CACHE_REG_CMD);
+	return true;
+}
 
-		/* Set flush due for LLC cache */
-		iowrite32be(cmd, esp_cache->iomem + ESP_CACHE_REG_CMD);
+static bool esp_cache_flush_done(struct esp_cache_device *esp_cache)
+{
+	u32 status_reg;
 
-		/* Wait for completion */
-		do {
-			satus_reg = ioread32be(esp_cache->iomem + ESP_CACHE_REG_STATUS);
-			satus_reg &= ESP_CACHE_STATUS_DONE_MASK;
-		} while (!satus_reg);
+	status_reg = ioread32be(esp_cache->iomem + ESP_CACHE_REG_STATUS);
+	return status_reg & ESP_CACHE_STATUS_DONE_MASK;
+}
+
+/*
+ * Flush every bank at once, then wait for all of them. The first sleep
+ * covers most of the expected latency; after that, poll every few tens of
+ * microseconds instead of spinning.
+ */
+static void esp_cache_flush_all(void)
+{
+	struct esp_cache_device *esp_cache;
+	unsigned long avg_us = esp_cache_flush_avg_us;
+	unsigned long elapsed_us;
+	ktime_t start;
+	bool done;
+
+	start = ktime_get();
+	list_for_each_entry(esp_cache, &esp_cache_list, list)
+		esp_cache->flushing = esp_cache_start_flush(esp_cache);
+
+	if (avg_us > ESP_CACHE_SPIN_US)
+		usleep_range(avg_us / 2, avg_us * 3 / 4);
+
+	for (;;) {
+		done = true;
+		list_for_each_entry(esp_cache, &esp_cache_list, list) {
+			if (!esp_cache->flushing)
+				continue;
+			if (esp_cache_flush_done(esp_cache))
+				esp_cache->flushing = false;
+			else
+				done = false;
+		}
+		if (done)
+			break;
+
+		if (ktime_us_delta(ktime_get(), start) < ESP_CACHE_SPIN_US)
+			cpu_relax();
+		else
+			usleep_range(ESP_CACHE_POLL_MIN_US, ESP_CACHE_POLL_MAX_US);
 	}
 
-	/* Clear command register */
-	iowrite32be(0x0, esp_cache->iomem + ESP_CACHE_REG_CMD);
+	/* Clear command registers */
+	list_for_each_entry(esp_cache, &esp_cache_list, list)
+		iowrite32be(0x0, esp_cache->iomem + ESP_CACHE_REG_CMD);
+
+	elapsed_us = ktime_us_delta(ktime_get(), start);
+	esp_cache_flush_avg_us = (esp_cache_flush_avg_us * 7 + elapsed_us) / 8;
 }
 
 int esp_cache_flush()
 {
-	struct esp_cache_device *esp_cache = NULL;
-	list_for_each_entry(esp_cache, &esp_cache_list, list) {
-		if (mutex_lock_interruptible(&esp_cache->lock))
-			return -EINTR;
-		esp_cache_do_flush(esp_cache);
-		mutex_unlock(&esp_cache->lock);
+	unsigned long seen = READ_ONCE(esp_cache_flushes);
+
+	if (mutex_lock_interruptible(&esp_cache_flush_lock))
+		return -EINTR;
+
+	/*
+	 * The flush in progress when we got here may have missed our writes,
+	 * but the one after it started later: if that completed while we were
+	 * waiting for the lock, there is nothing left to do.
+	 */
+	if (esp_cache_flushes - seen < 2) {
+		esp_cache_flush_all();
+		WRITE_ONCE(esp_cache_flushes, esp_cache_flushes + 1);
 	}
+
+	mutex_unlock(&esp_cache_flush_lock);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(esp_cache_flush);
@@ -94,8 +159,6 @@ static int esp_cache_probe(struct platform_device *pdev)
 
 	esp_cache->module = THIS_MODULE;
 
-	mutex_init(&esp_cache->lock);
-
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	esp_cache->iomem = devm_ioremap_resource(&pdev->dev, res);
 	if (esp_cache->iomem == NULL) {
@@ -38,6 +38,86 @@ void *contig_alloc_policy(struct contig_alloc_params params, unsigned long size,
  */
 void contig_free(contig_handle_t handle);
 
+/**
+ * struct contig_pool_stats - buffer pool statistics
+ * @hits: allocations served by a pooled buffer
+ * @thread_hits: subset of @hits served by the per-thread cache
+ * @misses: allocations that reached the kernel
+ * @frees: calls to contig_free()
+ * @releases: buffers returned to the kernel
+ * @idle_bytes: bytes held by pooled buffers
+ * @idle_buffers: number of pooled buffers, excluding per-thread caches
+ */
+struct contig_pool_stats {
+	unsigned long long hits;
+	unsigned long long thread_hits;
+	unsigned long long misses;
+	unsigned long long frees;
+	unsigned long long releases;
+	unsigned long idle_bytes;
+	unsigned long idle_buffers;
+};
+
+/**
+ * contig_pool_set_retain - bound the memory kept by the buffer pool
+ * @bytes: maximum idle bytes kept mapped after contig_free(); 0 disables
+ *	the pool
+ *
+ * contig_free() keeps buffers mapped and contig_alloc() reuses them for
+ * requests of the same number of chunks and the same policy parameters.
+ * Reused buffers are not cleared. Lowering the bound releases the buffers
+ * of the shared pool right away; each thread releases the excess of its own
+ * cache on its next contig_alloc() or contig_free(), or when it exits. The
+ * default is 0: the pool is off until it is set.
+ */
+void contig_pool_set_retain(unsigned long bytes);
+
+/**
+ * contig_pool_set_thread_cache - size the per-thread buffer cache
+ * @nbufs: buffers each thread keeps without locking (at most 16); 0 disables
+ *	the per-thread caches. The default is 4.
+ */
+void contig_pool_set_thread_cache(unsigned int nbufs);
+
+/**
+ * contig_pool_drain - return every pooled buffer to the kernel
+ *
+ * Only the per-thread cache of the calling thread is drained; the caches of
+ * other threads go back to the shared pool, within the current bound, when
+ * those threads exit.
+ */
+void contig_pool_drain(void);
+
+/**
+ * contig_pool_get_stats - read the buffer pool statistics
+ * @stats: where to store the statistics
+ */
+void contig_pool_get_stats(struct contig_pool_stats *stats);
+
+/**
+ * contig_reserve_attach - allocate from a reservation of the contig_alloc module
+ * @name: name of the reservation, or NULL to stop using one
+ *
+ * Later allocations of the process take memory set aside for @name first,
+ * and memory shared with other processes once it is exhausted. Buffers
+ * freed to the buffer pool stay where they were allocated.
+ *
+ * Returns 0 on success or -1 on error, setting errno.
+ */
+int contig_reserve_attach(const char *name);
+
+/**
+ * contig_set_quota - bound the memory the process takes outside of its
+ * reservation
+ * @bytes: the bound, 0 for none
+ *
+ * Allocations beyond it fail with EDQUOT. The bound starts at the file_quota
+ * parameter of the contig_alloc module; only CAP_SYS_ADMIN can raise it.
+ *
+ * Returns 0 on success or -1 on error, setting errno.
+ */
+int contig_set_quota(unsigned long bytes);
+
 /**
  * contig_to_khandle - obtain a kernel handle from a handle
  * @handle: contig buffer handle to obtain the kernel handle from
@@ -36,11 +36,23 @@ typedef struct contig_khandle_struct *contig_khandle_t;
  *	sharing DDR0.
  * @CONTIG_ALLOC_BALANCED: allocate a cluster of N chunks for each memory
  *	controller.
+ * @CONTIG_ALLOC_LEAST_BUSY: allocate all chunks of each buffer on the DDR
+ *	controller with the least recent traffic, as sampled from the monitors
+ *	of its memory tile, plus a cost per NoC hop from the accelerator tile
+ *	that will access the buffer. Without monitors, allocated memory stands
+ *	in for traffic.
+ * @CONTIG_ALLOC_INTERLEAVED: allocate consecutive chunks of each buffer on
+ *	consecutive DDR controllers, and thus LLC banks, so that an accelerator
+ *	streaming the buffer spreads its requests over all of them. Uses the
+ *	smallest chunks unless the caller asks for a class, and starts each
+ *	buffer one controller after the previous one.
  */
 enum contig_alloc_policy {
 	CONTIG_ALLOC_PREFERRED,
 	CONTIG_ALLOC_LEAST_LOADED,
 	CONTIG_ALLOC_BALANCED,
+	CONTIG_ALLOC_LEAST_BUSY,
+	CONTIG_ALLOC_INTERLEAVED,
 };
 
 /**
@@ -69,10 +81,25 @@ struct contig_alloc_balanced {
         unsigned int cluster_size;
 };
 
+/**
+ * struct contig_alloc_least_busy
+ * @y: NoC row of the accelerator tile, or -1 to ignore the distance
+ * @x: NoC column of the accelerator tile
+ * @hop_cost: traffic, in words per sampling period, worth one NoC hop
+ */
+struct contig_alloc_least_busy {
+	int y;
+	int x;
+	unsigned int hop_cost;
+};
+
 /**
  * struct contig_alloc_params - policy and parameters for contig_alloc
  * @policy: policy to be used for allocation
  * @pol: policy-specific struct
+ * @chunk_log: log2 of the chunk size, one of the classes of the module; 0
+ *	picks the class from the buffer size, falling back to smaller chunks
+ *	when larger ones are not available
  */
 struct contig_alloc_params {
         enum contig_alloc_policy policy;
@@ -80,7 +107,9 @@ struct contig_alloc_params {
                 struct contig_alloc_preferred first;
                 struct contig_alloc_least_loaded lloaded;
                 struct contig_alloc_balanced balanced;
+                struct contig_alloc_least_busy lbusy;
         } pol;
+	unsigned int chunk_log;
 };
 
 struct contig_alloc_req {
@@ -91,30 +120,79 @@ struct contig_alloc_req {
 	void __user *mm; /* user-space only */
 	unsigned int n; /* filled in by the kernel */
 	int most_allocated; /* filled in by the kernel */
-	unsigned int n_max;
+	unsigned int n_max; /* chunks that fit in arr, counted in the smallest class */
+	unsigned int chunk_log; /* of the chunks in arr, filled in by the kernel */
+};
+
+#define CONTIG_RESV_NAME_MAX	32
+
+/**
+ * struct contig_resv_req - memory set aside for some clients
+ * @name: name of the reservation
+ * @size: bytes to reserve, rounded up to whole chunks (create only)
+ * @ddr_node: DDR controller to reserve them from (create only)
+ * @uid: user that may attach besides CAP_SYS_ADMIN, or -1 for any user
+ *	(create only)
+ */
+struct contig_resv_req {
+	char name[CONTIG_RESV_NAME_MAX];
+	unsigned long size;
+	int ddr_node;
+	int uid;
 };
 
 #define CONTIG_IOC_ALLOC	_IOWR('1', 0, struct contig_alloc_req)
 #define CONTIG_IOC_FREE		_IOR ('1', 1, contig_khandle_t)
+/* log2 of the smallest chunk size */
 #define CONTIG_IOC_CHUNK_LOG	_IOW ('1', 2, unsigned long)
+/* CAP_SYS_ADMIN only */
+#define CONTIG_IOC_RESV_CREATE	_IOW ('1', 3, struct contig_resv_req)
+#define CONTIG_IOC_RESV_DESTROY	_IOW ('1', 4, struct contig_resv_req)
+/* allocate from the named reservation first; an empty name detaches */
+#define CONTIG_IOC_RESV_ATTACH	_IOW ('1', 5, struct contig_resv_req)
+/* bytes the file may allocate outside of its reservation, 0 for no limit */
+#define CONTIG_IOC_SET_QUOTA	_IOW ('1', 6, unsigned long)
 
 #ifdef __KERNEL__
 
 #include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/fs.h>
+
+struct contig_resv;
 
 struct contig_desc {
 	unsigned long *arr;
 	dma_addr_t arr_dma_addr;
 	unsigned int n;
+	unsigned int chunk_log; /* log2 of the size of each chunk in arr */
 	int most_allocated;
 	struct list_head desc_node;
 	struct list_head file_node;
-	struct list_head alloc_list;
+	struct kref kref;
+	struct address_space *mapping; /* of the user mappings, if any */
+	unsigned int nmaps;
+	bool cached; /* may have lines in the CPU caches or in the LLC */
+	struct contig_resv *resv; /* reservation the chunks come from, if any */
 };
 
 extern struct contig_desc *contig_alloc(const struct contig_alloc_params *params, unsigned long size);
 extern void contig_free(struct contig_desc *desc);
 extern struct contig_desc *contig_khandle_to_desc(contig_khandle_t khandle);
+extern struct contig_desc *contig_get(contig_khandle_t khandle);
+extern void contig_put(struct contig_desc *desc);
+extern void contig_clean(struct contig_desc *desc);
+
+/* A CPU access or a coherent accelerator may have cached the buffer */
+static inline void contig_set_cached(struct contig_desc *desc)
+{
+	WRITE_ONCE(desc->cached, true);
+}
+
+static inline bool contig_is_cached(struct contig_desc *desc)
+{
+	return READ_ONCE(desc->cached);
+}
 
 extern unsigned long contig_chunk_size_log;
 
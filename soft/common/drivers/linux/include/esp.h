@@ -30,13 +30,198 @@ struct esp_access {
         unsigned int ddr_node;
 	unsigned int in_place;
 	unsigned int reuse_factor;
+	/* where the accelerator reads and writes, in bytes from the buffer start */
+	uint32_t src_offset;
+	uint32_t dst_offset;
+	/* CLOCK_MONOTONIC timestamps in ns, written back by the access ioctl */
+	uint64_t ts_flush; /* cache flush start */
+	uint64_t ts_run; /* accelerator start */
+	uint64_t ts_done; /* completion seen by the driver */
+};
+
+/* Maximum number of invocations waiting in a device submission queue */
+#define ESP_QUEUE_DEPTH 64
+
+/**
+ * struct esp_job_desc - one invocation queued with ESP_IOC_SUBMIT
+ * @access: driver-specific access struct, which starts with struct esp_access
+ * @tag: user cookie, returned unchanged by ESP_IOC_REAP
+ */
+struct esp_job_desc {
+	void __user *access;
+	uint64_t tag;
+};
+
+/**
+ * struct esp_submit_req - queue invocations without waiting for them
+ * @jobs: array of @n invocations, started in order
+ * @n: number of invocations
+ * @n_submitted: number of invocations queued (filled in by the kernel)
+ *
+ * Returns 0 if at least one invocation was queued. The queue holds at most
+ * ESP_QUEUE_DEPTH invocations per device; -EAGAIN means it is full. P2P
+ * invocations cannot be queued, and the esp.run flag is ignored.
+ */
+struct esp_submit_req {
+	struct esp_job_desc __user *jobs;
+	unsigned int n;
+	unsigned int n_submitted;
+};
+
+/**
+ * struct esp_job_done - completion of a queued invocation
+ * @tag: cookie of the invocation
+ * @err: 0 on success, negative error code otherwise
+ * @hw_ns: time from accelerator start to its interrupt
+ * @flush_ns: time spent flushing caches for this invocation at submission
+ */
+struct esp_job_done {
+	uint64_t tag;
+	int err;
+	unsigned long long hw_ns;
+	unsigned long long flush_ns;
+};
+
+/**
+ * struct esp_reap_req - collect completed invocations
+ * @done: array of @n_max completions
+ * @n_max: maximum number of completions to return
+ * @min_complete: block until at least this many completions are available,
+ *	or until every invocation in flight on this file has completed
+ * @n: number of completions returned (filled in by the kernel)
+ */
+struct esp_reap_req {
+	struct esp_job_done __user *done;
+	unsigned int n_max;
+	unsigned int min_complete;
+	unsigned int n;
+};
+
+/**
+ * struct esp_prepare_req - validate an invocation once and run it many times
+ * @access: driver-specific access struct, which starts with struct esp_access
+ * @token: identifies the prepared invocation (filled in by the kernel)
+ *
+ * The contig buffer stays pinned until ESP_IOC_RELEASE_PREPARED or until the
+ * file is closed. Later changes to the access struct in user memory have no
+ * effect; the esp.run flag is ignored.
+ */
+struct esp_prepare_req {
+	void __user *access;
+	unsigned int token;
+};
+
+/* Maximum number of stages of an ESP_IOC_RUN_CHAIN */
+#define ESP_CHAIN_MAX 16
+
+/**
+ * struct esp_chain_stage - one invocation of an accelerator chain
+ * @devname: accelerator that runs the stage, as named in /dev
+ * @access: driver-specific access struct, which starts with struct esp_access
+ * @err: 0 on success, -ECANCELED if the stage did not run, negative error
+ *	code otherwise (filled in by the kernel)
+ * @flush_ns: time spent flushing caches before the stage (filled in by the kernel)
+ * @hw_ns: time from accelerator start to its interrupt (filled in by the kernel)
+ */
+struct esp_chain_stage {
+	char devname[64];
+	void __user *access;
+	int err;
+	unsigned long long flush_ns;
+	unsigned long long hw_ns;
+};
+
+/**
+ * struct esp_chain_req - run invocations on one or more accelerators in order
+ * @stages: array of @n stages
+ * @n: number of stages, at most ESP_CHAIN_MAX
+ * @n_done: stages that completed successfully (filled in by the kernel)
+ *
+ * Each stage is started from the interrupt of the previous one. The caches
+ * are flushed up front for the stages that need it, as for a batch of
+ * ESP_IOC_SUBMIT. Only an ACC_COH_NONE or ACC_COH_LLC stage that follows a
+ * coherent one needs a flush of its own, and the chain goes back to the
+ * calling thread for it.
+ * The chain stops at the first stage that fails. P2P stages are rejected, and the esp.run flag
+ * is ignored. The request may be issued on any open accelerator device.
+ */
+struct esp_chain_req {
+	struct esp_chain_stage __user *stages;
+	unsigned int n;
+	unsigned int n_done;
+};
+
+/* Scheduling classes; a class gets the accelerator only when no higher one waits */
+enum esp_sched_class {
+	ESP_SCHED_REALTIME = 0,
+	ESP_SCHED_NORMAL,
+	ESP_SCHED_BATCH,
+	ESP_SCHED_CLASSES,
+};
+
+#define ESP_SCHED_WEIGHT_DEFAULT 100
+#define ESP_SCHED_WEIGHT_MAX 10000
+
+/**
+ * struct esp_sched_param - how the invocations of a file share the accelerator
+ * @sched_class: ESP_SCHED_*; ESP_SCHED_REALTIME needs CAP_SYS_NICE
+ * @weight: share of accelerator time among the files of the same class,
+ *	from 1 to ESP_SCHED_WEIGHT_MAX
+ * @deadline_ns: hint that each invocation should start within this many ns
+ *	of being issued, 0 for none. Within a class, invocations with a
+ *	deadline go first, earliest deadline first.
+ *
+ * Applies to blocking and queued invocations of the file. Files start in
+ * ESP_SCHED_NORMAL with ESP_SCHED_WEIGHT_DEFAULT and no deadline.
+ */
+struct esp_sched_param {
+	unsigned int sched_class;
+	unsigned int weight;
+	uint64_t deadline_ns;
+};
+
+#define ESP_STATUS_DONE (1 << 0)
+#define ESP_STATUS_ERR (1 << 1)
+
+/**
+ * struct esp_status_page - completion of the invocations queued on a file
+ * @seq: odd while the driver updates the page; a reader retries if it was
+ *	odd or changed while it read the other fields
+ * @flags: ESP_STATUS_DONE, and ESP_STATUS_ERR if it failed, for the last
+ *	invocation that completed
+ * @submitted: invocations queued with ESP_IOC_SUBMIT on this file
+ * @completed: invocations of @submitted that completed, in submission order
+ * @errors: invocations of @completed that failed
+ * @ts_start: CLOCK_MONOTONIC time in ns the last invocation started
+ * @ts_done: CLOCK_MONOTONIC time in ns the last invocation completed
+ *
+ * Mapping one read-only page at offset 0 of an open accelerator device
+ * returns the status page of that file. Completions still have to be
+ * collected with ESP_IOC_REAP.
+ */
+struct esp_status_page {
+	uint32_t seq;
+	uint32_t flags;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t errors;
+	uint64_t ts_start;
+	uint64_t ts_done;
 };
 
 #define ESP_IOC_RUN _IO('E', 0)
 #define ESP_IOC_FLUSH _IO('E', 1)
+#define ESP_IOC_SUBMIT _IOWR('E', 2, struct esp_submit_req)
+#define ESP_IOC_REAP _IOWR('E', 3, struct esp_reap_req)
+#define ESP_IOC_PREPARE _IOWR('E', 4, struct esp_prepare_req)
+#define ESP_IOC_RUN_PREPARED _IOW('E', 5, unsigned int)
+#define ESP_IOC_RELEASE_PREPARED _IOW('E', 6, unsigned int)
+#define ESP_IOC_RUN_CHAIN _IOWR('E', 7, struct esp_chain_req)
+#define ESP_IOC_SET_SCHED _IOW('E', 8, struct esp_sched_param)
 
 #ifdef __KERNEL__
 
+#include <linux/atomic.h>
 #include <linux/platform_device.h>
 #include <linux/completion.h>
 #include <linux/device.h>
@@ -44,12 +229,11 @@ struct esp_access {
 #include <linux/mutex.h>
 #include <linux/cdev.h>
 #include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 
-// TO DO do not hard-code this values
-#define N_MEM 8
-#define PRIVATE_CACHE_SIZE 16384
-#define LLC_SIZE 524288
-#define LLC_SIZE_SPLIT 262144 
+/* Cache geometry comes from the device tree; this only bounds the banks */
+#define ESP_LLC_BANKS_MAX 8
 
 extern struct esp_driver *prc_fir_driver;
 extern struct esp_driver *prc_mac_driver;
@@ -60,6 +244,17 @@ extern spinlock_t esp_drivers_lock;
 extern struct list_head esp_drivers;
 
 struct esp_device;
+struct esp_job;
+
+/* Transfer registers common to all accelerators */
+struct esp_xfer_regs {
+	u32 pt_address;
+	u32 pt_address_ext; /* bits 63:32 of the page table address */
+	u32 pt_shift;
+	u32 pt_nchunk;
+	u32 coherence;
+	u32 p2p;
+};
 
 struct esp_driver {
 	struct list_head list;
@@ -71,11 +266,52 @@ struct esp_driver {
 	void (*prep_xfer)(struct esp_device *esp, void *arg);
 	unsigned int ioctl_cm;
 	size_t arg_size;
+	/*
+	 * The accelerator reaches memory only at SRC_OFFSET_REG and
+	 * DST_OFFSET_REG plus its own indices, so its page table may start at
+	 * the first chunk that the offsets touch.
+	 */
+	bool xfer_window;
 	struct platform_device *pdev;
 	struct esp_device *esp;
 	bool dpr;
 };
 
+#define ESP_FOOTPRINT_BUCKETS 12 /* footprints below 4 KB << i, the last one unbounded */
+
+/* Learned cost of the coherence modes, see coh_learning in esp.c */
+#define ESP_COH_LOADS 2 /* alone, sharing the caches with other accelerators */
+#define ESP_COH_EWMA_SHIFT 3
+
+struct esp_coh_cell {
+	unsigned long long ns; /* moving average of flush plus run time */
+	unsigned int samples;
+};
+
+struct esp_coh_learn {
+	spinlock_t lock;
+	unsigned int picks;
+	struct esp_coh_cell cell[ESP_FOOTPRINT_BUCKETS][ESP_COH_LOADS][ACC_COH_AUTO];
+};
+
+/* How a blocking invocation waits for the accelerator to complete */
+enum esp_wait_mode {
+	ESP_WAIT_IRQ, /* sleep until the interrupt */
+	ESP_WAIT_SPIN, /* spin on STATUS_REG for up to wait_spin_us, then sleep */
+	ESP_WAIT_ADAPTIVE, /* spin only when the usual run time fits wait_spin_us */
+	ESP_WAIT_MODES,
+};
+
+#define ESP_WAIT_EWMA_SHIFT 3
+
+struct esp_wait_stats {
+	unsigned long long waits;
+	unsigned long long polled; /* completions seen while spinning */
+	unsigned long long spin_ns;
+	unsigned long long wake_ns; /* completion to waiter running */
+	unsigned long long wake_max_ns;
+};
+
 struct esp_device {
 	struct list_head list;
 	struct cdev cdev;
@@ -97,22 +333,51 @@ struct esp_device {
 	unsigned int in_place;
 	unsigned int reuse_factor;
 
+	/* submission queue, protected by queue_lock */
+	spinlock_t queue_lock;
+	struct list_head queue;
+	unsigned int nqueued;
+	struct esp_job *running; /* queued invocation owning the accelerator */
+	struct list_head sync_waiters; /* blocking invocations waiting for it */
+	bool sync_running; /* a blocking access ioctl owns the accelerator */
+	bool quiesced; /* the tile is being reconfigured: start nothing */
+	wait_queue_head_t idle_wq;
+	/* scheduler, protected by queue_lock */
+	struct list_head clients; /* open files */
+	struct esp_file *sync_client; /* owner of the blocking invocation */
+	u64 sync_start;
+	u64 min_vruntime; /* lower bound for the clients that start waiting */
+
+	/* last values written to the transfer registers */
+	struct esp_xfer_regs regs;
+	bool regs_valid;
+	struct esp_job *last_prepared; /* owner of the accelerator-specific registers */
+
+	struct esp_coh_learn coh;
+
+	/* blocking invocations, wait_stats protected by queue_lock */
+	enum esp_wait_mode wait_mode;
+	u64 done_ns; /* when the last blocking invocation was seen complete */
+	u64 wait_run_ns[ESP_FOOTPRINT_BUCKETS]; /* usual run time, under esp->lock */
+	struct esp_wait_stats wait_stats[ESP_WAIT_MODES];
 
 	struct mutex dpr_lock;
 };
 
 struct esp_status {
-	struct mutex lock;
-	unsigned int active_acc_cnt;
-	unsigned int active_acc_cnt_full; 
-	unsigned int active_footprint;
-	unsigned int active_footprint_split[N_MEM]; // 2 mem ctrl
+	atomic_t active_acc_cnt;
+	atomic_t active_acc_cnt_full;
+	atomic_t active_footprint;
+	atomic_t active_footprint_split[ESP_LLC_BANKS_MAX]; /* one per LLC bank */
 };
 
 int esp_driver_register(struct esp_driver *driver);
 void esp_driver_unregister(struct esp_driver *driver);
+void esp_device_init(struct esp_device *esp);
 int esp_device_register(struct esp_device *esp, struct platform_device *pdev);
 void esp_device_unregister(struct esp_device *device);
+void esp_device_quiesce(struct esp_device *esp);
+void esp_device_resume(struct esp_device *esp);
 
 #endif /* __KERNEL__ */
 
@@ -41,24 +41,234 @@ typedef struct esp_accelerator_thread_info {
 	/* Filled-in by ESPLIB */
 	int fd;
 	unsigned long long hw_ns;
+	/* Optional, in bytes from hw_buf: where the accelerator reads and writes */
+	unsigned src_offset;
+	unsigned dst_offset;
 } esp_thread_info_t;
 
-typedef struct buf2handle_node {
-	void *buf;
-	contig_handle_t *handle;
-	enum contig_alloc_policy policy;
-	struct buf2handle_node *next;
-} buf2handle_node;
-
 struct thread_args {
 	esp_thread_info_t* info;
 	unsigned nacc;
 };
 
+/* Opaque: see libesp/session.c */
+typedef struct esp_session esp_session_t;
+typedef struct esp_session_job esp_handle_t;
+typedef struct esp_prepared esp_prepared_t;
+typedef struct esp_pool esp_pool_t;
+typedef struct esp_graph esp_graph_t;
+typedef struct esp_stream esp_stream_t;
+typedef struct esp_queue esp_queue_t;
+
 void *esp_alloc_policy(struct contig_alloc_params params, size_t size);
 void *esp_alloc(size_t size);
+/*
+ * Allocate with CONTIG_ALLOC_LEAST_BUSY for the accelerator devname, e.g.
+ * "fft_stratus.0": on the DDR controller with the least recent traffic,
+ * preferring the ones few NoC hops away from the accelerator tile.
+ */
+void *esp_alloc_near(const char *devname, size_t size);
 void esp_run_parallel(esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc);
 void esp_run(esp_thread_info_t cfg[], unsigned nacc);
 void esp_free(void *buf);
+void esp_config(esp_thread_info_t* cfg[], unsigned nthreads, unsigned *nacc);
+bool thread_is_p2p(esp_thread_info_t *thread);
+
+/*
+ * Sub-buffer invocations. hw_buf may point anywhere inside a buffer returned
+ * by esp_alloc(): esp_config() sets the source and destination offsets of
+ * the invocation to where hw_buf lies in that buffer plus info->src_offset
+ * and info->dst_offset, so that slices of one large buffer feed many
+ * invocations without copies. The driver rejects offsets past the end of the
+ * buffer and slices the accelerator page table cannot map; the page table
+ * covers the whole buffer unless the accelerator driver sets xfer_window.
+ */
+
+/*
+ * Sessions keep device files open and a pool of worker threads alive across
+ * invocations. esp_session_submit() and esp_session_submit_parallel() have
+ * the same semantics as esp_run() and esp_run_parallel(), but do not print
+ * timing information; they return 0 on success and -1 if any of the
+ * accelerators could not be invoked. nworkers = 0 selects one worker per
+ * online CPU; the pool grows if a P2P chain needs more concurrent workers.
+ */
+esp_session_t *esp_session_open(unsigned nworkers);
+int esp_session_submit(esp_session_t *session, esp_thread_info_t cfg[], unsigned nacc);
+int esp_session_submit_parallel(esp_session_t *session, esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc);
+void esp_session_close(esp_session_t *session);
+
+/*
+ * Asynchronous invocations. esp_submit() and esp_submit_parallel() configure
+ * and start the accelerators like esp_run() and esp_run_parallel(), then
+ * return a completion handle right away (NULL on error). They run on a
+ * process-wide session; the esp_session_*_async() variants use an explicit
+ * one. The cfg tables must stay valid until the handle completes.
+ *
+ * esp_poll() returns 1 if the handle has completed and 0 otherwise.
+ * esp_wait() blocks until completion, releases the handle and returns 0, or
+ * -1 if any accelerator could not be invoked.
+ * esp_wait_any() blocks for up to timeout_ms (-1: forever) until one of the
+ * handles completes and returns its index, or -1 on timeout; the handle must
+ * still be released with esp_wait().
+ * esp_handle_fd() returns an eventfd that becomes readable on completion, for
+ * use with poll/epoll. It is owned by the handle and closed by esp_wait().
+ */
+esp_handle_t *esp_submit(esp_thread_info_t cfg[], unsigned nacc);
+esp_handle_t *esp_submit_parallel(esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc);
+esp_handle_t *esp_session_submit_async(esp_session_t *session, esp_thread_info_t cfg[], unsigned nacc);
+esp_handle_t *esp_session_submit_parallel_async(esp_session_t *session, esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc);
+int esp_poll(esp_handle_t *handle);
+int esp_wait(esp_handle_t *handle);
+int esp_wait_any(esp_handle_t *handles[], unsigned n, int timeout_ms);
+int esp_handle_fd(esp_handle_t *handle);
+
+/*
+ * Prepared invocations. esp_prepare() configures a single accelerator
+ * invocation and has the driver validate it and pin its buffer once;
+ * it returns NULL on error. esp_run_prepared() runs it and blocks until
+ * completion, only rewriting registers that changed since the previous run
+ * on the device; it stores the hardware time in info->hw_ns and returns 0,
+ * or -1 on error. Changes to the access struct after esp_prepare() have no
+ * effect. esp_release_prepared() frees the invocation and unpins the buffer.
+ */
+esp_prepared_t *esp_prepare(esp_thread_info_t *info);
+int esp_run_prepared(esp_prepared_t *prep);
+void esp_release_prepared(esp_prepared_t *prep);
+
+/*
+ * Accelerator chains. esp_run_chain() runs one invocation per element of
+ * stages, in order, and blocks until the last one completes. The driver
+ * starts each stage from the interrupt of the previous one and flushes the
+ * caches only where the coherence modes of the stages require it, so the
+ * stages may share a tile or hand buffers over in memory without returning
+ * to user space in between. It stores the hardware time of each stage in
+ * its hw_ns and returns 0, or -1 if a stage failed or could not be started.
+ * At most ESP_CHAIN_MAX stages; P2P stages are not supported.
+ */
+int esp_run_chain(esp_thread_info_t *stages[], unsigned n);
+
+/*
+ * Device pools. esp_pool_open() finds every /dev/<devclass>.<n> instance of
+ * an accelerator and returns NULL if there is none. esp_pool_submit() picks
+ * the instance with the fewest invocations in flight from this pool, then
+ * the one closest to the DDR controller of the buffer, and stores its name in
+ * info->devname. It returns a completion handle like esp_submit(); P2P
+ * invocations are not supported. esp_pool_run() submits and waits.
+ */
+esp_pool_t *esp_pool_open(const char *devclass);
+unsigned esp_pool_size(esp_pool_t *pool);
+esp_handle_t *esp_pool_submit(esp_pool_t *pool, esp_thread_info_t *info);
+int esp_pool_run(esp_pool_t *pool, esp_thread_info_t *info);
+void esp_pool_close(esp_pool_t *pool);
+
+/*
+ * Dataflow graphs. Each node is an invocation given as an array of nsets
+ * thread infos, one per buffer set; iteration i runs with set i % nsets, so
+ * up to nsets iterations are in flight at once. A node's devname may name an
+ * instance or an accelerator class, in which case esp_graph_compile() binds
+ * it to an instance, preferring unused ones close to its neighbors.
+ *
+ * Edges order a producer before a consumer. ESP_EDGE_MEMORY edges pass data
+ * through the buffers set up by the caller; ESP_EDGE_P2P edges stream it
+ * between the accelerators, which then run together. ESP_EDGE_AUTO edges
+ * use P2P unless the consumer is on a reconfigurable tile, both nodes share
+ * an instance, or the P2P constraints of either accelerator (all outputs
+ * P2P or none, all inputs P2P from at most four sources or none) cannot be
+ * met. The P2P fields of the access structs are overwritten at compile time.
+ *
+ * esp_graph_run() compiles the graph if needed and runs it for the given
+ * number of iterations; the begin hook runs before an iteration uses its
+ * buffer set and the end hook after every node completed it. It returns 0
+ * on success and -1 on error. esp_graph_edge_is_p2p() and
+ * esp_graph_node_device() report the compiled placement.
+ */
+enum esp_edge_type {
+	ESP_EDGE_AUTO,
+	ESP_EDGE_MEMORY,
+	ESP_EDGE_P2P,
+};
+
+typedef void (*esp_graph_hook_t)(unsigned iter, unsigned set, void *arg);
+
+esp_graph_t *esp_graph_create(unsigned nsets);
+int esp_graph_add_node(esp_graph_t *g, esp_thread_info_t info[]);
+int esp_graph_add_edge(esp_graph_t *g, int src, int dst, enum esp_edge_type type);
+void esp_graph_set_hooks(esp_graph_t *g, esp_graph_hook_t begin, esp_graph_hook_t end, void *arg);
+int esp_graph_compile(esp_graph_t *g);
+int esp_graph_edge_is_p2p(esp_graph_t *g, int edge);
+const char *esp_graph_node_device(esp_graph_t *g, int node);
+int esp_graph_run(esp_graph_t *g, unsigned iterations);
+void esp_graph_destroy(esp_graph_t *g);
+
+/*
+ * Streams. esp_stream_open() allocates nbufs buffers of in_bytes + out_bytes
+ * and copies the invocation in info, whose esp_desc is the accelerator
+ * access struct of desc_size bytes, once per buffer; the accelerator reads
+ * its input at offset 0 and is expected to write its output at in_bytes.
+ * esp_stream_run() calls fill on the input of a free buffer for each frame,
+ * queues the invocation and calls drain on the output of each completed
+ * frame, in order, so that filling and draining overlap the accelerator. It
+ * stops after nframes frames (0: no limit) or when fill returns nonzero, and
+ * returns 0, or -1 if fill returned a negative value, drain returned
+ * nonzero or an invocation failed. esp_stream_get_stats() reports on the
+ * last run; idle is the fraction of the elapsed time the accelerator was not
+ * running a frame.
+ */
+struct esp_stream_stats {
+	unsigned long long frames;
+	unsigned long long elapsed_ns;
+	unsigned long long busy_ns;
+	double fps;
+	double idle;
+};
+
+typedef int (*esp_stream_fill_t)(void *in, unsigned long long frame, void *arg);
+typedef int (*esp_stream_drain_t)(void *out, unsigned long long frame, void *arg);
+
+esp_stream_t *esp_stream_open(esp_thread_info_t *info, size_t desc_size, unsigned nbufs,
+			size_t in_bytes, size_t out_bytes);
+int esp_stream_run(esp_stream_t *stream, unsigned long long nframes,
+		esp_stream_fill_t fill, esp_stream_drain_t drain, void *arg);
+void esp_stream_get_stats(esp_stream_t *stream, struct esp_stream_stats *stats);
+void esp_stream_close(esp_stream_t *stream);
+
+/*
+ * Device queues. esp_queue_open() opens an accelerator instance for
+ * invocations queued in the driver and maps its status page; it returns NULL
+ * on error. esp_queue_submit() queues one invocation and returns its ticket,
+ * or 0 on error (errno EAGAIN if the driver queue is full); the access struct
+ * must stay valid until the invocation completes. Tickets of a queue complete
+ * in order. esp_queue_done() returns 1 once the ticket has completed and 0
+ * otherwise, reading only the status page, so it is cheap enough to poll many
+ * queues in a loop. esp_queue_wait() spins for up to spin_us microseconds,
+ * then sleeps in the driver until the ticket completes; it returns 0, or -1
+ * if this or an earlier unreported invocation failed. esp_queue_close() waits
+ * for every invocation of the queue.
+ */
+esp_queue_t *esp_queue_open(const char *devname);
+unsigned long long esp_queue_submit(esp_queue_t *queue, esp_thread_info_t *info);
+int esp_queue_done(esp_queue_t *queue, unsigned long long ticket);
+int esp_queue_wait(esp_queue_t *queue, unsigned long long ticket, unsigned spin_us);
+void esp_queue_close(esp_queue_t *queue);
+
+/*
+ * Scheduling. esp_set_sched() sets the class, weight and deadline hint (see
+ * struct esp_sched_param) with which the driver schedules the invocations of
+ * this process against those of other processes sharing an accelerator. It
+ * applies to the device files libesp opens afterwards, so it should be called
+ * before the first invocation; errors are reported when a file is opened.
+ * The driver reports per-client waits in /sys/class/<devclass>/<dev>/sched_clients.
+ */
+void esp_set_sched(const struct esp_sched_param *param);
+
+/*
+ * Tracing. If the ESP_TRACE environment variable names a file, libesp
+ * records the buffer lookup, device open and ioctl of every invocation, as
+ * well as the cache flush, accelerator run and wakeup reported by the
+ * driver, and writes them to that file as Chrome trace-event JSON at exit.
+ * esp_trace_dump() writes the events recorded so far to path at any time
+ * and returns 0, or -1 on error. Each thread keeps its latest 4096 events.
+ */
+int esp_trace_dump(const char *path);
 
 #endif /* __ESPLIB_H__ */
@@ -0,0 +1,646 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * graph.c
+ * Dataflow graphs of accelerator invocations. Nodes are invocations and
+ * edges are producer/consumer dependences. esp_graph_compile() binds each
+ * node to an accelerator instance, decides which edges are implemented with
+ * P2P transfers and groups P2P-connected nodes into units that run together.
+ * esp_graph_run() then runs the units in dependence order, overlapping
+ * successive iterations that use different buffer sets.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include "libesp.h"
+#include "session.h"
+
+#define ESP_GRAPH_MAX_NODES	32
+#define ESP_GRAPH_MAX_EDGES	64
+#define ESP_GRAPH_MAX_DEVS	64
+#define ESP_P2P_MAX_SRCS	4
+
+struct esp_graph_node {
+	esp_thread_info_t *info; /* one entry per buffer set */
+	char req[ESP_DEVNAME_MAX + 1]; /* device or class name requested */
+	struct esp_devinfo dev;
+	unsigned devid; /* index in graph->devs */
+	unsigned unit;
+};
+
+struct esp_graph_edge {
+	unsigned src;
+	unsigned dst;
+	enum esp_edge_type type;
+	bool p2p;
+};
+
+struct esp_graph_unit {
+	esp_graph_t *graph;
+	unsigned nodes[ESP_GRAPH_MAX_NODES];
+	unsigned nnodes;
+	uint32_t preds; /* units this one reads memory from */
+	uint32_t devs; /* devices used by this unit */
+	unsigned next; /* next iteration to launch */
+	esp_handle_t *handle; /* iteration in flight, or NULL */
+	bool complete; /* set by the session worker, under graph->lock */
+};
+
+struct esp_graph {
+	unsigned nsets;
+	struct esp_graph_node nodes[ESP_GRAPH_MAX_NODES];
+	unsigned nnodes;
+	struct esp_graph_edge edges[ESP_GRAPH_MAX_EDGES];
+	unsigned nedges;
+	struct esp_graph_unit units[ESP_GRAPH_MAX_NODES];
+	unsigned nunits;
+	unsigned order[ESP_GRAPH_MAX_NODES]; /* units in topological order */
+	char devs[ESP_GRAPH_MAX_NODES][ESP_DEVNAME_MAX + 1];
+	unsigned ndevs;
+	bool compiled;
+
+	esp_graph_hook_t begin;
+	esp_graph_hook_t end;
+	void *hook_arg;
+
+	esp_session_t *session;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+esp_graph_t *esp_graph_create(unsigned nsets)
+{
+	esp_graph_t *g;
+
+	if (nsets == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		return NULL;
+	g->nsets = nsets;
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	return g;
+}
+
+int esp_graph_add_node(esp_graph_t *g, esp_thread_info_t info[])
+{
+	struct esp_graph_node *node;
+
+	if (g->nnodes == ESP_GRAPH_MAX_NODES || strlen(info[0].devname) > ESP_DEVNAME_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	node = &g->nodes[g->nnodes];
+	node->info = info;
+	strcpy(node->req, info[0].devname);
+	g->compiled = false;
+	return g->nnodes++;
+}
+
+int esp_graph_add_edge(esp_graph_t *g, int src, int dst, enum esp_edge_type type)
+{
+	struct esp_graph_edge *edge;
+
+	if (g->nedges == ESP_GRAPH_MAX_EDGES || src < 0 || dst < 0 ||
+		src >= g->nnodes || dst >= g->nnodes || src == dst) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	edge = &g->edges[g->nedges];
+	edge->src = src;
+	edge->dst = dst;
+	edge->type = type;
+	g->compiled = false;
+	return g->nedges++;
+}
+
+void esp_graph_set_hooks(esp_graph_t *g, esp_graph_hook_t begin, esp_graph_hook_t end, void *arg)
+{
+	g->begin = begin;
+	g->end = end;
+	g->hook_arg = arg;
+}
+
+static unsigned esp_graph_hops(struct esp_devinfo *a, struct esp_devinfo *b)
+{
+	if (a->y < 0 || b->y < 0)
+		return 0;
+	return abs(a->y - b->y) + abs(a->x - b->x);
+}
+
+/*
+ * Bind a node that names an accelerator class to one of its instances:
+ * prefer instances not yet used by the graph, then instances that can take
+ * P2P input if the node has candidate P2P inputs, then the instance closest
+ * to the neighbors that are already bound.
+ */
+static int esp_graph_bind_class(esp_graph_t *g, unsigned n, bool *bound)
+{
+	struct esp_devinfo devs[ESP_GRAPH_MAX_DEVS];
+	struct esp_graph_node *node = &g->nodes[n];
+	unsigned best_score[3] = { 0, 0, 0 };
+	int best = -1;
+	bool p2p_in = false;
+	unsigned ndevs;
+	unsigned i, j;
+
+	ndevs = esp_find_devices(node->req, devs, ESP_GRAPH_MAX_DEVS);
+	if (ndevs == 0) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	for (j = 0; j < g->nedges; j++)
+		if (g->edges[j].dst == n && g->edges[j].type != ESP_EDGE_MEMORY)
+			p2p_in = true;
+
+	for (i = 0; i < ndevs; i++) {
+		unsigned score[3] = { 0, 0, 0 };
+
+		for (j = 0; j < g->nnodes; j++)
+			if (bound[j] && !strcmp(g->nodes[j].dev.name, devs[i].name))
+				score[0]++;
+		score[1] = p2p_in && devs[i].reconfigurable;
+		for (j = 0; j < g->nedges; j++) {
+			struct esp_graph_edge *edge = &g->edges[j];
+
+			if (edge->type == ESP_EDGE_MEMORY)
+				continue;
+			if (edge->src == n && bound[edge->dst])
+				score[2] += esp_graph_hops(&devs[i], &g->nodes[edge->dst].dev);
+			if (edge->dst == n && bound[edge->src])
+				score[2] += esp_graph_hops(&devs[i], &g->nodes[edge->src].dev);
+		}
+
+		for (j = 0; j < 3 && best >= 0; j++)
+			if (score[j] != best_score[j])
+				break;
+		if (best < 0 || (j < 3 && score[j] < best_score[j])) {
+			best = i;
+			memcpy(best_score, score, sizeof(score));
+		}
+	}
+
+	node->dev = devs[best];
+	return 0;
+}
+
+static int esp_graph_bind(esp_graph_t *g)
+{
+	bool bound[ESP_GRAPH_MAX_NODES] = { false };
+	unsigned i, j;
+
+	/* nodes naming an instance first, so that classes can be placed
+	 * around them */
+	for (i = 0; i < g->nnodes; i++) {
+		struct esp_graph_node *node = &g->nodes[i];
+		char path[ESP_DEVNAME_MAX + sizeof("/dev/")];
+		char devclass[ESP_DEVNAME_MAX + 1];
+		char *dot;
+
+		sprintf(path, "/dev/%s", node->req);
+		if (access(path, F_OK))
+			continue;
+
+		strcpy(devclass, node->req);
+		dot = strrchr(devclass, '.');
+		if (dot)
+			*dot = '\0';
+		memset(&node->dev, 0, sizeof(node->dev));
+		strcpy(node->dev.name, node->req);
+		esp_read_devinfo(devclass, &node->dev);
+		bound[i] = true;
+	}
+
+	for (i = 0; i < g->nnodes; i++) {
+		if (bound[i])
+			continue;
+		if (esp_graph_bind_class(g, i, bound))
+			return -1;
+		bound[i] = true;
+	}
+
+	g->ndevs = 0;
+	for (i = 0; i < g->nnodes; i++) {
+		struct esp_graph_node *node = &g->nodes[i];
+
+		for (j = 0; j < g->ndevs; j++)
+			if (!strcmp(g->devs[j], node->dev.name))
+				break;
+		if (j == g->ndevs)
+			strcpy(g->devs[g->ndevs++], node->dev.name);
+		node->devid = j;
+	}
+	return 0;
+}
+
+/*
+ * An accelerator either stores all of its output P2P or all of it to
+ * memory, and either loads all of its input P2P, from up to four sources,
+ * or all of it from memory. Demote automatic edges until every node
+ * satisfies these constraints; fail if explicit P2P edges cannot.
+ */
+static int esp_graph_settle(esp_graph_t *g)
+{
+	bool changed = true;
+	unsigned i, j;
+
+	while (changed) {
+		changed = false;
+		for (i = 0; i < g->nnodes; i++) {
+			unsigned in_p2p = 0, in_mem = 0, out_mem = 0;
+
+			for (j = 0; j < g->nedges; j++) {
+				struct esp_graph_edge *edge = &g->edges[j];
+
+				if (edge->dst == i) {
+					if (edge->p2p)
+						in_p2p++;
+					else
+						in_mem++;
+				}
+				if (edge->src == i && !edge->p2p)
+					out_mem++;
+			}
+
+			for (j = 0; j < g->nedges; j++) {
+				struct esp_graph_edge *edge = &g->edges[j];
+				bool demote = false;
+
+				if (!edge->p2p)
+					continue;
+				if (edge->dst == i && (in_mem || in_p2p > ESP_P2P_MAX_SRCS))
+					demote = true;
+				if (edge->src == i && out_mem)
+					demote = true;
+				if (!demote)
+					continue;
+				if (edge->type == ESP_EDGE_P2P) {
+					errno = EINVAL;
+					return -1;
+				}
+				edge->p2p = false;
+				changed = true;
+			}
+		}
+	}
+	return 0;
+}
+
+static unsigned esp_graph_find(unsigned *parent, unsigned n)
+{
+	while (parent[n] != n)
+		n = parent[n] = parent[parent[n]];
+	return n;
+}
+
+/*
+ * Group P2P-connected nodes into units; return a node whose device is
+ * already used by its unit, or -1
+ */
+static int esp_graph_group(esp_graph_t *g)
+{
+	unsigned parent[ESP_GRAPH_MAX_NODES];
+	unsigned unit_of[ESP_GRAPH_MAX_NODES];
+	unsigned i;
+
+	for (i = 0; i < g->nnodes; i++)
+		parent[i] = i;
+	for (i = 0; i < g->nedges; i++) {
+		struct esp_graph_edge *edge = &g->edges[i];
+
+		if (edge->p2p)
+			parent[esp_graph_find(parent, edge->src)] = esp_graph_find(parent, edge->dst);
+	}
+
+	memset(g->units, 0, sizeof(g->units));
+	g->nunits = 0;
+	for (i = 0; i < g->nnodes; i++)
+		unit_of[i] = ESP_GRAPH_MAX_NODES;
+	for (i = 0; i < g->nnodes; i++) {
+		unsigned root = esp_graph_find(parent, i);
+		struct esp_graph_unit *unit;
+
+		if (unit_of[root] == ESP_GRAPH_MAX_NODES)
+			unit_of[root] = g->nunits++;
+		unit = &g->units[unit_of[root]];
+		g->nodes[i].unit = unit_of[root];
+
+		/* P2P accelerators must all run at the same time */
+		if (unit->devs & (1u << g->nodes[i].devid))
+			return i;
+		unit->graph = g;
+		unit->devs |= 1u << g->nodes[i].devid;
+		unit->nodes[unit->nnodes++] = i;
+	}
+	return -1;
+}
+
+/* Order units by their memory dependences */
+static int esp_graph_sort(esp_graph_t *g)
+{
+	unsigned indeg[ESP_GRAPH_MAX_NODES];
+	unsigned head = 0, tail = 0;
+	unsigned i, j;
+
+	for (i = 0; i < g->nedges; i++) {
+		struct esp_graph_edge *edge = &g->edges[i];
+		unsigned src = g->nodes[edge->src].unit;
+		unsigned dst = g->nodes[edge->dst].unit;
+
+		if (edge->p2p)
+			continue;
+		/* a unit cannot wait for its own output */
+		if (src == dst) {
+			errno = EINVAL;
+			return -1;
+		}
+		g->units[dst].preds |= 1u << src;
+	}
+
+	for (i = 0; i < g->nunits; i++) {
+		indeg[i] = __builtin_popcount(g->units[i].preds);
+		if (indeg[i] == 0)
+			g->order[tail++] = i;
+	}
+	while (head < tail) {
+		unsigned u = g->order[head++];
+
+		for (j = 0; j < g->nunits; j++)
+			if ((g->units[j].preds & (1u << u)) && --indeg[j] == 0)
+				g->order[tail++] = j;
+	}
+	if (tail != g->nunits) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int esp_graph_compile(esp_graph_t *g)
+{
+	unsigned i, k;
+	int dup;
+
+	if (g->nnodes == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (esp_graph_bind(g))
+		return -1;
+
+	/* P2P is not used towards reconfigurable tiles, whose accelerator
+	 * may be swapped between iterations, nor within one device */
+	for (i = 0; i < g->nedges; i++) {
+		struct esp_graph_edge *edge = &g->edges[i];
+		struct esp_graph_node *src = &g->nodes[edge->src];
+		struct esp_graph_node *dst = &g->nodes[edge->dst];
+
+		edge->p2p = edge->type != ESP_EDGE_MEMORY && src->devid != dst->devid;
+		if (edge->type == ESP_EDGE_AUTO && dst->dev.reconfigurable)
+			edge->p2p = false;
+		if (edge->type == ESP_EDGE_P2P && !edge->p2p) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for (;;) {
+		bool demoted = false;
+
+		if (esp_graph_settle(g))
+			return -1;
+		dup = esp_graph_group(g);
+		if (dup < 0)
+			break;
+
+		/* detach the node from its unit and try again */
+		for (i = 0; i < g->nedges; i++) {
+			struct esp_graph_edge *edge = &g->edges[i];
+
+			if (edge->p2p && edge->type == ESP_EDGE_AUTO && (edge->src == dup || edge->dst == dup)) {
+				edge->p2p = false;
+				demoted = true;
+			}
+		}
+		if (!demoted) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (esp_graph_sort(g))
+		return -1;
+
+	for (i = 0; i < g->nnodes; i++) {
+		struct esp_graph_node *node = &g->nodes[i];
+
+		for (k = 0; k < g->nsets; k++) {
+			esp_thread_info_t *info = &node->info[k];
+			struct esp_access *desc = info->esp_desc;
+
+			info->run = true;
+			info->devname = node->dev.name;
+			desc->p2p_store = 0;
+			desc->p2p_nsrcs = 0;
+		}
+	}
+	for (i = 0; i < g->nedges; i++) {
+		struct esp_graph_edge *edge = &g->edges[i];
+		struct esp_graph_node *src = &g->nodes[edge->src];
+		struct esp_graph_node *dst = &g->nodes[edge->dst];
+
+		if (!edge->p2p)
+			continue;
+		if (strlen(src->dev.name) >= sizeof(src->info[0].esp_desc->p2p_srcs[0])) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		for (k = 0; k < g->nsets; k++) {
+			struct esp_access *desc = dst->info[k].esp_desc;
+
+			src->info[k].esp_desc->p2p_store = 1;
+			strcpy(desc->p2p_srcs[desc->p2p_nsrcs++], src->dev.name);
+		}
+	}
+
+	g->compiled = true;
+	return 0;
+}
+
+int esp_graph_edge_is_p2p(esp_graph_t *g, int edge)
+{
+	if (!g->compiled || edge < 0 || edge >= g->nedges)
+		return -1;
+	return g->edges[edge].p2p;
+}
+
+const char *esp_graph_node_device(esp_graph_t *g, int node)
+{
+	if (!g->compiled || node < 0 || node >= g->nnodes)
+		return NULL;
+	return g->nodes[node].dev.name;
+}
+
+static void esp_graph_unit_done(void *arg)
+{
+	struct esp_graph_unit *unit = arg;
+	esp_graph_t *g = unit->graph;
+
+	pthread_mutex_lock(&g->lock);
+	unit->complete = true;
+	pthread_cond_signal(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+}
+
+static bool esp_graph_unit_ready(esp_graph_t *g, struct esp_graph_unit *unit, unsigned begun)
+{
+	unsigned i;
+
+	if (unit->handle || unit->next >= begun)
+		return false;
+
+	for (i = 0; i < g->nunits; i++) {
+		struct esp_graph_unit *other = &g->units[i];
+
+		if ((unit->preds & (1u << i)) && other->next <= unit->next)
+			return false;
+		/* two P2P units sharing devices could wait for each other */
+		if (other != unit && other->handle && (unit->devs & other->devs) &&
+			(unit->nnodes > 1 || other->nnodes > 1))
+			return false;
+	}
+	return true;
+}
+
+static int esp_graph_launch(esp_graph_t *g, struct esp_graph_unit *unit)
+{
+	esp_thread_info_t *cfg[ESP_GRAPH_MAX_NODES];
+	unsigned nacc[ESP_GRAPH_MAX_NODES];
+	unsigned set = unit->next % g->nsets;
+	unsigned i;
+
+	for (i = 0; i < unit->nnodes; i++) {
+		cfg[i] = &g->nodes[unit->nodes[i]].info[set];
+		nacc[i] = 1;
+	}
+
+	unit->complete = false;
+	unit->handle = esp_session_enqueue(g->session, cfg, unit->nnodes, nacc, esp_graph_unit_done, unit);
+	return unit->handle ? 0 : -1;
+}
+
+int esp_graph_run(esp_graph_t *g, unsigned iterations)
+{
+	unsigned begun = 0;
+	unsigned finished = 0;
+	int rc = 0;
+	unsigned i;
+
+	if (!g->compiled && esp_graph_compile(g))
+		return -1;
+	if (g->session == NULL) {
+		g->session = esp_session_open(g->nnodes);
+		if (g->session == NULL)
+			return -1;
+	}
+	for (i = 0; i < g->nunits; i++) {
+		g->units[i].next = 0;
+		g->units[i].handle = NULL;
+		g->units[i].complete = false;
+	}
+
+	while (finished < iterations) {
+		bool progress = false;
+		unsigned inflight = 0;
+
+		/* at most nsets iterations in flight, one per buffer set */
+		if (rc == 0 && begun < iterations && begun < finished + g->nsets) {
+			if (g->begin)
+				g->begin(begun, begun % g->nsets, g->hook_arg);
+			begun++;
+			continue;
+		}
+
+		for (i = 0; i < g->nunits; i++) {
+			struct esp_graph_unit *unit = &g->units[g->order[i]];
+			bool complete;
+
+			if (unit->handle) {
+				pthread_mutex_lock(&g->lock);
+				complete = unit->complete;
+				pthread_mutex_unlock(&g->lock);
+				if (!complete) {
+					inflight++;
+					continue;
+				}
+				if (esp_wait(unit->handle))
+					rc = -1;
+				unit->handle = NULL;
+				unit->next++;
+				progress = true;
+			}
+
+			if (rc == 0 && esp_graph_unit_ready(g, unit, begun)) {
+				if (esp_graph_launch(g, unit)) {
+					rc = -1;
+					continue;
+				}
+				inflight++;
+				progress = true;
+			}
+		}
+
+		if (rc == 0) {
+			for (i = 0; i < g->nunits; i++)
+				if (g->units[i].next <= finished)
+					break;
+			if (i == g->nunits) {
+				if (g->end)
+					g->end(finished, finished % g->nsets, g->hook_arg);
+				finished++;
+				continue;
+			}
+		} else if (inflight == 0) {
+			break;
+		}
+
+		if (progress || inflight == 0)
+			continue;
+
+		pthread_mutex_lock(&g->lock);
+		for (;;) {
+			for (i = 0; i < g->nunits; i++)
+				if (g->units[i].handle && g->units[i].complete)
+					break;
+			if (i < g->nunits)
+				break;
+			pthread_cond_wait(&g->cond, &g->lock);
+		}
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	return rc;
+}
+
+void esp_graph_destroy(esp_graph_t *g)
+{
+	if (g == NULL)
+		return;
+
+	if (g->session)
+		esp_session_close(g->session);
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->lock);
+	free(g);
+}
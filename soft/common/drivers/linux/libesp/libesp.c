@@ -3,58 +3,151 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <errno.h>
+
 #include "libesp.h"
+#include "session.h"
+#include "trace.h"
 
-buf2handle_node *head = NULL;
+/*
+ * Registry of live contig buffers. A buffer is linked into the hash bucket of
+ * every BUF_GRANULE_SHIFT-sized granule of address space it covers, so any
+ * pointer into it, including an interior one, resolves with a single bucket
+ * walk. Buckets have their own reader-writer lock: lookups run concurrently
+ * and only contend with allocations that hash to the same bucket.
+ */
+#define BUF_GRANULE_SHIFT 20
+#define BUF_BUCKETS_LOG 10
+#define BUF_BUCKETS (1 << BUF_BUCKETS_LOG)
+
+struct esp_buf {
+	void *buf;
+	size_t size;
+	contig_handle_t handle;
+	enum contig_alloc_policy policy;
+};
+
+struct esp_buf_link {
+	struct esp_buf *b;
+	struct esp_buf_link *next;
+};
+
+static struct esp_buf_bucket {
+	pthread_rwlock_t lock;
+	struct esp_buf_link *head;
+} buf_table[BUF_BUCKETS] = {
+	[0 ... BUF_BUCKETS - 1] = { PTHREAD_RWLOCK_INITIALIZER, NULL },
+};
+
+static inline uintptr_t buf_granule(const void *p)
+{
+	return (uintptr_t) p >> BUF_GRANULE_SHIFT;
+}
 
-void insert_buf(void *buf, contig_handle_t *handle, enum contig_alloc_policy policy)
+static inline struct esp_buf_bucket *buf_bucket(uintptr_t granule)
 {
-	buf2handle_node *new = malloc(sizeof(buf2handle_node));
-	new->buf = buf;
-	new->handle = handle;
-	new->policy = policy;
+	return &buf_table[(uint64_t) (granule * 0x9E3779B97F4A7C15ULL) >> (64 - BUF_BUCKETS_LOG)];
+}
 
-	new->next = head;
-	head = new;
+static inline uintptr_t buf_last_granule(const struct esp_buf *b)
+{
+	return buf_granule((char *) b->buf + (b->size ? b->size - 1 : 0));
 }
 
-contig_handle_t* lookup_handle(void *buf, enum contig_alloc_policy *policy)
+void insert_buf(void *buf, size_t size, contig_handle_t handle, enum contig_alloc_policy policy)
 {
-	buf2handle_node *cur = head;
-	while (cur != NULL) {
-		if (cur->buf == buf) {
-			if (policy != NULL)
-				*policy = cur->policy;
-			return cur->handle;
-		}
-		cur = cur->next;
+	struct esp_buf *b = malloc(sizeof(struct esp_buf));
+	uintptr_t g;
+
+	if (b == NULL)
+		die_errno("%s: cannot allocate buffer entry", __func__);
+	b->buf = buf;
+	b->size = size;
+	b->handle = handle;
+	b->policy = policy;
+
+	for (g = buf_granule(buf); g <= buf_last_granule(b); g++) {
+		struct esp_buf_bucket *bucket = buf_bucket(g);
+		struct esp_buf_link *new = malloc(sizeof(struct esp_buf_link));
+
+		if (new == NULL)
+			die_errno("%s: cannot allocate buffer entry", __func__);
+		new->b = b;
+
+		pthread_rwlock_wrlock(&bucket->lock);
+		new->next = bucket->head;
+		bucket->head = new;
+		pthread_rwlock_unlock(&bucket->lock);
 	}
-	die("buf not in active allocations\n");
 }
 
-void remove_buf(void *buf)
+/*
+ * Copy the entry of the buffer that contains @ptr to @copy; if @exact, @ptr
+ * must be its start. The entry may be freed as soon as the bucket lock is
+ * dropped, so callers only ever see the copy. Returns false if none.
+ */
+static bool find_buf(void *ptr, bool exact, struct esp_buf *copy)
 {
-	buf2handle_node *cur = head;
-	if (cur->buf == buf) {
-		head = cur->next;
-		contig_free(*(cur->handle));
-		free(cur);
-		return;
+	struct esp_buf_bucket *bucket = buf_bucket(buf_granule(ptr));
+	struct esp_buf_link *cur;
+	bool found = false;
+
+	pthread_rwlock_rdlock(&bucket->lock);
+	for (cur = bucket->head; cur != NULL; cur = cur->next) {
+		char *start = cur->b->buf;
+
+		if ((char *) ptr == start ||
+			(!exact && (char *) ptr > start && (char *) ptr < start + cur->b->size)) {
+			*copy = *cur->b;
+			found = true;
+			break;
+		}
 	}
+	pthread_rwlock_unlock(&bucket->lock);
 
-	buf2handle_node *prev;
-	while (cur != NULL && cur->buf != buf) {
-		prev = cur;
-		cur = cur->next;
-	}
+	return found;
+}
+
+contig_handle_t lookup_handle(void *buf, enum contig_alloc_policy *policy)
+{
+	struct esp_buf b;
+
+	if (!find_buf(buf, false, &b))
+		die("buf not in active allocations\n");
+	if (policy != NULL)
+		*policy = b.policy;
+	return b.handle;
+}
 
-	if (cur == NULL)
+void remove_buf(void *buf)
+{
+	struct esp_buf copy, *b = NULL;
+	uintptr_t g;
+
+	if (!find_buf(buf, true, &copy))
 		die("buf not in active allocations\n");
 
-	prev->next = cur->next;
-	contig_free(*(cur->handle));
-	free(cur->handle);
-	free(cur);
+	/* buffers do not overlap: the entry is the one that starts at @buf */
+	for (g = buf_granule(buf); g <= buf_last_granule(&copy); g++) {
+		struct esp_buf_bucket *bucket = buf_bucket(g);
+		struct esp_buf_link **pp;
+
+		pthread_rwlock_wrlock(&bucket->lock);
+		for (pp = &bucket->head; *pp != NULL; pp = &(*pp)->next) {
+			if ((*pp)->b->buf == buf) {
+				struct esp_buf_link *cur = *pp;
+
+				b = cur->b;
+				*pp = cur->next;
+				free(cur);
+				break;
+			}
+		}
+		pthread_rwlock_unlock(&bucket->lock);
+	}
+
+	contig_free(copy.handle);
+	free(b);
 }
 
 bool thread_is_p2p(esp_thread_info_t *thread)
@@ -82,6 +175,8 @@ void *accelerator_thread( void *ptr )
 	}
 
 	info->hw_ns = ts_subtract(&th_start, &th_end);
+	if (esp_trace_on)
+		esp_trace_ioctl(info, getformattedtime(&th_start), getformattedtime(&th_end));
 
 	return NULL;
 }
@@ -143,6 +238,8 @@ void *accelerator_thread_serial(void *ptr)
 		}
 
 		info->hw_ns = ts_subtract(&th_start, &th_end);
+		if (esp_trace_on)
+			esp_trace_ioctl(info, getformattedtime(&th_start), getformattedtime(&th_end));
 		close(info->fd);
 	}
 	free(ptr);
@@ -151,21 +248,56 @@ void *accelerator_thread_serial(void *ptr)
 
 void *esp_alloc_policy(struct contig_alloc_params params, size_t size)
 {
-	contig_handle_t *handle = malloc(sizeof(contig_handle_t));
-	void* contig_ptr = contig_alloc_policy(params, size, handle);
-	insert_buf(contig_ptr, handle, params.policy);
+	contig_handle_t handle;
+	void* contig_ptr = contig_alloc_policy(params, size, &handle);
+	if (contig_ptr == NULL)
+		return NULL;
+	insert_buf(contig_ptr, size, handle, params.policy);
 	return contig_ptr;
 }
 
+/* Traffic, in words per sampling period of contig_alloc, worth one NoC hop */
+#define ESP_ALLOC_HOP_COST 1024
+
+void *esp_alloc_near(const char *devname, size_t size)
+{
+	struct contig_alloc_params params;
+	char devclass[ESP_DEVNAME_MAX + 1];
+	struct esp_devinfo dev;
+	char *dot;
+
+	memset(&params, 0, sizeof(params));
+	params.policy = CONTIG_ALLOC_LEAST_BUSY;
+	params.pol.lbusy.y = -1;
+	params.pol.lbusy.x = -1;
+	params.pol.lbusy.hop_cost = ESP_ALLOC_HOP_COST;
+
+	/* instances are named <devclass>.<index> */
+	if (strlen(devname) <= ESP_DEVNAME_MAX) {
+		strcpy(devclass, devname);
+		strcpy(dev.name, devname);
+		dot = strrchr(devclass, '.');
+		if (dot != NULL)
+			*dot = '\0';
+		esp_read_devinfo(devclass, &dev);
+		params.pol.lbusy.y = dev.y;
+		params.pol.lbusy.x = dev.x;
+	}
+
+	return esp_alloc_policy(params, size);
+}
+
 void *esp_alloc(size_t size)
 {
-	contig_handle_t *handle = malloc(sizeof(contig_handle_t));
-	void* contig_ptr = contig_alloc(size, handle);
-	insert_buf(contig_ptr, handle, CONTIG_ALLOC_PREFERRED);
+	contig_handle_t handle;
+	void* contig_ptr = contig_alloc(size, &handle);
+	if (contig_ptr == NULL)
+		return NULL;
+	insert_buf(contig_ptr, size, handle, CONTIG_ALLOC_PREFERRED);
 	return contig_ptr;
 }
 
-static void esp_config(esp_thread_info_t* cfg[], unsigned nthreads, unsigned *nacc)
+void esp_config(esp_thread_info_t* cfg[], unsigned nthreads, unsigned *nacc)
 {
 	int i, j;
 	for (i = 0; i < nthreads; i++) {
@@ -175,17 +307,171 @@ static void esp_config(esp_thread_info_t* cfg[], unsigned nthreads, unsigned *na
 			if (!info->run)
 				continue;
 
-			enum contig_alloc_policy policy;
-			contig_handle_t *handle = lookup_handle(info->hw_buf, &policy);
-
-			(info->esp_desc)->contig = contig_to_khandle(*handle);
-			(info->esp_desc)->ddr_node = contig_to_most_allocated(*handle);
-			(info->esp_desc)->alloc_policy = policy;
+			unsigned long long start = esp_trace_on ? esp_trace_now() : 0;
+			struct esp_buf b;
+			size_t base;
+
+			if (!find_buf(info->hw_buf, false, &b))
+				die("buf not in active allocations\n");
+			if (esp_trace_on)
+				esp_trace_span("lookup", info->devname, start, esp_trace_now());
+
+			/* the offsets of esp_access are 32-bit */
+			base = (char *) info->hw_buf - (char *) b.buf;
+			if (base + info->src_offset > UINT32_MAX || base + info->dst_offset > UINT32_MAX)
+				die("%s: hw_buf lies beyond 4 GB into its buffer\n", info->devname);
+			(info->esp_desc)->contig = contig_to_khandle(b.handle);
+			(info->esp_desc)->ddr_node = contig_to_most_allocated(b.handle);
+			(info->esp_desc)->alloc_policy = b.policy;
+			(info->esp_desc)->src_offset = base + info->src_offset;
+			(info->esp_desc)->dst_offset = base + info->dst_offset;
 			(info->esp_desc)->run = true;
 		}
 	}
 }
 
+static struct esp_sched_param esp_sched;
+static bool esp_sched_set;
+
+void esp_set_sched(const struct esp_sched_param *param)
+{
+	esp_sched = *param;
+	__atomic_store_n(&esp_sched_set, true, __ATOMIC_RELEASE);
+}
+
+void esp_sched_apply(int fd, const char *devname)
+{
+	if (!__atomic_load_n(&esp_sched_set, __ATOMIC_ACQUIRE))
+		return;
+	if (ioctl(fd, ESP_IOC_SET_SCHED, &esp_sched))
+		fprintf(stderr, "libesp: cannot set scheduling parameters of %s: %s\n",
+			devname, strerror(errno));
+}
+
+struct esp_prepared {
+	esp_thread_info_t *info;
+	int fd;
+	unsigned int token;
+};
+
+esp_prepared_t *esp_prepare(esp_thread_info_t *info)
+{
+	struct esp_prepare_req req;
+	esp_prepared_t *prep;
+	unsigned nacc = 1;
+	char path[ESP_DEVNAME_MAX + sizeof("/dev/")];
+
+	if (strlen(info->devname) > ESP_DEVNAME_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	prep = malloc(sizeof(*prep));
+	if (prep == NULL)
+		return NULL;
+
+	info->run = true;
+	esp_config(&info, 1, &nacc);
+
+	sprintf(path, "/dev/%s", info->devname);
+	prep->fd = open(path, O_RDWR, 0);
+	if (prep->fd < 0)
+		goto err_open;
+	esp_sched_apply(prep->fd, info->devname);
+
+	req.access = info->esp_desc;
+	if (ioctl(prep->fd, ESP_IOC_PREPARE, &req))
+		goto err_ioctl;
+
+	prep->info = info;
+	prep->token = req.token;
+	return prep;
+
+err_ioctl:
+	close(prep->fd);
+err_open:
+	free(prep);
+	return NULL;
+}
+
+int esp_run_prepared(esp_prepared_t *prep)
+{
+	struct timespec th_start;
+	struct timespec th_end;
+	int rc;
+
+	gettime(&th_start);
+	rc = ioctl(prep->fd, ESP_IOC_RUN_PREPARED, &prep->token);
+	gettime(&th_end);
+
+	prep->info->hw_ns = ts_subtract(&th_start, &th_end);
+	if (esp_trace_on)
+		esp_trace_span("ioctl", prep->info->devname, getformattedtime(&th_start),
+			getformattedtime(&th_end));
+	return rc ? -1 : 0;
+}
+
+void esp_release_prepared(esp_prepared_t *prep)
+{
+	ioctl(prep->fd, ESP_IOC_RELEASE_PREPARED, &prep->token);
+	close(prep->fd);
+	free(prep);
+}
+
+int esp_run_chain(esp_thread_info_t *stages[], unsigned n)
+{
+	struct esp_chain_stage chain[ESP_CHAIN_MAX];
+	unsigned nacc[ESP_CHAIN_MAX];
+	struct esp_chain_req req;
+	struct timespec th_start;
+	struct timespec th_end;
+	char path[ESP_DEVNAME_MAX + sizeof("/dev/")];
+	unsigned i;
+	int fd, rc;
+
+	if (n == 0 || n > ESP_CHAIN_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(chain, 0, sizeof(chain));
+	for (i = 0; i < n; i++) {
+		/* the name goes to the driver in a fixed-size field */
+		if (strlen(stages[i]->devname) >= sizeof(chain[i].devname)) {
+			errno = EINVAL;
+			return -1;
+		}
+		strcpy(chain[i].devname, stages[i]->devname);
+		stages[i]->run = true;
+		nacc[i] = 1;
+	}
+	esp_config(stages, n, nacc);
+	for (i = 0; i < n; i++)
+		chain[i].access = stages[i]->esp_desc;
+
+	/* any accelerator takes the request: use the one of the first stage */
+	sprintf(path, "/dev/%s", stages[0]->devname);
+	fd = open(path, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+	esp_sched_apply(fd, stages[0]->devname);
+
+	req.stages = chain;
+	req.n = n;
+	req.n_done = 0;
+	gettime(&th_start);
+	rc = ioctl(fd, ESP_IOC_RUN_CHAIN, &req);
+	gettime(&th_end);
+	close(fd);
+
+	for (i = 0; i < n; i++)
+		stages[i]->hw_ns = chain[i].hw_ns;
+	if (esp_trace_on)
+		esp_trace_span("chain", stages[0]->devname, getformattedtime(&th_start),
+			getformattedtime(&th_end));
+	return rc ? -1 : 0;
+}
+
 static void print_time_info(esp_thread_info_t *info[], unsigned long long hw_ns, int nthreads, unsigned* nacc)
 {
 	int i, j;
@@ -230,6 +516,7 @@ void esp_run_parallel(esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nac
 	struct timespec th_start;
 	struct timespec th_end;
 	pthread_t *thread = malloc(nthreads * sizeof(pthread_t));
+	unsigned long long start;
 	int rc = 0;
 	esp_config(cfg, nthreads, nacc);
 	for (i = 0; i < nthreads; i++) {
@@ -237,23 +524,25 @@ void esp_run_parallel(esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nac
 		for (j = 0; j < len; j++) {
 			esp_thread_info_t *info = cfg[i] + j;
 			const char *prefix = "/dev/";
-			char path[70];
+			char path[ESP_DEVNAME_MAX + sizeof("/dev/")];
 
-			if (strlen(info->devname) > 64) {
-				contig_handle_t *handle = lookup_handle(info->hw_buf, NULL);
-				contig_free(*handle);
-				die("Error: device name %s exceeds maximum length of 64 characters\n",
-					info->devname);
+			if (strlen(info->devname) > ESP_DEVNAME_MAX) {
+				contig_free(lookup_handle(info->hw_buf, NULL));
+				die("Error: device name %s exceeds maximum length of %d characters\n",
+					info->devname, ESP_DEVNAME_MAX);
 			}
 
 			sprintf(path, "%s%s", prefix, info->devname);
 
+			start = esp_trace_on ? esp_trace_now() : 0;
 			info->fd = open(path, O_RDWR, 0);
 			if (info->fd < 0) {
-				contig_handle_t *handle = lookup_handle(info->hw_buf, NULL);
-				contig_free(*handle);
+				contig_free(lookup_handle(info->hw_buf, NULL));
 				die_errno("fopen failed\n");
 			}
+			esp_sched_apply(info->fd, info->devname);
+			if (esp_trace_on)
+				esp_trace_span("open", info->devname, start, esp_trace_now());
 		}
 	}
 
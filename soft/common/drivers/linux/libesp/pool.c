@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * pool.c
+ * Device pools. A pool gathers every instance of an accelerator class, e.g.
+ * /dev/fft_stratus.0 to /dev/fft_stratus.N, and dispatches each invocation
+ * to the instance with the fewest invocations in flight, breaking ties with
+ * the number of NoC hops between the instance and the DDR controller that
+ * holds most of the buffer.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "libesp.h"
+#include "session.h"
+
+#define ESP_POOL_MAX_DEVS	64
+
+struct esp_pool_dev {
+	struct esp_devinfo info;
+	unsigned inflight;
+};
+
+struct esp_pool {
+	esp_session_t *session;
+	int ddr_y[ESP_MAX_DDR_NODES];
+	int ddr_x[ESP_MAX_DDR_NODES];
+	unsigned nddr;
+	struct esp_pool_dev devs[ESP_POOL_MAX_DEVS];
+	unsigned ndevs;
+};
+
+/* Parse a comma-separated list of integers from a sysfs file */
+static unsigned read_int_list(const char *path, int *vals, unsigned max)
+{
+	char buf[128];
+	char *p = buf;
+	char *end;
+	unsigned n = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), fp) == NULL)
+		buf[0] = '\0';
+	fclose(fp);
+
+	while (n < max) {
+		long v = strtol(p, &end, 10);
+
+		if (end == p)
+			break;
+		vals[n++] = v;
+		p = end;
+		if (*p != ',')
+			break;
+		p++;
+	}
+	return n;
+}
+
+unsigned esp_read_ddr_tiles(int *ddr_y, int *ddr_x, unsigned max)
+{
+	unsigned ny, nx;
+
+	ny = read_int_list("/sys/module/contig_alloc/parameters/ddr_y", ddr_y, max);
+	nx = read_int_list("/sys/module/contig_alloc/parameters/ddr_x", ddr_x, max);
+	return ny == nx ? ny : 0;
+}
+
+void esp_read_devinfo(const char *devclass, struct esp_devinfo *dev)
+{
+	char path[2 * ESP_DEVNAME_MAX + 32];
+	FILE *fp;
+	int dpr;
+
+	dev->y = -1;
+	dev->x = -1;
+	dev->reconfigurable = false;
+
+	sprintf(path, "/sys/class/%s/%s/tile", devclass, dev->name);
+	fp = fopen(path, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%d %d", &dev->y, &dev->x) != 2) {
+			dev->y = -1;
+			dev->x = -1;
+		}
+		fclose(fp);
+	}
+
+	sprintf(path, "/sys/class/%s/%s/reconfigurable", devclass, dev->name);
+	fp = fopen(path, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%d", &dpr) == 1)
+			dev->reconfigurable = dpr;
+		fclose(fp);
+	}
+}
+
+static int esp_devinfo_cmp(const void *a, const void *b)
+{
+	const struct esp_devinfo *da = a;
+	const struct esp_devinfo *db = b;
+
+	return (int) da->index - (int) db->index;
+}
+
+unsigned esp_find_devices(const char *devclass, struct esp_devinfo *devs, unsigned max)
+{
+	size_t len = strlen(devclass);
+	struct dirent *ent;
+	unsigned n = 0;
+	DIR *dir;
+
+	if (len + 2 > ESP_DEVNAME_MAX)
+		return 0;
+
+	dir = opendir("/dev");
+	if (dir == NULL)
+		return 0;
+
+	/* instances are named <devclass>.<index> */
+	while ((ent = readdir(dir)) != NULL && n < max) {
+		struct esp_devinfo *dev = &devs[n];
+		const char *suffix = ent->d_name + len + 1;
+		char *end;
+
+		if (strncmp(ent->d_name, devclass, len) || ent->d_name[len] != '.')
+			continue;
+		if (strlen(ent->d_name) > ESP_DEVNAME_MAX)
+			continue;
+		dev->index = strtoul(suffix, &end, 10);
+		if (end == suffix || *end != '\0')
+			continue;
+
+		strcpy(dev->name, ent->d_name);
+		esp_read_devinfo(devclass, dev);
+		n++;
+	}
+	closedir(dir);
+
+	qsort(devs, n, sizeof(devs[0]), esp_devinfo_cmp);
+	return n;
+}
+
+esp_pool_t *esp_pool_open(const char *devclass)
+{
+	struct esp_devinfo devs[ESP_POOL_MAX_DEVS];
+	esp_pool_t *pool;
+	unsigned i;
+
+	if (strlen(devclass) + 2 > ESP_DEVNAME_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->ndevs = esp_find_devices(devclass, devs, ESP_POOL_MAX_DEVS);
+	if (pool->ndevs == 0) {
+		free(pool);
+		errno = ENODEV;
+		return NULL;
+	}
+	for (i = 0; i < pool->ndevs; i++)
+		pool->devs[i].info = devs[i];
+
+	pool->nddr = esp_read_ddr_tiles(pool->ddr_y, pool->ddr_x, ESP_MAX_DDR_NODES);
+
+	pool->session = esp_session_open(pool->ndevs);
+	if (pool->session == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+unsigned esp_pool_size(esp_pool_t *pool)
+{
+	return pool->ndevs;
+}
+
+static unsigned esp_pool_hops(esp_pool_t *pool, struct esp_pool_dev *dev, struct esp_access *desc)
+{
+	unsigned node = desc->ddr_node;
+
+	/* balanced and interleaved buffers are spread over every controller */
+	if (desc->alloc_policy == CONTIG_ALLOC_BALANCED || desc->alloc_policy == CONTIG_ALLOC_INTERLEAVED)
+		return 0;
+	if (dev->info.y < 0 || node >= pool->nddr)
+		return 0;
+	return abs(dev->info.y - pool->ddr_y[node]) + abs(dev->info.x - pool->ddr_x[node]);
+}
+
+static struct esp_pool_dev *esp_pool_pick(esp_pool_t *pool, struct esp_access *desc)
+{
+	struct esp_pool_dev *best = NULL;
+	unsigned best_inflight = 0;
+	unsigned best_hops = 0;
+	int i;
+
+	for (i = 0; i < pool->ndevs; i++) {
+		struct esp_pool_dev *dev = &pool->devs[i];
+		unsigned inflight = __atomic_load_n(&dev->inflight, __ATOMIC_RELAXED);
+		unsigned hops = esp_pool_hops(pool, dev, desc);
+
+		if (best == NULL || inflight < best_inflight ||
+			(inflight == best_inflight && hops < best_hops)) {
+			best = dev;
+			best_inflight = inflight;
+			best_hops = hops;
+		}
+	}
+	return best;
+}
+
+static void esp_pool_done(void *arg)
+{
+	struct esp_pool_dev *dev = arg;
+
+	__atomic_sub_fetch(&dev->inflight, 1, __ATOMIC_RELAXED);
+}
+
+esp_handle_t *esp_pool_submit(esp_pool_t *pool, esp_thread_info_t *info)
+{
+	esp_thread_info_t *cfg[1] = { info };
+	struct esp_pool_dev *dev;
+	esp_handle_t *handle;
+	unsigned nacc = 1;
+
+	if (thread_is_p2p(info)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	info->run = true;
+	esp_config(cfg, 1, &nacc);
+
+	dev = esp_pool_pick(pool, info->esp_desc);
+	__atomic_add_fetch(&dev->inflight, 1, __ATOMIC_RELAXED);
+	info->devname = dev->info.name;
+
+	handle = esp_session_enqueue(pool->session, cfg, 1, &nacc, esp_pool_done, dev);
+	if (handle == NULL)
+		__atomic_sub_fetch(&dev->inflight, 1, __ATOMIC_RELAXED);
+	return handle;
+}
+
+int esp_pool_run(esp_pool_t *pool, esp_thread_info_t *info)
+{
+	esp_handle_t *handle = esp_pool_submit(pool, info);
+
+	if (handle == NULL)
+		return -1;
+	return esp_wait(handle);
+}
+
+void esp_pool_close(esp_pool_t *pool)
+{
+	if (pool == NULL)
+		return;
+
+	esp_session_close(pool->session);
+	free(pool);
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * queue.c
+ * Invocations queued in the driver with ESP_IOC_SUBMIT. The status page the
+ * driver maps for each open device file tells how many of them completed,
+ * so that callers can poll one or many devices without system calls and
+ * only enter the driver to collect completions.
+ */
+
+#include <errno.h>
+
+#include "libesp.h"
+#include "session.h"
+#include "trace.h"
+
+struct esp_queue {
+	int fd;
+	const struct esp_status_page *status;
+	char devname[ESP_DEVNAME_MAX + 1];
+	unsigned long long submitted; /* tickets handed out */
+	unsigned long long reaped; /* completions collected from the driver */
+	unsigned long long errors; /* failures collected but not reported yet */
+};
+
+esp_queue_t *esp_queue_open(const char *devname)
+{
+	esp_queue_t *queue;
+	char path[ESP_DEVNAME_MAX + sizeof("/dev/")];
+	void *status;
+
+	if (strlen(devname) > ESP_DEVNAME_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	queue = calloc(1, sizeof(*queue));
+	if (queue == NULL)
+		return NULL;
+	strcpy(queue->devname, devname);
+
+	sprintf(path, "/dev/%s", devname);
+	queue->fd = open(path, O_RDWR, 0);
+	if (queue->fd < 0)
+		goto err_open;
+	esp_sched_apply(queue->fd, devname);
+
+	status = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, queue->fd, 0);
+	if (status == MAP_FAILED)
+		goto err_mmap;
+	queue->status = status;
+
+	return queue;
+
+err_mmap:
+	close(queue->fd);
+err_open:
+	free(queue);
+	return NULL;
+}
+
+unsigned long long esp_queue_submit(esp_queue_t *queue, esp_thread_info_t *info)
+{
+	struct esp_job_desc desc;
+	struct esp_submit_req req;
+	unsigned nacc = 1;
+	unsigned long long start = esp_trace_on ? esp_trace_now() : 0;
+
+	info->run = true;
+	esp_config(&info, 1, &nacc);
+
+	desc.access = info->esp_desc;
+	desc.tag = queue->submitted + 1;
+	req.jobs = &desc;
+	req.n = 1;
+	if (ioctl(queue->fd, ESP_IOC_SUBMIT, &req) || req.n_submitted != 1)
+		return 0;
+
+	if (esp_trace_on)
+		esp_trace_span("submit", queue->devname, start, esp_trace_now());
+	return ++queue->submitted;
+}
+
+/* Invocations completed so far, from a consistent snapshot of the status page */
+static unsigned long long esp_queue_completed(esp_queue_t *queue)
+{
+	const struct esp_status_page *status = queue->status;
+	unsigned long long completed;
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&status->seq, __ATOMIC_ACQUIRE);
+		completed = *(volatile const uint64_t *) &status->completed;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&status->seq, __ATOMIC_RELAXED));
+
+	return completed;
+}
+
+int esp_queue_done(esp_queue_t *queue, unsigned long long ticket)
+{
+	return ticket <= queue->reaped || esp_queue_completed(queue) >= ticket;
+}
+
+/* Collect completions from the driver until @ticket is one of them */
+static int esp_queue_reap(esp_queue_t *queue, unsigned long long ticket)
+{
+	struct esp_job_done done[ESP_QUEUE_DEPTH];
+	struct esp_reap_req req;
+	unsigned i;
+
+	while (queue->reaped < ticket) {
+		unsigned long long want = ticket - queue->reaped;
+
+		req.done = done;
+		req.n_max = ESP_QUEUE_DEPTH;
+		req.min_complete = want < ESP_QUEUE_DEPTH ? want : ESP_QUEUE_DEPTH;
+		if (ioctl(queue->fd, ESP_IOC_REAP, &req))
+			return -1;
+		if (req.n == 0) {
+			/* nothing in flight: the ticket was never submitted */
+			errno = EINVAL;
+			return -1;
+		}
+		for (i = 0; i < req.n; i++)
+			if (done[i].err)
+				queue->errors++;
+		queue->reaped += req.n;
+	}
+
+	return 0;
+}
+
+int esp_queue_wait(esp_queue_t *queue, unsigned long long ticket, unsigned spin_us)
+{
+	unsigned long long start = esp_trace_now();
+	unsigned long long deadline = start + spin_us * 1000ULL;
+
+	if (ticket > queue->submitted) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (!esp_queue_done(queue, ticket) && esp_trace_now() < deadline)
+		;
+
+	if (esp_queue_reap(queue, ticket))
+		return -1;
+
+	if (esp_trace_on)
+		esp_trace_span("wait", queue->devname, start, esp_trace_now());
+
+	if (queue->errors) {
+		queue->errors = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void esp_queue_close(esp_queue_t *queue)
+{
+	if (queue == NULL)
+		return;
+
+	esp_queue_reap(queue, queue->submitted);
+	munmap((void *) queue->status, getpagesize());
+	close(queue->fd);
+	free(queue);
+}
@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * session.c
+ * Persistent accelerator sessions. A session keeps the device files it has
+ * used open and owns a pool of worker threads, so that repeated invocations
+ * pay neither open()/close() nor pthread_create()/pthread_join().
+ * Submissions can also be asynchronous: esp_submit() returns a completion
+ * handle that can be waited on, polled, or watched through an eventfd.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "libesp.h"
+#include "session.h"
+#include "trace.h"
+
+#define ESP_SESSION_MAX_DEVS	64
+
+struct esp_session_dev {
+	char devname[ESP_DEVNAME_MAX + 1];
+	int fd;
+};
+
+struct esp_session_job;
+
+/* A task is a list of accelerators invoked back to back by one worker */
+struct esp_session_task {
+	esp_thread_info_t *info;
+	unsigned nacc;
+	bool p2p;
+	struct esp_session_job *job;
+	struct esp_session_task *next;
+};
+
+struct esp_session_job {
+	esp_session_t *session;
+	unsigned pending;
+	int rc;
+	int efd; /* created on demand by esp_handle_fd() */
+	void (*done)(void *arg);
+	void *done_arg;
+	struct esp_session_task tasks[];
+};
+
+struct esp_session {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct esp_session_task *head;
+	struct esp_session_task *tail;
+	pthread_t *workers;
+	unsigned nworkers;
+	/* P2P tasks queued or running: they must all be running at once */
+	unsigned p2p_inflight;
+	bool stop;
+	struct esp_session_dev devs[ESP_SESSION_MAX_DEVS];
+	unsigned ndevs;
+};
+
+static int esp_session_run_task(struct esp_session_task *task)
+{
+	int rc = 0;
+	int i;
+
+	for (i = 0; i < task->nacc; i++) {
+		esp_thread_info_t *info = task->info + i;
+		struct timespec th_start;
+		struct timespec th_end;
+
+		if (!info->run)
+			continue;
+
+		gettime(&th_start);
+		if (ioctl(info->fd, info->ioctl_req, info->esp_desc) < 0) {
+			perror("ioctl");
+			rc = -1;
+		}
+		gettime(&th_end);
+
+		info->hw_ns = ts_subtract(&th_start, &th_end);
+		if (esp_trace_on)
+			esp_trace_ioctl(info, getformattedtime(&th_start), getformattedtime(&th_end));
+	}
+	return rc;
+}
+
+static void esp_job_signal(struct esp_session_job *job)
+{
+	uint64_t val = 1;
+
+	if (write(job->efd, &val, sizeof(val)) != sizeof(val))
+		perror("eventfd write");
+}
+
+static void *esp_session_worker(void *ptr)
+{
+	esp_session_t *session = (esp_session_t *) ptr;
+	struct esp_session_task *task;
+	struct esp_session_job *job;
+	int rc;
+
+	pthread_mutex_lock(&session->lock);
+	for (;;) {
+		while (session->head == NULL && !session->stop)
+			pthread_cond_wait(&session->work_cond, &session->lock);
+		if (session->head == NULL)
+			break;
+
+		task = session->head;
+		session->head = task->next;
+		if (session->head == NULL)
+			session->tail = NULL;
+		pthread_mutex_unlock(&session->lock);
+
+		rc = esp_session_run_task(task);
+
+		pthread_mutex_lock(&session->lock);
+		job = task->job;
+		if (rc)
+			job->rc = rc;
+		if (task->p2p)
+			session->p2p_inflight--;
+		if (--job->pending == 0) {
+			if (job->done)
+				job->done(job->done_arg);
+			if (job->efd >= 0)
+				esp_job_signal(job);
+			pthread_cond_broadcast(&session->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&session->lock);
+
+	return NULL;
+}
+
+/* Called with session->lock held */
+static int esp_session_grow(esp_session_t *session, unsigned nworkers)
+{
+	pthread_t *workers;
+	int rc;
+
+	if (nworkers <= session->nworkers)
+		return 0;
+
+	workers = realloc(session->workers, nworkers * sizeof(pthread_t));
+	if (workers == NULL)
+		return -1;
+	session->workers = workers;
+
+	while (session->nworkers < nworkers) {
+		rc = pthread_create(&workers[session->nworkers], NULL, esp_session_worker, session);
+		if (rc != 0) {
+			errno = rc;
+			perror("pthread_create");
+			return session->nworkers ? 0 : -1;
+		}
+		session->nworkers++;
+	}
+	return 0;
+}
+
+esp_session_t *esp_session_open(unsigned nworkers)
+{
+	esp_session_t *session;
+	long ncpu;
+
+	if (nworkers == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nworkers = ncpu > 0 ? ncpu : 1;
+	}
+
+	session = calloc(1, sizeof(*session));
+	if (session == NULL)
+		return NULL;
+
+	pthread_mutex_init(&session->lock, NULL);
+	pthread_cond_init(&session->work_cond, NULL);
+	pthread_cond_init(&session->done_cond, NULL);
+
+	pthread_mutex_lock(&session->lock);
+	if (esp_session_grow(session, nworkers)) {
+		pthread_mutex_unlock(&session->lock);
+		esp_session_close(session);
+		return NULL;
+	}
+	pthread_mutex_unlock(&session->lock);
+
+	return session;
+}
+
+/* Return the cached file descriptor for devname, opening it on first use */
+static int esp_session_get_fd(esp_session_t *session, const char *devname)
+{
+	struct esp_session_dev *dev;
+	char path[ESP_DEVNAME_MAX + sizeof("/dev/")];
+	unsigned long long start = 0;
+	int fd;
+	int i;
+
+	if (strlen(devname) > ESP_DEVNAME_MAX) {
+		fprintf(stderr, "Error: device name %s exceeds maximum length of %d characters\n",
+			devname, ESP_DEVNAME_MAX);
+		return -1;
+	}
+
+	pthread_mutex_lock(&session->lock);
+	for (i = 0; i < session->ndevs; i++) {
+		if (!strcmp(session->devs[i].devname, devname)) {
+			fd = session->devs[i].fd;
+			pthread_mutex_unlock(&session->lock);
+			return fd;
+		}
+	}
+
+	if (session->ndevs == ESP_SESSION_MAX_DEVS) {
+		pthread_mutex_unlock(&session->lock);
+		fprintf(stderr, "Error: too many devices open in session\n");
+		return -1;
+	}
+
+	sprintf(path, "/dev/%s", devname);
+	if (esp_trace_on)
+		start = esp_trace_now();
+	fd = open(path, O_RDWR, 0);
+	if (fd < 0) {
+		pthread_mutex_unlock(&session->lock);
+		perror("open");
+		return -1;
+	}
+	if (esp_trace_on)
+		esp_trace_span("open", devname, start, esp_trace_now());
+	esp_sched_apply(fd, devname);
+
+	dev = &session->devs[session->ndevs++];
+	strcpy(dev->devname, devname);
+	dev->fd = fd;
+	pthread_mutex_unlock(&session->lock);
+
+	return fd;
+}
+
+struct esp_session_job *esp_session_enqueue(esp_session_t *session, esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc,
+					void (*done)(void *arg), void *done_arg)
+{
+	struct esp_session_job *job;
+	struct esp_session_task *task;
+	unsigned ntasks = 0;
+	unsigned np2p = 0;
+	int i, j;
+
+	esp_config(cfg, nthreads, nacc);
+
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; j < nacc[i]; j++) {
+			esp_thread_info_t *info = cfg[i] + j;
+
+			if (!info->run)
+				continue;
+			info->fd = esp_session_get_fd(session, info->devname);
+			if (info->fd < 0)
+				return NULL;
+		}
+		if (thread_is_p2p(cfg[i])) {
+			ntasks += nacc[i];
+			np2p += nacc[i];
+		} else {
+			ntasks++;
+		}
+	}
+
+	job = malloc(sizeof(*job) + ntasks * sizeof(struct esp_session_task));
+	if (job == NULL)
+		return NULL;
+	job->session = session;
+	job->pending = ntasks;
+	job->rc = 0;
+	job->efd = -1;
+	job->done = done;
+	job->done_arg = done_arg;
+
+	/* P2P stages are split in one task per accelerator, since they all
+	 * have to be running for any of them to complete. */
+	task = job->tasks;
+	for (i = 0; i < nthreads; i++) {
+		if (thread_is_p2p(cfg[i])) {
+			for (j = 0; j < nacc[i]; j++, task++) {
+				task->info = cfg[i] + j;
+				task->nacc = 1;
+				task->p2p = true;
+			}
+		} else {
+			task->info = cfg[i];
+			task->nacc = nacc[i];
+			task->p2p = false;
+			task++;
+		}
+	}
+
+	pthread_mutex_lock(&session->lock);
+	if (np2p) {
+		/* Guarantee progress of every P2P chain in flight */
+		if (esp_session_grow(session, session->p2p_inflight + np2p)) {
+			pthread_mutex_unlock(&session->lock);
+			free(job);
+			return NULL;
+		}
+		session->p2p_inflight += np2p;
+	}
+
+	for (i = 0; i < ntasks; i++) {
+		task = &job->tasks[i];
+		task->job = job;
+		task->next = NULL;
+		if (session->tail)
+			session->tail->next = task;
+		else
+			session->head = task;
+		session->tail = task;
+	}
+	pthread_cond_broadcast(&session->work_cond);
+	pthread_mutex_unlock(&session->lock);
+
+	return job;
+}
+
+esp_handle_t *esp_session_submit_parallel_async(esp_session_t *session, esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc)
+{
+	return esp_session_enqueue(session, cfg, nthreads, nacc, NULL, NULL);
+}
+
+esp_handle_t *esp_session_submit_async(esp_session_t *session, esp_thread_info_t cfg[], unsigned nacc)
+{
+	esp_thread_info_t *cfg_ptrs[1];
+
+	/* Same grouping as esp_run(): P2P stages run together, other
+	 * accelerators run concurrently and independently. */
+	if (thread_is_p2p(&cfg[0])) {
+		cfg_ptrs[0] = cfg;
+		return esp_session_enqueue(session, cfg_ptrs, 1, &nacc, NULL, NULL);
+	} else {
+		esp_thread_info_t *cfg_arr[nacc];
+		unsigned nacc_arr[nacc];
+		int i;
+
+		for (i = 0; i < nacc; i++) {
+			nacc_arr[i] = 1;
+			cfg_arr[i] = &cfg[i];
+		}
+		return esp_session_enqueue(session, cfg_arr, nacc, nacc_arr, NULL, NULL);
+	}
+}
+
+int esp_session_submit_parallel(esp_session_t *session, esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc)
+{
+	esp_handle_t *handle = esp_session_enqueue(session, cfg, nthreads, nacc, NULL, NULL);
+
+	if (handle == NULL)
+		return -1;
+	return esp_wait(handle);
+}
+
+int esp_session_submit(esp_session_t *session, esp_thread_info_t cfg[], unsigned nacc)
+{
+	esp_handle_t *handle = esp_session_submit_async(session, cfg, nacc);
+
+	if (handle == NULL)
+		return -1;
+	return esp_wait(handle);
+}
+
+void esp_session_close(esp_session_t *session)
+{
+	int i;
+
+	if (session == NULL)
+		return;
+
+	pthread_mutex_lock(&session->lock);
+	session->stop = true;
+	pthread_cond_broadcast(&session->work_cond);
+	pthread_mutex_unlock(&session->lock);
+
+	for (i = 0; i < session->nworkers; i++)
+		pthread_join(session->workers[i], NULL);
+
+	for (i = 0; i < session->ndevs; i++)
+		close(session->devs[i].fd);
+
+	pthread_cond_destroy(&session->done_cond);
+	pthread_cond_destroy(&session->work_cond);
+	pthread_mutex_destroy(&session->lock);
+	free(session->workers);
+	free(session);
+}
+
+/* Process-wide session backing esp_submit() */
+static esp_session_t *default_session;
+static pthread_once_t default_session_once = PTHREAD_ONCE_INIT;
+
+static void esp_default_session_init(void)
+{
+	default_session = esp_session_open(0);
+}
+
+static esp_session_t *esp_default_session(void)
+{
+	pthread_once(&default_session_once, esp_default_session_init);
+	return default_session;
+}
+
+esp_handle_t *esp_submit(esp_thread_info_t cfg[], unsigned nacc)
+{
+	esp_session_t *session = esp_default_session();
+
+	if (session == NULL)
+		return NULL;
+	return esp_session_submit_async(session, cfg, nacc);
+}
+
+esp_handle_t *esp_submit_parallel(esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc)
+{
+	esp_session_t *session = esp_default_session();
+
+	if (session == NULL)
+		return NULL;
+	return esp_session_enqueue(session, cfg, nthreads, nacc, NULL, NULL);
+}
+
+int esp_poll(esp_handle_t *handle)
+{
+	esp_session_t *session = handle->session;
+	int done;
+
+	pthread_mutex_lock(&session->lock);
+	done = handle->pending == 0;
+	pthread_mutex_unlock(&session->lock);
+
+	return done;
+}
+
+int esp_wait(esp_handle_t *handle)
+{
+	esp_session_t *session = handle->session;
+	int rc;
+
+	pthread_mutex_lock(&session->lock);
+	while (handle->pending)
+		pthread_cond_wait(&session->done_cond, &session->lock);
+	pthread_mutex_unlock(&session->lock);
+
+	rc = handle->rc;
+	if (handle->efd >= 0)
+		close(handle->efd);
+	free(handle);
+	return rc;
+}
+
+int esp_handle_fd(esp_handle_t *handle)
+{
+	esp_session_t *session = handle->session;
+	int fd;
+
+	pthread_mutex_lock(&session->lock);
+	if (handle->efd < 0) {
+		handle->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (handle->efd >= 0 && handle->pending == 0)
+			esp_job_signal(handle);
+	}
+	fd = handle->efd;
+	pthread_mutex_unlock(&session->lock);
+
+	return fd;
+}
+
+int esp_wait_any(esp_handle_t *handles[], unsigned n, int timeout_ms)
+{
+	struct pollfd fds[n];
+	int rc;
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (esp_poll(handles[i]))
+			return i;
+
+	for (i = 0; i < n; i++) {
+		fds[i].fd = esp_handle_fd(handles[i]);
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+		if (fds[i].fd < 0)
+			return -1;
+	}
+
+	do {
+		rc = poll(fds, n, timeout_ms);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc <= 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		if (fds[i].revents & POLLIN)
+			return i;
+	return -1;
+}
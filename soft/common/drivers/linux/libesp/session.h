@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __ESP_SESSION_H__
+#define __ESP_SESSION_H__
+
+#include <stdbool.h>
+
+#include "libesp.h"
+
+#define ESP_DEVNAME_MAX		64 /* longest device name, without the NUL */
+#define ESP_MAX_DDR_NODES	8
+
+/*
+ * Queue an invocation on a session. If done is not NULL, it is called by the
+ * worker that completes the invocation, with the session lock held, before
+ * any waiter is woken up.
+ */
+struct esp_session_job *esp_session_enqueue(esp_session_t *session, esp_thread_info_t* cfg[], unsigned nthreads, unsigned* nacc,
+					void (*done)(void *arg), void *done_arg);
+
+/* Apply the parameters of esp_set_sched(), if any, to a device file just opened */
+void esp_sched_apply(int fd, const char *devname);
+
+/* An accelerator instance, as exposed under /dev and /sys/class */
+struct esp_devinfo {
+	char name[ESP_DEVNAME_MAX + 1];
+	unsigned index;
+	int y;
+	int x; /* tile coordinates, -1 if unknown */
+	bool reconfigurable;
+};
+
+/*
+ * Fill devs with the /dev/<devclass>.<n> instances sorted by index and return
+ * how many were found.
+ */
+unsigned esp_find_devices(const char *devclass, struct esp_devinfo *devs, unsigned max);
+
+/* Read the tile and reconfigurable sysfs attributes of dev->name */
+void esp_read_devinfo(const char *devclass, struct esp_devinfo *dev);
+
+/* Read the DDR controller tiles passed to contig_alloc; returns their number */
+unsigned esp_read_ddr_tiles(int *ddr_y, int *ddr_x, unsigned max);
+
+#endif /* __ESP_SESSION_H__ */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * stream.c
+ * Software-pipelined streams of independent frames. A stream owns N buffers
+ * and as many copies of the accelerator configuration; while the accelerator
+ * processes frame k, the caller drains frame k - 1 and fills frame k + 1 in
+ * other buffers.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include "libesp.h"
+
+struct esp_stream {
+	esp_session_t *session;
+	unsigned nbufs;
+	size_t in_bytes;
+	void **bufs;
+	esp_thread_info_t *info;
+	char *descs;
+	esp_handle_t **handles;
+	struct esp_stream_stats stats;
+};
+
+esp_stream_t *esp_stream_open(esp_thread_info_t *info, size_t desc_size, unsigned nbufs,
+			size_t in_bytes, size_t out_bytes)
+{
+	esp_stream_t *stream;
+	unsigned i;
+
+	if (nbufs == 0 || desc_size < sizeof(struct esp_access) || thread_is_p2p(info)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	stream = calloc(1, sizeof(*stream));
+	if (stream == NULL)
+		return NULL;
+	stream->nbufs = nbufs;
+	stream->in_bytes = in_bytes;
+
+	stream->bufs = calloc(nbufs, sizeof(*stream->bufs));
+	stream->info = calloc(nbufs, sizeof(*stream->info));
+	stream->descs = calloc(nbufs, desc_size);
+	stream->handles = calloc(nbufs, sizeof(*stream->handles));
+	if (!stream->bufs || !stream->info || !stream->descs || !stream->handles)
+		goto err;
+
+	/* one worker: invocations run back to back, so the time each one
+	 * spends in the driver is time the accelerator was busy */
+	stream->session = esp_session_open(1);
+	if (stream->session == NULL)
+		goto err;
+
+	for (i = 0; i < nbufs; i++) {
+		char *desc = stream->descs + i * desc_size;
+
+		stream->bufs[i] = esp_alloc(in_bytes + out_bytes);
+		if (stream->bufs[i] == NULL)
+			goto err;
+		memcpy(desc, info->esp_desc, desc_size);
+		stream->info[i] = *info;
+		stream->info[i].run = true;
+		stream->info[i].hw_buf = stream->bufs[i];
+		stream->info[i].esp_desc = (struct esp_access *) desc;
+	}
+
+	return stream;
+
+err:
+	esp_stream_close(stream);
+	return NULL;
+}
+
+int esp_stream_run(esp_stream_t *stream, unsigned long long nframes,
+		esp_stream_fill_t fill, esp_stream_drain_t drain, void *arg)
+{
+	struct esp_stream_stats *stats = &stream->stats;
+	unsigned long long submitted = 0;
+	unsigned long long done = 0;
+	struct timespec th_start;
+	struct timespec th_end;
+	bool eos = false;
+	int rc = 0;
+
+	memset(stats, 0, sizeof(*stats));
+	gettime(&th_start);
+
+	for (;;) {
+		unsigned slot;
+
+		/* refill every free buffer while the accelerator works */
+		while (!eos && rc == 0 && submitted - done < stream->nbufs) {
+			int ret;
+
+			slot = submitted % stream->nbufs;
+			if (nframes && submitted == nframes) {
+				eos = true;
+				break;
+			}
+			ret = fill(stream->bufs[slot], submitted, arg);
+			if (ret) {
+				eos = true;
+				if (ret < 0)
+					rc = -1;
+				break;
+			}
+			stream->handles[slot] = esp_session_submit_async(stream->session, &stream->info[slot], 1);
+			if (stream->handles[slot] == NULL) {
+				rc = -1;
+				break;
+			}
+			submitted++;
+		}
+
+		if (done == submitted)
+			break;
+
+		slot = done % stream->nbufs;
+		if (esp_wait(stream->handles[slot]))
+			rc = -1;
+		stats->busy_ns += stream->info[slot].hw_ns;
+		if (rc == 0 && drain && drain((char *) stream->bufs[slot] + stream->in_bytes, done, arg))
+			rc = -1;
+		done++;
+	}
+
+	gettime(&th_end);
+	stats->frames = done;
+	stats->elapsed_ns = ts_subtract(&th_start, &th_end);
+	if (stats->elapsed_ns) {
+		stats->fps = (double) done * 1000000000.0 / stats->elapsed_ns;
+		stats->idle = 1.0 - (double) stats->busy_ns / stats->elapsed_ns;
+		if (stats->idle < 0)
+			stats->idle = 0;
+	}
+
+	return rc;
+}
+
+void esp_stream_get_stats(esp_stream_t *stream, struct esp_stream_stats *stats)
+{
+	*stats = stream->stats;
+}
+
+void esp_stream_close(esp_stream_t *stream)
+{
+	unsigned i;
+
+	if (stream == NULL)
+		return;
+
+	if (stream->session)
+		esp_session_close(stream->session);
+	if (stream->bufs)
+		for (i = 0; i < stream->nbufs; i++)
+			if (stream->bufs[i])
+				esp_free(stream->bufs[i]);
+	free(stream->handles);
+	free(stream->descs);
+	free(stream->info);
+	free(stream->bufs);
+	free(stream);
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * trace.c
+ * Per-invocation tracing. When ESP_TRACE names a file, every thread records
+ * the phases of its invocations in a private ring without locking, and the
+ * rings are written as Chrome trace-event JSON (chrome://tracing, Perfetto)
+ * at exit or by esp_trace_dump(). When ESP_TRACE is unset, each trace point
+ * costs one load and branch.
+ */
+
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "libesp.h"
+#include "trace.h"
+
+#define ESP_TRACE_EVENTS	4096
+#define ESP_TRACE_DEVNAME	24
+
+struct esp_trace_event {
+	unsigned long long ts;
+	unsigned long long dur;
+	const char *name;
+	pid_t tid;
+	char dev[ESP_TRACE_DEVNAME];
+};
+
+/*
+ * Rings outlive their thread so that its events can still be dumped; a
+ * ring whose thread exited is handed to the next thread that needs one.
+ */
+struct esp_trace_ring {
+	struct esp_trace_ring *next;
+	int owned;
+	unsigned long head; /* events ever written, published with release */
+	struct esp_trace_event events[ESP_TRACE_EVENTS];
+};
+
+int esp_trace_on;
+static char *esp_trace_path;
+static struct esp_trace_ring *esp_trace_rings;
+static pthread_key_t esp_trace_key;
+static __thread struct esp_trace_ring *esp_trace_ring;
+static __thread pid_t esp_trace_tid;
+
+static void esp_trace_thread_exit(void *arg)
+{
+	struct esp_trace_ring *ring = arg;
+
+	__atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static struct esp_trace_ring *esp_trace_get_ring(void)
+{
+	struct esp_trace_ring *ring;
+
+	if (esp_trace_ring)
+		return esp_trace_ring;
+
+	for (ring = __atomic_load_n(&esp_trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		int unowned = 0;
+
+		if (__atomic_compare_exchange_n(&ring->owned, &unowned, 1, false,
+							__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(*ring));
+		if (ring == NULL)
+			return NULL;
+		ring->owned = 1;
+		ring->next = __atomic_load_n(&esp_trace_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&esp_trace_rings, &ring->next, ring, true,
+							__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	esp_trace_ring = ring;
+	esp_trace_tid = syscall(SYS_gettid);
+	pthread_setspecific(esp_trace_key, ring);
+	return ring;
+}
+
+void esp_trace_span(const char *name, const char *dev, unsigned long long start, unsigned long long end)
+{
+	struct esp_trace_ring *ring;
+	struct esp_trace_event *ev;
+	unsigned long head;
+
+	if (!esp_trace_on)
+		return;
+
+	ring = esp_trace_get_ring();
+	if (ring == NULL)
+		return;
+
+	head = ring->head;
+	ev = &ring->events[head % ESP_TRACE_EVENTS];
+	ev->ts = start;
+	ev->dur = end > start ? end - start : 0;
+	ev->name = name;
+	ev->tid = esp_trace_tid;
+	if (dev) {
+		strncpy(ev->dev, dev, ESP_TRACE_DEVNAME - 1);
+		ev->dev[ESP_TRACE_DEVNAME - 1] = '\0';
+	} else {
+		ev->dev[0] = '\0';
+	}
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void esp_trace_ioctl(esp_thread_info_t *info, unsigned long long start, unsigned long long end)
+{
+	struct esp_access *desc = info->esp_desc;
+
+	if (!esp_trace_on)
+		return;
+
+	esp_trace_span("ioctl", info->devname, start, end);
+
+	/* the driver only reports timestamps for synchronous runs */
+	if (desc->ts_flush < start || desc->ts_done > end || desc->ts_run < desc->ts_flush ||
+		desc->ts_done < desc->ts_run)
+		return;
+
+	if (desc->ts_run > desc->ts_flush)
+		esp_trace_span("flush", info->devname, desc->ts_flush, desc->ts_run);
+	esp_trace_span("run", info->devname, desc->ts_run, desc->ts_done);
+	esp_trace_span("wakeup", info->devname, desc->ts_done, end);
+}
+
+int esp_trace_dump(const char *path)
+{
+	struct esp_trace_ring *ring;
+	bool first = true;
+	pid_t pid = getpid();
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return -1;
+
+	fprintf(fp, "{\"traceEvents\":[");
+	for (ring = __atomic_load_n(&esp_trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned long i = head > ESP_TRACE_EVENTS ? head - ESP_TRACE_EVENTS : 0;
+
+		/* events of running threads may be overwritten while we read */
+		for (; i < head; i++) {
+			struct esp_trace_event *ev = &ring->events[i % ESP_TRACE_EVENTS];
+
+			fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"esp\",\"ph\":\"X\","
+				"\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"dev\":\"%s\"}}",
+				first ? "" : ",", ev->name,
+				ev->ts / 1000, ev->ts % 1000, ev->dur / 1000, ev->dur % 1000,
+				pid, ev->tid, ev->dev);
+			first = false;
+		}
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	if (fclose(fp))
+		return -1;
+	return 0;
+}
+
+static void esp_trace_exit(void)
+{
+	if (esp_trace_dump(esp_trace_path))
+		fprintf(stderr, "libesp: cannot write trace to %s: %s\n", esp_trace_path, strerror(errno));
+}
+
+static void __attribute__((constructor)) esp_trace_init(void)
+{
+	const char *path = getenv("ESP_TRACE");
+
+	if (path == NULL || path[0] == '\0')
+		return;
+	esp_trace_path = strdup(path);
+	if (esp_trace_path == NULL)
+		return;
+	if (pthread_key_create(&esp_trace_key, esp_trace_thread_exit))
+		return;
+	atexit(esp_trace_exit);
+	esp_trace_on = 1;
+}
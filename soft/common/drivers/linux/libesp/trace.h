@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2011-2022 Columbia University, System Level Design Group
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __ESP_TRACE_H__
+#define __ESP_TRACE_H__
+
+#include "libesp.h"
+
+/* Set from the ESP_TRACE environment variable when the library is loaded */
+extern int esp_trace_on;
+
+static inline unsigned long long esp_trace_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return getformattedtime(&ts);
+}
+
+/* Record a phase of an invocation on dev that ran from start to end (ns) */
+void esp_trace_span(const char *name, const char *dev, unsigned long long start, unsigned long long end);
+
+/*
+ * Record an access ioctl on info that ran from start to end, together with
+ * the flush, run and wakeup phases reported by the driver.
+ */
+void esp_trace_ioctl(esp_thread_info_t *info, unsigned long long start, unsigned long long end);
+
+#endif /* __ESP_TRACE_H__ */
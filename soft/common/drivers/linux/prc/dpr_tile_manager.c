@@ -159,6 +159,7 @@ void load_driver(struct esp_driver *esp, int tile_num)
 	tiles[tile_num].esp_drv.prep_xfer	= esp->prep_xfer;
 	tiles[tile_num].esp_drv.ioctl_cm		= esp->ioctl_cm;
 	tiles[tile_num].esp_drv.arg_size		= esp->arg_size;
+	tiles[tile_num].esp_drv.xfer_window	= esp->xfer_window;
 	tiles[tile_num].esp_drv.dpr		= true;
 	//tiles[tile_num].esp_drv.esp		= &test_esp_device;
 
@@ -221,7 +222,7 @@ void tiles_setup(void)
 		strcpy(tiles[i].device_ids[2].compatible , "sld");
 		tiles[i].esp_drv.plat.driver.of_match_table = tiles[i].device_ids;
 
-		mutex_init(&tiles[i].esp_dev.dpr_lock);
+		esp_device_init(&tiles[i].esp_dev);
 		init_completion(&tiles[i].prc_completion);
 	}
 
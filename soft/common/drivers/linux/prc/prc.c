@@ -229,9 +229,11 @@ static long esp_prc_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 
 				tiles[pbs_entry->tile_id].next = pbs_entry; 
 
+				esp_device_quiesce(&tiles[user_pbs.pbs_tile_id].esp_dev);
 				mutex_lock(&tiles[user_pbs.pbs_tile_id].esp_dev.dpr_lock);
 				prc_reconfigure(pbs_entry);
 				mutex_unlock(&tiles[user_pbs.pbs_tile_id].esp_dev.dpr_lock);
+				esp_device_resume(&tiles[user_pbs.pbs_tile_id].esp_dev);
 			}
 
 			//Add to list:
@@ -255,6 +257,8 @@ static long esp_prc_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 
 					tiles[user_pbs.pbs_tile_id].next = pbs_entry;
 					pr_info(DRV_NAME ": unregistering %s\n", tiles[user_pbs.pbs_tile_id].curr->driver);
+					/* nothing may start on the tile until the new driver probed */
+					esp_device_quiesce(&tiles[user_pbs.pbs_tile_id].esp_dev);
 					wait_for_tile(user_pbs.pbs_tile_id);
 					mutex_lock(&tiles[user_pbs.pbs_tile_id].esp_dev.dpr_lock);
 					unload_driver(user_pbs.pbs_tile_id);
@@ -264,6 +268,7 @@ static long esp_prc_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 					prc_reconfigure(pbs_entry);
 					//pr_info("Please register %s\n", pbs_entry->esp_drv->plat.driver.name);
 					mutex_unlock(&tiles[user_pbs.pbs_tile_id].esp_dev.dpr_lock);
+					esp_device_resume(&tiles[user_pbs.pbs_tile_id].esp_dev);
 					return 0;
 				}
 			}
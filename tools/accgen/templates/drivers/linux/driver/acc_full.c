@@ -45,8 +45,8 @@ static void <accelerator_name>_prep_xfer(struct esp_device *esp, void *arg)
 	struct <acc_full_name>_access *a = arg;
 
 	/* <<--regs-config-->> */
-	iowrite32be(a->src_offset, esp->iomem + SRC_OFFSET_REG);
-	iowrite32be(a->dst_offset, esp->iomem + DST_OFFSET_REG);
+	iowrite32be(a->esp.src_offset + a->src_offset, esp->iomem + SRC_OFFSET_REG);
+	iowrite32be(a->esp.dst_offset + a->dst_offset, esp->iomem + DST_OFFSET_REG);
 
 }
 
@@ -107,6 +107,7 @@ static struct esp_driver <accelerator_name>_driver = {
 	.prep_xfer	= <accelerator_name>_prep_xfer,
 	.ioctl_cm	= <ACC_FULL_NAME>_IOC_ACCESS,
 	.arg_size	= sizeof(struct <acc_full_name>_access),
+	.xfer_window	= true,
 };
 
 static int __init <accelerator_name>_init(void)
@@ -123,6 +123,9 @@ LLC_CACHE_PIRQ = 4
 # Last-level cache I/O-bus slave indices (more indices can be reserved if necessary)
 LLC_CACHE_PINDEX = [16, 17, 18, 19]
 
+# Cache line size in bytes
+CACHE_LINE_BYTES = 16
+
 # ESP Tile CSRs APB indices
 CSR_PINDEX = list(range(20, 20 + NTILE_MAX))
 
@@ -2254,10 +2257,18 @@ def print_devtree(fp, soc, esp_config):
       fp.write("      reg = <0x0 0x" + address_str + " 0x0 0x" + size_str + ">;\n")
       fp.write("      reg-shift = <2>; // regs are spaced on 32 bit boundary\n")
       fp.write("      reg-io-width = <4>; // only 32-bit access are supported\n")
+      fp.write("      cache-level = <2>;\n")
+      fp.write("      cache-line-size = <" + str(CACHE_LINE_BYTES) + ">;\n")
+      fp.write("      cache-sets = <" + str(soc.l2_sets.get()) + ">;\n")
+      fp.write("      cache-size = <" + str(soc.l2_sets.get() * soc.l2_ways.get() * CACHE_LINE_BYTES) + ">;\n")
       fp.write("    };\n")
 
   # ESP LLC caches
   base = AHB2APB_HADDR[esp_config.cpu_arch] << 20
+  # RTL LLC sets are split across the banks, SystemC sets are per bank
+  llc_bank_sets = soc.llc_sets.get()
+  if soc.cache_rtl.get() == 1 and esp_config.nmem > 0:
+    llc_bank_sets = int(llc_bank_sets / esp_config.nmem)
   for i in range(esp_config.nllc):
     llc = esp_config.llcs[i]
     if llc.idx != -1:
@@ -2272,6 +2283,10 @@ def print_devtree(fp, soc, esp_config):
       fp.write("      reg = <0x0 0x" + address_str + " 0x0 0x" + size_str + ">;\n")
       fp.write("      reg-shift = <2>; // regs are spaced on 32 bit boundary\n")
       fp.write("      reg-io-width = <4>; // only 32-bit access are supported\n")
+      fp.write("      cache-level = <3>;\n")
+      fp.write("      cache-line-size = <" + str(CACHE_LINE_BYTES) + ">;\n")
+      fp.write("      cache-sets = <" + str(llc_bank_sets) + ">;\n")
+      fp.write("      cache-size = <" + str(llc_bank_sets * soc.llc_ways.get() * CACHE_LINE_BYTES) + ">;\n")
       fp.write("    };\n")
 
   # Reset all THIRDPARTY accelerators counters
@@ -2565,18 +2580,30 @@ def print_load_script(fp, soc, esp_config):
     fp.write(sizes[i])
     if i != nddr - 1:
         fp.write(",")
-    
-  fp.write(" chunk_log=20\n")
+
+  ddr_y = []
+  ddr_x = []
+  for m in esp_config.contig_alloc_ddr:
+    for t in esp_config.tiles:
+      if t.type == "mem" and t.mem_id == m:
+        ddr_y.append(str(t.row))
+        ddr_x.append(str(t.col))
+  if len(ddr_y) == nddr:
+    fp.write(" ddr_y=" + ",".join(ddr_y))
+    fp.write(" ddr_x=" + ",".join(ddr_x))
+    # DDR traffic for the least-busy placement policy
+    if soc.noc.monitor_ddr.get() or soc.noc.monitor_mem.get():
+      if esp_config.cpu_arch == "leon3":
+        fp.write(" mon_base=0x80090000")
+      else:
+        fp.write(" mon_base=0x60090000")
+      fp.write(" noc_cols=" + str(soc.noc.cols))
+
+  fp.write(" chunk_log=20 classes=24\n")
   fp.write("insmod esp_cache.ko\n")
   fp.write("insmod esp_private_cache.ko\n")
+  # cache geometry is read from the device tree
   fp.write("insmod esp.ko")
-  fp.write(" line_bytes=16")
-  fp.write(" l2_sets=" + str(soc.l2_sets.get()))
-  fp.write(" l2_ways=" + str(soc.l2_ways.get()))
-  fp.write(" llc_sets=" + str(soc.llc_sets.get()))
-  fp.write(" llc_ways=" + str(soc.llc_ways.get()))
-  fp.write(" llc_banks=" + str(nmem))
-  fp.write(" rtl_cache=" + str(soc.cache_rtl.get()))
   fp.write("\ninsmod dpr_tile_manager.ko");
   fp.write("\ninsmod prc.ko");
 